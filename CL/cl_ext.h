@@ -174,6 +174,335 @@ typedef cl_int (CL_CALLBACK * intercept_callback_fn)(cl_event, cl_int *);
 // </amd_internal>
 
 
+/****************************
+* cl_hsa_file_backed_buffer *
+****************************/
+#define cl_hsa_file_backed_buffer 1
+
+typedef cl_bitfield cl_file_buffer_flags_hsa;
+
+/* cl_file_buffer_flags_hsa */
+#define CL_FILE_BUFFER_POPULATE_HSA                 (1 << 0)    // Prefault the whole range at creation
+#define CL_FILE_BUFFER_SEQUENTIAL_HSA               (1 << 1)    // Aggressive readahead for sequential reads
+#define CL_FILE_BUFFER_STREAM_HSA                   (1 << 2)    // Keep only a sliding window resident
+
+extern CL_API_ENTRY cl_mem CL_API_CALL
+clCreateBufferFromFileHSA(cl_context                /* context */,
+                          cl_mem_flags              /* flags */,
+                          int                       /* fd */,
+                          cl_ulong                  /* offset */,
+                          size_t                    /* size */,
+                          cl_file_buffer_flags_hsa  /* file_flags */,
+                          size_t                    /* window_size */,
+                          cl_int *                  /* errcode_ret */) CL_EXT_SUFFIX__VERSION_1_1;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueAdvanceFileWindowHSA(cl_command_queue      /* command_queue */,
+                              cl_mem                /* buffer */,
+                              size_t                /* window_offset */,
+                              cl_uint               /* num_events_in_wait_list */,
+                              const cl_event *      /* event_wait_list */,
+                              cl_event *            /* event */) CL_EXT_SUFFIX__VERSION_1_1;
+
+/*************************
+* cl_hsa_queue_prefault *
+*************************/
+#define cl_hsa_queue_prefault 1
+
+/* cl_command_queue_properties */
+#define CL_QUEUE_PREFAULT_ENABLE_HSA                (1 << 16)   // Prefault kernel buffer args before dispatch
+#define CL_QUEUE_PREFAULT_MLOCK_HSA                 (1 << 17)   // Also lock the prefaulted pages in memory
+
+/* cl_command_queue_info */
+#define CL_QUEUE_PAGES_PREFAULTED_HSA               0x4100      // cl_ulong: non-resident pages faulted in by the host
+#define CL_QUEUE_PAGES_LOCKED_HSA                   0x4101      // cl_ulong: pages locked with mlock
+
+/**************************
+* cl_hsa_kernel_arg_info *
+**************************/
+#define cl_hsa_kernel_arg_info 1
+
+/* cl_kernel_arg_info */
+#define CL_KERNEL_ARG_SIZE_HSA                      0x4110      // size_t: bytes in the kernarg segment
+#define CL_KERNEL_ARG_ALIGNMENT_HSA                 0x4111      // size_t: required alignment
+#define CL_KERNEL_ARG_IS_POINTER_HSA                0x4112      // cl_bool: argument is a pointer
+
+/****************************
+* cl_hsa_thread_local_args *
+****************************/
+#define cl_hsa_thread_local_args 1
+
+/* cl_kernel_exec_info */
+#define CL_KERNEL_EXEC_INFO_THREAD_LOCAL_ARGS_HSA   0x4120      // cl_bool: arguments are per thread
+
+/**********************
+* cl_hsa_launch_plan *
+**********************/
+#define cl_hsa_launch_plan 1
+
+/* A kernel, its work sizes and its argument layout frozen into a prebuilt
+ * dispatch. Launching a plan copies the prebuilt queue entry and rings the
+ * doorbell; only argument values can be changed after creation.
+ */
+typedef struct _cl_launch_plan_hsa *        cl_launch_plan_hsa;
+
+extern CL_API_ENTRY cl_launch_plan_hsa CL_API_CALL
+clCreateLaunchPlanHSA(cl_command_queue  /* command_queue */,
+                      cl_kernel         /* kernel */,
+                      cl_uint           /* work_dim */,
+                      const size_t *    /* global_work_offset */,
+                      const size_t *    /* global_work_size */,
+                      const size_t *    /* local_work_size */,
+                      cl_int *          /* errcode_ret */) CL_EXT_SUFFIX__VERSION_1_1;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clSetLaunchPlanArgHSA(cl_launch_plan_hsa  /* plan */,
+                      cl_uint             /* arg_index */,
+                      size_t              /* arg_size */,
+                      const void *        /* arg_value */) CL_EXT_SUFFIX__VERSION_1_1;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueLaunchPlanHSA(cl_launch_plan_hsa  /* plan */,
+                       cl_uint             /* num_events_in_wait_list */,
+                       const cl_event *    /* event_wait_list */,
+                       cl_event *          /* event */) CL_EXT_SUFFIX__VERSION_1_1;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clReleaseLaunchPlanHSA(cl_launch_plan_hsa  /* plan */) CL_EXT_SUFFIX__VERSION_1_1;
+
+/*************************
+* cl_hsa_program_reload *
+*************************/
+#define cl_hsa_program_reload 1
+
+/* Replace the code of a program without restarting the process. The new
+ * kernels are read from the code-object file at code_object_path, or from
+ * the driver if it is NULL, into a fresh segment. Kernels of the program,
+ * and the kernels cloned from them, switch to the new code by name;
+ * dispatches already enqueued, and launch plans, keep running the old
+ * code, which is unmapped once nothing can use it any more.
+ */
+extern CL_API_ENTRY cl_int CL_API_CALL
+clReloadProgramHSA(cl_program    /* program */,
+                   const char *  /* code_object_path */) CL_EXT_SUFFIX__VERSION_1_1;
+
+/************************
+* cl_hsa_native_kernel *
+************************/
+#define cl_hsa_native_kernel 1
+
+/* Kernels for the CPU device are C functions registered by name. A program
+ * built for a CL_DEVICE_TYPE_CPU context finds them with clCreateKernel,
+ * and a launch calls the entry point once per work-item. args[i] points
+ * at the value of argument i as set with clSetKernelArg; for a __local
+ * argument it points at the address of the argument's local memory.
+ */
+typedef cl_bitfield cl_native_kernel_flags_hsa;
+
+/* cl_native_kernel_flags_hsa */
+#define CL_NATIVE_KERNEL_BARRIER_HSA                (1 << 0)    // Work-items call clWorkGroupBarrierHSA
+#define CL_NATIVE_KERNEL_CO_EXECUTE_HSA             (1 << 1)    // Launches may be split, see cl_hsa_co_execution
+
+typedef struct _cl_work_item_hsa {
+    cl_uint                 work_dim;
+    size_t                  global_id[3];
+    size_t                  local_id[3];
+    size_t                  group_id[3];
+    size_t                  global_size[3];
+    size_t                  local_size[3];
+    size_t                  num_groups[3];
+    size_t                  global_offset[3];
+    void *                  local_mem;  /* the kernel's static local memory */
+    void *                  group;      /* for clWorkGroupBarrierHSA */
+} cl_work_item_hsa;
+
+typedef void (CL_CALLBACK *cl_native_kernel_fn_hsa)(void ** /* args */,
+                                                    const cl_work_item_hsa * /* item */);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clRegisterNativeKernelHSA(const char *                /* kernel_name */,
+                          cl_native_kernel_fn_hsa     /* entry */,
+                          cl_uint                     /* num_args */,
+                          size_t                      /* local_mem_size */,
+                          cl_native_kernel_flags_hsa  /* flags */) CL_EXT_SUFFIX__VERSION_1_1;
+
+extern CL_API_ENTRY void CL_API_CALL
+clWorkGroupBarrierHSA(const cl_work_item_hsa *  /* item */) CL_EXT_SUFFIX__VERSION_1_1;
+
+/***********************
+* cl_hsa_co_execution *
+***********************/
+#define cl_hsa_co_execution 1
+
+/* On a GPU queue created with CL_QUEUE_CO_EXECUTE_HSA, a launch of a
+ * kernel that also has a native kernel of the same name registered with
+ * CL_NATIVE_KERNEL_CO_EXECUTE_HSA is split along its last dimension at a
+ * work-group boundary. The GPU runs the leading part and the CPU device
+ * the rest. Both parts see the global and group IDs of the whole
+ * NDRange, and the CPU part sees its global size and number of groups
+ * too, but the GPU part's get_global_size and get_num_groups of the last
+ * dimension cover its own part only: a kernel registered with the flag
+ * must not read them. The split follows the throughput each device was
+ * measured at on earlier launches of the kernel. A split launch waits for
+ * the commands before it, and the launches after it wait for its CPU part.
+ */
+
+/* cl_command_queue_properties */
+#define CL_QUEUE_CO_EXECUTE_HSA                     (1 << 18)   // Split launches between the GPU and the CPU
+
+/**********************
+* cl_hsa_tiled_image *
+**********************/
+#define cl_hsa_tiled_image 1
+
+/* Image storage is split into tiles of 8x8 texels. Tiles are laid out in
+ * row-major order within each slice, and the texels of a tile follow a
+ * Morton (Z-order) curve, so the 2x2 neighbourhood of any even texel is
+ * contiguous. The cl_mem handle of an image points at this descriptor,
+ * which is what a kernel receives for an image argument. Texel (x, y, z)
+ * lives at
+ *
+ *   data + z * slice_size
+ *        + ((y >> 3) * tiles_per_row + (x >> 3)) * tile_size
+ *        + morton(x & 7, y & 7) * element_size
+ *
+ * where morton() interleaves the bits of x (even bits) and y (odd bits).
+ *
+ * There are no samplers, so kernels address texels themselves, and the
+ * device does not report core image support: CL_DEVICE_IMAGE_SUPPORT is
+ * CL_FALSE. The image argument limits it reports apply to descriptors.
+ */
+#define CL_IMAGE_TILE_LOG2_HSA                      3
+
+typedef struct _cl_image_layout_hsa {
+    cl_ulong                data;
+    cl_ulong                tile_size;
+    cl_ulong                slice_size;
+    cl_uint                 width;
+    cl_uint                 height;
+    cl_uint                 depth;
+    cl_uint                 element_size;
+    cl_uint                 tiles_per_row;
+    cl_uint                 tiles_per_column;
+    cl_channel_order        channel_order;
+    cl_channel_type         channel_data_type;
+} cl_image_layout_hsa;
+
+/**********************************************
+* OpenCL 2.0 shared virtual memory            *
+* (ahead of the 2.0 headers for this runtime) *
+**********************************************/
+#ifndef CL_VERSION_2_0
+typedef cl_bitfield cl_svm_mem_flags;
+typedef cl_bitfield cl_device_svm_capabilities;
+typedef cl_uint     cl_kernel_exec_info;
+
+/* cl_svm_mem_flags */
+#define CL_MEM_SVM_FINE_GRAIN_BUFFER                (1 << 10)
+#define CL_MEM_SVM_ATOMICS                          (1 << 11)
+
+/* cl_device_info */
+#define CL_DEVICE_SVM_CAPABILITIES                  0x1053
+
+/* cl_device_svm_capabilities */
+#define CL_DEVICE_SVM_COARSE_GRAIN_BUFFER           (1 << 0)
+#define CL_DEVICE_SVM_FINE_GRAIN_BUFFER             (1 << 1)
+#define CL_DEVICE_SVM_FINE_GRAIN_SYSTEM             (1 << 2)
+#define CL_DEVICE_SVM_ATOMICS                       (1 << 3)
+
+/* cl_kernel_exec_info */
+#define CL_KERNEL_EXEC_INFO_SVM_PTRS                0x11B6
+#define CL_KERNEL_EXEC_INFO_SVM_FINE_GRAIN_SYSTEM   0x11B7
+
+/* cl_command_type */
+#define CL_COMMAND_SVM_FREE                         0x1209
+#define CL_COMMAND_SVM_MEMCPY                       0x120A
+#define CL_COMMAND_SVM_MEMFILL                      0x120B
+#define CL_COMMAND_SVM_MAP                          0x120C
+#define CL_COMMAND_SVM_UNMAP                        0x120D
+
+extern CL_API_ENTRY void * CL_API_CALL
+clSVMAlloc(cl_context       /* context */,
+           cl_svm_mem_flags /* flags */,
+           size_t           /* size */,
+           cl_uint          /* alignment */) CL_API_SUFFIX__VERSION_1_2;
+
+extern CL_API_ENTRY void CL_API_CALL
+clSVMFree(cl_context        /* context */,
+          void *            /* svm_pointer */) CL_API_SUFFIX__VERSION_1_2;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clSetKernelArgSVMPointer(cl_kernel    /* kernel */,
+                         cl_uint      /* arg_index */,
+                         const void * /* arg_value */) CL_API_SUFFIX__VERSION_1_2;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clSetKernelExecInfo(cl_kernel            /* kernel */,
+                    cl_kernel_exec_info  /* param_name */,
+                    size_t               /* param_value_size */,
+                    const void *         /* param_value */) CL_API_SUFFIX__VERSION_1_2;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueSVMFree(cl_command_queue  /* command_queue */,
+                 cl_uint           /* num_svm_pointers */,
+                 void *[]          /* svm_pointers[] */,
+                 void (CL_CALLBACK * /*pfn_free_func*/)(cl_command_queue /* queue */,
+                                                        cl_uint          /* num_svm_pointers */,
+                                                        void *[]         /* svm_pointers[] */,
+                                                        void *           /* user_data */),
+                 void *            /* user_data */,
+                 cl_uint           /* num_events_in_wait_list */,
+                 const cl_event *  /* event_wait_list */,
+                 cl_event *        /* event */) CL_API_SUFFIX__VERSION_1_2;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueSVMMemcpy(cl_command_queue  /* command_queue */,
+                   cl_bool           /* blocking_copy */,
+                   void *            /* dst_ptr */,
+                   const void *      /* src_ptr */,
+                   size_t            /* size */,
+                   cl_uint           /* num_events_in_wait_list */,
+                   const cl_event *  /* event_wait_list */,
+                   cl_event *        /* event */) CL_API_SUFFIX__VERSION_1_2;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueSVMMemFill(cl_command_queue  /* command_queue */,
+                    void *            /* svm_ptr */,
+                    const void *      /* pattern */,
+                    size_t            /* pattern_size */,
+                    size_t            /* size */,
+                    cl_uint           /* num_events_in_wait_list */,
+                    const cl_event *  /* event_wait_list */,
+                    cl_event *        /* event */) CL_API_SUFFIX__VERSION_1_2;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueSVMMap(cl_command_queue  /* command_queue */,
+                cl_bool           /* blocking_map */,
+                cl_map_flags      /* flags */,
+                void *            /* svm_ptr */,
+                size_t            /* size */,
+                cl_uint           /* num_events_in_wait_list */,
+                const cl_event *  /* event_wait_list */,
+                cl_event *        /* event */) CL_API_SUFFIX__VERSION_1_2;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueSVMUnmap(cl_command_queue  /* command_queue */,
+                  void *            /* svm_ptr */,
+                  cl_uint           /* num_events_in_wait_list */,
+                  const cl_event *  /* event_wait_list */,
+                  cl_event *        /* event */) CL_API_SUFFIX__VERSION_1_2;
+#endif /* CL_VERSION_2_0 */
+
+/**********************************************
+* OpenCL 2.1 kernel cloning                   *
+* (ahead of the 2.1 headers for this runtime) *
+**********************************************/
+#ifndef CL_VERSION_2_1
+extern CL_API_ENTRY cl_kernel CL_API_CALL
+clCloneKernel(cl_kernel     /* source_kernel */,
+              cl_int *      /* errcode_ret */) CL_API_SUFFIX__VERSION_1_2;
+#endif /* CL_VERSION_2_1 */
+
 #ifdef CL_VERSION_1_1
    /***********************************
     * cl_ext_device_fission extension *
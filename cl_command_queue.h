@@ -36,19 +36,92 @@
 #ifndef __CL_COMMAND_QUEUE_HH__
 #define __CL_COMMAND_QUEUE_HH__
 
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
+#include <mutex>
+#include <vector>
+
+// Used in qstruct.h
+typedef uint64_t Addr;
+
+#include "qstruct.hh"
+
+class _cl_event;
+
+static const uint32_t SUBMIT_RING_SIZE = 64;
+
+// One slot of a queue's submission ring. seq holds the ring position the
+// slot is free for; the producer that reserved position p copies its entry
+// into the slot and stores p + 1 to commit it, and the publisher stores
+// p + SUBMIT_RING_SIZE once the entry has gone to the dispatcher. The
+// slot holds its own copy, so the producer's entry may be freed, with its
+// event, while the slot still waits to be published.
+struct submitSlot {
+    std::atomic<uint64_t> seq;
+    HsaQueueEntry entry;
+};
 
 class _cl_command_queue {
   public:
-    _cl_command_queue()
+    _cl_command_queue(cl_context ctx, cl_device_id dev,
+                      cl_command_queue_properties props)
+        : context(ctx), device(dev), properties(props), pagesPrefaulted(0),
+          pagesLocked(0), hostDispLeft(0), drainedEpoch(0),
+          coLastGpu(nullptr), ringTail(0), ringHead(0),
+          ringPublishing(false)
     {
         numDispLeft = (volatile uint32_t*)calloc(1, sizeof(uint32_t));
         *numDispLeft = 0;
+
+        for (uint32_t i = 0; i < SUBMIT_RING_SIZE; ++i) {
+            ring[i].seq = i;
+        }
     }
 
     cl_uint ID;
     volatile uint32_t *numDispLeft;
+
+    cl_context context;
+    cl_device_id device;
+    cl_command_queue_properties properties;
+
+    // pre-dispatch prefault statistics, bumped by every submitting thread
+    std::atomic<uint64_t> pagesPrefaulted;
+    std::atomic<uint64_t> pagesLocked;
+
+    // launches run by the CPU device for this queue, its own or the CPU
+    // parts of co-executed launches; the dispatcher never sees them
+    std::atomic<uint32_t> hostDispLeft;
+
+    // every launch from an API call that entered before this descriptor
+    // epoch had completed by the end of the last clFinish
+    std::atomic<uint64_t> drainedEpoch;
+
+    // private and spill scratch of the launches enqueued without an event,
+    // which no event release frees; clFinish frees it once they are done.
+    // Guarded by scratchLock.
+    std::vector<void*> scratch;
+    std::mutex scratchLock;
+
+    // Co-execution queues: the event of the GPU dispatch committed last,
+    // which the CPU part of the next split launch starts after, and the
+    // earlier ones that were not done yet when it was replaced. The queue
+    // holds a reference to each until it sees them done, or clFinish.
+    // Guarded by coLock.
+    _cl_event *coLastGpu;
+    std::vector<_cl_event*> coRetired;
+    std::mutex coLock;
+
+    // Multi-producer submission ring. Producers reserve a position with a
+    // fetch-add on ringTail and commit their slot; whichever thread holds
+    // ringPublishing hands committed slots to the dispatcher in position
+    // order and advances ringHead. The slots keep the producers' and the
+    // publisher's counters off each other's cache lines.
+    std::atomic<uint64_t> ringTail;
+    submitSlot ring[SUBMIT_RING_SIZE];
+    std::atomic<uint64_t> ringHead;
+    std::atomic<bool> ringPublishing;
 };
 
 #endif // __CL_COMMAND_QUEUE_HH__
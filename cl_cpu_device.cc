@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2011-2015 Advanced Micro Devices, Inc.
+ * All rights reserved.
+ *
+ * For use for simulation and test purposes only
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "cl_cpu_device.h"
+
+// How often idle workers look at the launches waiting to be joined.
+static const std::chrono::microseconds CPU_JOIN_POLL(50);
+
+thread_local cpuDevice::worker *cpuDevice::self = nullptr;
+
+static uint64_t
+nowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned
+cpuDevice::workerCount()
+{
+    unsigned num_workers = std::thread::hardware_concurrency();
+    const char *threads = getenv("HSA_CPU_THREADS");
+
+    if (threads && atoi(threads) > 0) {
+        num_workers = atoi(threads);
+    }
+
+    return num_workers ? num_workers : 1;
+}
+
+cpuDevice *
+cpuDevice::get()
+{
+    // never destroyed; idle workers sleep through process exit
+    static cpuDevice *device = new cpuDevice(workerCount());
+
+    return device;
+}
+
+cpuDevice::cpuDevice(unsigned num_workers)
+    : available(0), sleeping(0), pendingJoins(0), nextSeq(0)
+{
+    workers.resize(num_workers);
+
+    for (unsigned i = 0; i < num_workers; ++i) {
+        worker *w = new worker();
+        w->index = i;
+        if (posix_memalign((void**)&w->groupMem, 64, MAX_LDS_SIZE)) {
+            clFatal("cpuDevice: cannot allocate group memory");
+        }
+        w->argsSeq = ~0ULL;
+        w->current = nullptr;
+        w->launch = nullptr;
+        workers[i] = w;
+    }
+
+    // workers steal from each other, so start them once all exist
+    for (unsigned i = 0; i < num_workers; ++i) {
+        workers[i]->thread = std::thread(&cpuDevice::run, this,
+                                         std::ref(*workers[i]));
+    }
+}
+
+void
+cpuDevice::submit(cpuLaunch *launch)
+{
+    launch->seq = nextSeq++;
+    launch->totalGroups = launch->numGroups[0] * launch->numGroups[1] *
+                          launch->numGroups[2];
+    // enough ranges per worker to even out groups of uneven cost
+    launch->grain = std::max<size_t>(1, launch->totalGroups /
+                                        (16 * workers.size()));
+    launch->groupsLeft = launch->totalGroups;
+    launch->next = nullptr;
+
+    // the application may release the event before the launch finishes
+    if (launch->event) {
+        clRetainEvent(launch->event);
+    }
+
+    ++*launch->dispLeft;
+
+    {
+        std::lock_guard<std::mutex> guard(chainLock);
+        cpuLaunch *&tail = queueTail[launch->queue];
+
+        if (tail) {
+            // started by finish() once the queue gets to it
+            tail->next = launch;
+            tail = launch;
+            return;
+        }
+
+        tail = launch;
+    }
+
+    start(launch);
+}
+
+// Start a launch the queue has got to, once its startAfter event is done.
+void
+cpuDevice::start(cpuLaunch *launch)
+{
+    launch->startNs = nowNs();
+    launch->joinNs = 0;
+    launch->parked = false;
+    if (launch->joinFlag) {
+        std::lock_guard<std::mutex> guard(joinLock);
+        joins.push_back(launch);
+        ++pendingJoins;
+    }
+
+    if (launch->onStart) {
+        launch->onStart(launch);
+    }
+
+    if (launch->startAfter &&
+        !__atomic_load_n(&launch->startAfter->done, __ATOMIC_ACQUIRE)) {
+        {
+            // pollJoins begins it
+            std::lock_guard<std::mutex> guard(joinLock);
+            gated.push_back(launch);
+            ++pendingJoins;
+        }
+
+        if (sleeping) {
+            wakeIdle();
+        }
+        return;
+    }
+
+    begin(launch);
+}
+
+// Hand the groups of a launch to the workers, a contiguous share each.
+void
+cpuDevice::begin(cpuLaunch *launch)
+{
+    DPRINT("cpuDevice: launching %d groups\n", (int)launch->totalGroups);
+
+    if (launch->startAfter) {
+        clReleaseEvent(launch->startAfter);
+        launch->startAfter = nullptr;
+    }
+
+    launch->beginNs = nowNs();
+    if (launch->event) {
+        launch->event->start = launch->beginNs;
+    }
+
+    if (!launch->totalGroups) {
+        complete(launch);
+        return;
+    }
+
+    size_t shares = std::min<size_t>(launch->totalGroups, workers.size());
+
+    for (size_t i = 0; i < shares; ++i) {
+        task t = { launch, launch->totalGroups * i / shares,
+                   launch->totalGroups * (i + 1) / shares };
+        push(*workers[i], t);
+    }
+}
+
+// The groups of a launch are done; finish it unless it still waits for
+// its join flag.
+void
+cpuDevice::complete(cpuLaunch *launch)
+{
+    launch->endNs = nowNs();
+
+    if (launch->joinFlag) {
+        std::lock_guard<std::mutex> guard(joinLock);
+
+        if (!launch->joinNs) {
+            if (!*launch->joinFlag) {
+                // pollJoins finishes it
+                launch->parked = true;
+                return;
+            }
+
+            launch->joinNs = launch->endNs;
+            unwatch(launch);
+        }
+    }
+
+    finish(launch);
+}
+
+// Stop polling the join flag of a launch. The caller holds joinLock.
+void
+cpuDevice::unwatch(cpuLaunch *launch)
+{
+    for (size_t i = 0; i < joins.size(); ++i) {
+        if (joins[i] == launch) {
+            joins[i] = joins.back();
+            joins.pop_back();
+            --pendingJoins;
+            return;
+        }
+    }
+}
+
+void
+cpuDevice::pollJoins()
+{
+    std::vector<cpuLaunch*> ready;
+    std::vector<cpuLaunch*> joined;
+
+    {
+        std::lock_guard<std::mutex> guard(joinLock);
+
+        for (size_t i = 0; i < gated.size();) {
+            cpuLaunch *launch = gated[i];
+
+            if (__atomic_load_n(&launch->startAfter->done,
+                                __ATOMIC_ACQUIRE)) {
+                ready.push_back(launch);
+                gated[i] = gated.back();
+                gated.pop_back();
+                --pendingJoins;
+            } else {
+                ++i;
+            }
+        }
+
+        for (size_t i = 0; i < joins.size();) {
+            cpuLaunch *launch = joins[i];
+
+            if (*launch->joinFlag) {
+                launch->joinNs = nowNs();
+                if (launch->parked) {
+                    joined.push_back(launch);
+                }
+                unwatch(launch);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    for (auto launch : ready) {
+        begin(launch);
+    }
+
+    for (auto launch : joined) {
+        finish(launch);
+    }
+}
+
+void
+cpuDevice::finish(cpuLaunch *launch)
+{
+    cpuLaunch *next;
+
+    {
+        std::lock_guard<std::mutex> guard(chainLock);
+        next = launch->next;
+        if (!next) {
+            queueTail.erase(launch->queue);
+        }
+    }
+
+    if (launch->onFinish) {
+        launch->onFinish(launch);
+    }
+
+    if (launch->event) {
+        launch->event->end = nowNs();
+        __atomic_store_n(&launch->event->done, true, __ATOMIC_RELEASE);
+        clReleaseEvent(launch->event);
+    }
+
+    // the next launch was counted when it was submitted, so the queue
+    // does not look idle in between
+    --*launch->dispLeft;
+    delete launch;
+
+    if (next) {
+        start(next);
+    }
+}
+
+void
+cpuDevice::wakeIdle()
+{
+    // taking the lock orders this after a worker's check of available
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+    }
+
+    idleCv.notify_all();
+}
+
+void
+cpuDevice::push(worker &w, const task &t)
+{
+    {
+        std::lock_guard<std::mutex> guard(w.lock);
+        w.tasks.push_back(t);
+    }
+
+    ++available;
+    if (sleeping) {
+        wakeIdle();
+    }
+}
+
+// The owner runs its newest range, the groups next to the ones it just
+// ran.
+bool
+cpuDevice::pop(worker &w, task &t)
+{
+    std::lock_guard<std::mutex> guard(w.lock);
+
+    if (w.tasks.empty()) {
+        return false;
+    }
+
+    t = w.tasks.back();
+    w.tasks.pop_back();
+    --available;
+
+    return true;
+}
+
+// A thief takes the oldest range of the next worker that has one, which
+// is the largest that worker left.
+bool
+cpuDevice::steal(worker &w, task &t)
+{
+    for (size_t i = 1; i < workers.size(); ++i) {
+        worker &victim = *workers[(w.index + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+
+        if (!victim.tasks.empty()) {
+            t = victim.tasks.front();
+            victim.tasks.pop_front();
+            --available;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+cpuDevice::run(worker &w)
+{
+    self = &w;
+
+    for (;;) {
+        task t;
+
+        if (pendingJoins) {
+            pollJoins();
+        }
+
+        if (pop(w, t) || steal(w, t)) {
+            runTask(w, t);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(idleLock);
+        ++sleeping;
+        if (pendingJoins) {
+            // nobody signals a join flag, so wake up to look
+            idleCv.wait_for(guard, CPU_JOIN_POLL,
+                            [this] { return available > 0; });
+        } else {
+            // or for a launch gated since
+            idleCv.wait(guard, [this] {
+                return available > 0 || pendingJoins > 0;
+            });
+        }
+        --sleeping;
+    }
+}
+
+void
+cpuDevice::runTask(worker &w, task t)
+{
+    cpuLaunch *launch = t.launch;
+
+    // keep the lower half, leave the upper half for thieves
+    while (t.end - t.begin > launch->grain) {
+        size_t mid = t.begin + (t.end - t.begin) / 2;
+        task upper = { launch, mid, t.end };
+
+        push(w, upper);
+        t.end = mid;
+    }
+
+    for (size_t group = t.begin; group < t.end; ++group) {
+        runGroup(w, launch, group);
+    }
+
+    size_t ran = t.end - t.begin;
+    if (launch->groupsLeft.fetch_sub(ran) == ran) {
+        complete(launch);
+    }
+}
+
+void
+cpuDevice::runGroup(worker &w, cpuLaunch *launch, size_t group)
+{
+    if (w.argsSeq != launch->seq) {
+        size_t num_args = launch->argOffset.size();
+
+        w.args.resize(num_args);
+        w.localArgs.resize(num_args);
+
+        for (size_t i = 0; i < num_args; ++i) {
+            if (launch->localOffset[i] >= 0) {
+                w.localArgs[i] = w.groupMem + launch->localOffset[i];
+                w.args[i] = &w.localArgs[i];
+            } else {
+                w.args[i] = launch->argData.data() + launch->argOffset[i];
+            }
+        }
+
+        w.argsSeq = launch->seq;
+    }
+
+    cl_work_item_hsa item;
+    size_t items = 1;
+    size_t rest = group;
+
+    item.work_dim = launch->workDim;
+    item.local_mem = w.groupMem;
+
+    for (int d = 0; d < 3; ++d) {
+        item.group_id[d] = launch->firstGroup[d] +
+                           rest % launch->numGroups[d];
+        rest /= launch->numGroups[d];
+
+        item.global_size[d] = launch->globalSize[d];
+        item.global_offset[d] = launch->globalOffset[d];
+        item.num_groups[d] = (launch->globalSize[d] +
+                              launch->localSize[d] - 1) /
+                             launch->localSize[d];
+
+        // the last group of a dimension may be cut short by the grid
+        item.local_size[d] = std::min(launch->localSize[d],
+            launch->globalSize[d] - item.group_id[d] * launch->localSize[d]);
+        items *= item.local_size[d];
+    }
+
+    if (launch->barriers) {
+        item.group = &w;
+        runFibers(w, launch, item, items);
+        return;
+    }
+
+    item.group = nullptr;
+
+    for (size_t z = 0; z < item.local_size[2]; ++z) {
+        for (size_t y = 0; y < item.local_size[1]; ++y) {
+            for (size_t x = 0; x < item.local_size[0]; ++x) {
+                item.local_id[0] = x;
+                item.local_id[1] = y;
+                item.local_id[2] = z;
+
+                for (int d = 0; d < 3; ++d) {
+                    item.global_id[d] = item.global_offset[d] +
+                        item.group_id[d] * launch->localSize[d] +
+                        item.local_id[d];
+                }
+
+                launch->entry(w.args.data(), &item);
+            }
+        }
+    }
+}
+
+void
+cpuDevice::runFibers(worker &w, cpuLaunch *launch,
+                     const cl_work_item_hsa &proto, size_t items)
+{
+    long page = sysconf(_SC_PAGESIZE);
+
+    while (w.fibers.size() < items) {
+        fiber *f = new fiber();
+        void *mem = mmap(nullptr, CPU_FIBER_STACK_SIZE + page,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (mem == MAP_FAILED) {
+            clFatal("cpuDevice: cannot map a fiber stack");
+        }
+
+        // the stack grows down into the guard page
+        mprotect(mem, page, PROT_NONE);
+        f->stack = (uint8_t*)mem + page;
+        getcontext(&f->ctx);
+
+        w.fibers.push_back(f);
+    }
+
+    size_t i = 0;
+
+    for (size_t z = 0; z < proto.local_size[2]; ++z) {
+        for (size_t y = 0; y < proto.local_size[1]; ++y) {
+            for (size_t x = 0; x < proto.local_size[0]; ++x) {
+                fiber *f = w.fibers[i++];
+
+                f->item = proto;
+                f->item.local_id[0] = x;
+                f->item.local_id[1] = y;
+                f->item.local_id[2] = z;
+
+                for (int d = 0; d < 3; ++d) {
+                    f->item.global_id[d] = proto.global_offset[d] +
+                        proto.group_id[d] * launch->localSize[d] +
+                        f->item.local_id[d];
+                }
+
+                f->finished = false;
+                f->ctx.uc_stack.ss_sp = f->stack;
+                f->ctx.uc_stack.ss_size = CPU_FIBER_STACK_SIZE;
+                f->ctx.uc_link = &w.sched;
+                makecontext(&f->ctx, fiberMain, 0);
+            }
+        }
+    }
+
+    // Run every unfinished work-item up to its next barrier or its end,
+    // in turn. A pass over the group only ends once each work-item got to
+    // the barrier, so none gets past it before the others arrive.
+    w.launch = launch;
+    size_t live = items;
+
+    while (live) {
+        for (i = 0; i < items; ++i) {
+            fiber *f = w.fibers[i];
+
+            if (f->finished) {
+                continue;
+            }
+
+            w.current = f;
+            swapcontext(&w.sched, &f->ctx);
+
+            if (f->finished) {
+                --live;
+            }
+        }
+    }
+}
+
+void
+cpuDevice::fiberMain()
+{
+    worker *w = self;
+    fiber *f = w->current;
+
+    w->launch->entry(w->args.data(), &f->item);
+    f->finished = true;
+    // returning resumes the worker at uc_link
+}
+
+void
+cpuDevice::barrier(const cl_work_item_hsa *item)
+{
+    worker *w = (worker*)item->group;
+
+    if (!w) {
+        clFatal("clWorkGroupBarrierHSA: the kernel was not registered with "
+                "CL_NATIVE_KERNEL_BARRIER_HSA");
+    }
+
+    swapcontext(&w->current->ctx, &w->sched);
+}
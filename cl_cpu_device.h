@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2011-2015 Advanced Micro Devices, Inc.
+ * All rights reserved.
+ *
+ * For use for simulation and test purposes only
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __CL_CPU_DEVICE_H__
+#define __CL_CPU_DEVICE_H__
+
+#include <ucontext.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cl_runtime.hh"
+
+// The CPU device runs the native kernels registered with
+// clRegisterNativeKernelHSA on a pool of worker threads. A launch is split
+// into ranges of work-groups; each worker keeps its ranges in a deque,
+// splits the one it runs in half until it is down to a few groups, and
+// when its deque is empty steals the largest range another worker has
+// left. Work-items of a group run one after the other on the worker, or
+// as fibers when the kernel uses barriers, so a barrier costs a context
+// switch rather than a thread synchronization.
+
+// Doubles per SSE register, the unit the device info reports vector
+// widths in.
+static const uint32_t CPU_VEC_SIZE = 2;
+
+// Stack of each work-item fiber, plus one guard page. Fibers are created
+// for the largest group a worker has run and then reused.
+static const size_t CPU_FIBER_STACK_SIZE = 64 * 1024;
+
+// A kernel launch on the CPU device, with the argument values captured at
+// enqueue.
+struct cpuLaunch {
+    cl_native_kernel_fn_hsa entry;
+    // work-items run as fibers so that they can wait at barriers
+    bool barriers;
+
+    // The launch runs numGroups work-groups in each dimension, starting at
+    // firstGroup, of an NDRange of globalSize work-items. A launch that
+    // runs only part of its NDRange still reports the whole of it to the
+    // kernel.
+    cl_uint workDim;
+    size_t globalSize[3];
+    size_t globalOffset[3];
+    size_t localSize[3];
+    size_t firstGroup[3];
+    size_t numGroups[3];
+    // static plus dynamic local memory of a work-group
+    size_t groupMemSize;
+
+    // Argument values, back to back. argOffset[i] locates argument i in
+    // argData; localOffset[i] is the group memory offset of a __local
+    // argument and -1 for any other.
+    std::vector<uint8_t> argData;
+    std::vector<size_t> argOffset;
+    std::vector<int64_t> localOffset;
+
+    // launches of one queue run in order, each counted in dispLeft from
+    // submission until it finishes
+    const void *queue;
+    std::atomic<uint32_t> *dispLeft;
+    // signalled on completion, nullptr if the caller did not ask for one
+    _cl_event *event;
+
+    // If set, the launch only finishes once *joinFlag is set too. The flag
+    // is watched from the start of the launch, so joinNs tells when it was
+    // set even if that came before the launch's own groups were done.
+    const volatile bool *joinFlag;
+    // called as the launch starts, on whichever thread starts it, once
+    // the launches before it on the queue have finished; it may set
+    // startAfter
+    std::function<void(cpuLaunch*)> onStart;
+    // If set, the groups are only handed out once this event is done. The
+    // device drops a reference to it then.
+    _cl_event *startAfter;
+    // called as the launch finishes, before event is signalled
+    std::function<void(const cpuLaunch*)> onFinish;
+
+    // host time the launch was started, its first group was handed out,
+    // the last one finished and the join flag was first seen set
+    uint64_t startNs;
+    uint64_t beginNs;
+    uint64_t endNs;
+    uint64_t joinNs;
+
+    void addArg(const void *value, size_t size, int64_t local_offset)
+    {
+        size_t offset = (argData.size() + 15) & ~(size_t)15;
+
+        argData.resize(offset + size);
+        if (value) {
+            memcpy(&argData[offset], value, size);
+        }
+
+        argOffset.push_back(offset);
+        localOffset.push_back(local_offset);
+    }
+
+  private:
+    friend class cpuDevice;
+
+    uint64_t seq;
+    size_t totalGroups;
+    // groups per range a worker stops splitting at
+    size_t grain;
+    std::atomic<size_t> groupsLeft;
+    // groups done, waiting for the join flag
+    bool parked;
+    // the launch submitted after this one on the same queue
+    cpuLaunch *next;
+};
+
+class cpuDevice {
+  public:
+    // the device, its workers started on first use
+    static cpuDevice *get();
+
+    // the number of workers the device runs, without starting it
+    static unsigned workerCount();
+
+    // Run launch once every launch submitted before it on the same queue
+    // has finished. The device owns the launch from here on.
+    void submit(cpuLaunch *launch);
+
+    // Park the calling work-item until every work-item of its group got
+    // here.
+    static void barrier(const cl_work_item_hsa *item);
+
+  private:
+    struct task {
+        cpuLaunch *launch;
+        size_t begin;
+        size_t end;
+    };
+
+    struct fiber {
+        ucontext_t ctx;
+        void *stack;
+        cl_work_item_hsa item;
+        bool finished;
+    };
+
+    struct worker {
+        unsigned index;
+        std::mutex lock;
+        std::deque<task> tasks;
+        std::thread thread;
+
+        // group memory of the work-group being run
+        uint8_t *groupMem;
+
+        // the args array of launch argsSeq, pointing into its argData and
+        // into groupMem
+        uint64_t argsSeq;
+        std::vector<void*> args;
+        std::vector<void*> localArgs;
+
+        std::vector<fiber*> fibers;
+        ucontext_t sched;
+        fiber *current;
+        cpuLaunch *launch;
+    };
+
+    cpuDevice(unsigned num_workers);
+
+    void start(cpuLaunch *launch);
+    void begin(cpuLaunch *launch);
+    void complete(cpuLaunch *launch);
+    void finish(cpuLaunch *launch);
+    void pollJoins();
+    void unwatch(cpuLaunch *launch);
+
+    void push(worker &w, const task &t);
+    bool pop(worker &w, task &t);
+    bool steal(worker &w, task &t);
+
+    void run(worker &w);
+    void runTask(worker &w, task t);
+    void runGroup(worker &w, cpuLaunch *launch, size_t group);
+    void runFibers(worker &w, cpuLaunch *launch,
+                   const cl_work_item_hsa &proto, size_t items);
+    static void fiberMain();
+    void wakeIdle();
+
+    // the worker running on this thread, nullptr on any other
+    static thread_local worker *self;
+
+    std::vector<worker*> workers;
+
+    // ranges queued on any worker; idle workers sleep while it is zero
+    std::atomic<long> available;
+    std::atomic<int> sleeping;
+    std::mutex idleLock;
+    std::condition_variable idleCv;
+
+    // started launches whose join flag has not been seen set, and those
+    // whose startAfter event is not done; guarded by joinLock and polled
+    // by the workers between ranges
+    std::vector<cpuLaunch*> joins;
+    std::vector<cpuLaunch*> gated;
+    std::atomic<int> pendingJoins;
+    std::mutex joinLock;
+
+    // last launch of every queue with a launch running, guarded by
+    // chainLock
+    std::map<const void*, cpuLaunch*> queueTail;
+    std::mutex chainLock;
+    std::atomic<uint64_t> nextSeq;
+};
+
+#endif // __CL_CPU_DEVICE_H__
@@ -40,9 +40,13 @@ struct HsaQueueEntry;
 
 class _cl_event {
   public:
-    _cl_event() : done(false), hsaTaskPtr(nullptr), start(0), end(0) { }
+    _cl_event() : done(false), onHost(false), hsaTaskPtr(nullptr), start(0),
+                  end(0) { }
 
     volatile bool done;
+    // completed by a CPU device worker rather than the dispatcher, so
+    // waited for without mwait
+    bool onHost;
     HsaQueueEntry *hsaTaskPtr;
     uint64_t start;
     uint64_t end;
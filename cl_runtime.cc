@@ -37,11 +37,22 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <emmintrin.h>
 
 #include <cassert>
+#include <deque>
+#include <limits>
+#include <mutex>
 #include <set>
+#include <string>
+#include <thread>
 
+#include "cl_cpu_device.h"
 #include "cl_runtime.hh"
+#include "hsa_code_object.h"
 #include "hsa_kernel_info.hh"
 #include "misc.hh"
 #include "qstruct.hh"
@@ -50,30 +61,260 @@
 
 volatile uint32_t *dispatcherDoorbell = (uint32_t*)0x10000000;
 HsaQueueEntry *hsaTaskPtr = (HsaQueueEntry*)0x10000008;
-
-// Pointer to the portion of the flat address space reserved for LDS memory
-static char *ldsSpaceStart = nullptr;
+// The dispatcher takes one queue entry at a time through hsaTaskPtr.
+// Launches go through their queue's submission ring, so only the one
+// publishing thread of each queue takes this lock to copy an entry there
+// and ring the doorbell.
+static std::mutex dispatcherLock;
 
 // global variables
-platform *theOnlyPlatform = nullptr;
-std::set<cl_mem> memTracker;
+static platform *theOnlyPlatform = nullptr;
+static std::once_flag platformInitFlag;
+shardedSet<cl_mem> memTracker;
+shardedMap<cl_mem, size_t> memSize;
+shardedMap<cl_mem, subBufDesc> subBufTracker;
+shardedMap<cl_mem, fileBufDesc> fileBufTracker;
+// buffers whose pages were locked, with the size they were locked for
+shardedMap<cl_mem, size_t> lockedMem;
+shardedSet<cl_mem> imageTracker;
 
 //object tracker
-std::map <cl_context, cl_int> refcontext;
-std::map <cl_mem, cl_int> refmem;
-std::map <cl_kernel, cl_int> refkernel;
-std::map <cl_command_queue, cl_int> refcmdqueue;
-std::map <cl_program, cl_int> refprogram;
+shardedMap<cl_context, cl_int> refcontext;
+shardedMap<cl_mem, cl_int> refmem;
+shardedMap<cl_kernel, cl_int> refkernel;
+shardedMap<cl_command_queue, cl_int> refcmdqueue;
+shardedMap<cl_program, cl_int> refprogram;
+shardedMap<cl_event, cl_int> refevent;
+
+// The trackers count the retains beyond the reference every object is
+// created with. Returns true when the caller dropped the last reference
+// and must destroy the object.
+template <typename K>
+static bool
+dropRef(shardedMap<K, cl_int> &refs, K handle)
+{
+    bool last = false;
+
+    refs.update(handle, [&](cl_int &retains) {
+        if (retains > 0) {
+            --retains;
+            return true;
+        }
+
+        last = true;
+        return false;
+    });
+
+    return last;
+}
+
+template <typename K>
+static void
+takeRef(shardedMap<K, cl_int> &refs, K handle)
+{
+    refs.update(handle, [](cl_int &retains) {
+        ++retains;
+        return true;
+    });
+}
 
 static HsaDriverSizes hsaDriverSizes;
-static HsaKernelInfo *hsaKernelInfo;
+static const HsaKernelInfo *hsaKernelInfo;
 static const char *hsaStringTable;
 static const uint8_t *hsaCode;
 static const uint8_t *hsaReadonly;
 static uint32_t numCUs = 0;
 static uint32_t VecSize = 0;
 
+// The kernels of a code image, with an open-addressed index from OpenCL
+// kernel name to entry. Empty index slots hold -1. Built once per image
+// and never resized, so _cl_kernels can point at the descriptors.
+struct HsaKernelTable {
+    // a deque, as descriptors hold locks and cannot be moved
+    std::deque<kernelDesc> kernels;
+    std::vector<int32_t> index;
+};
+
+// A program created from a binary runs the kernels of its own code object
+// rather than the ones loaded from the driver.
+struct HsaProgramBinary {
+    const HsaCodeObjectHeader *hdr;
+    // false if the image is the driver's code-object cache
+    bool ownsMapping;
+    HsaKernelTable kernels;
+    std::atomic<int> refCount;
+    // descriptor epoch the last reference was dropped in
+    uint64_t retireEpoch;
+};
+
+// Binaries nobody references any more. A dispatch carries no reference,
+// so these stay mapped until no dispatch can still be running their code.
+static std::vector<HsaProgramBinary*> hsaRetiredBinaries;
+// every command queue not yet released, polled before retired binaries
+// are unmapped
+static std::set<_cl_command_queue*> liveQueues;
+// guards hsaRetiredBinaries and liveQueues
+static std::mutex hsaBinaryLock;
+
+// API calls may use a kernel descriptor they read without taking a
+// reference on its binary, from a launch not yet counted by its queue to a
+// clone not yet holding its reference. Each thread announces the epoch it
+// entered such a call in, in a slot of its own so that readers never
+// write a shared cache line. A binary retired in epoch R is safe from
+// readers once no thread is still in a call it entered in epoch R or
+// before.
+struct DescReader {
+    // 0 outside a call
+    std::atomic<uint64_t> epoch;
+    // nesting depth of the calls, touched only by the owner
+    int depth;
+    // owned by a live thread; guarded by hsaDescReaderLock
+    bool inUse;
+};
+
+static std::atomic<uint64_t> hsaDescEpoch(1);
+// every slot handed out, each on a cache line of its own; the slots of
+// threads that exited are handed out again
+static std::vector<DescReader*> hsaDescReaders;
+static std::mutex hsaDescReaderLock;
+
+// Hands the calling thread's slot back when the thread exits.
+struct DescReaderHandle {
+    DescReader *slot = nullptr;
+
+    ~DescReaderHandle()
+    {
+        if (slot) {
+            std::lock_guard<std::mutex> guard(hsaDescReaderLock);
+            slot->inUse = false;
+        }
+    }
+};
+
+static thread_local DescReaderHandle descReader;
+
+static DescReader *
+hsaDescReader()
+{
+    if (descReader.slot) {
+        return descReader.slot;
+    }
+
+    std::lock_guard<std::mutex> guard(hsaDescReaderLock);
+
+    for (auto slot : hsaDescReaders) {
+        if (!slot->inUse) {
+            slot->inUse = true;
+            return descReader.slot = slot;
+        }
+    }
+
+    void *mem;
+    if (posix_memalign(&mem, 64, 64)) {
+        clFatal("hsaDescReader: out of memory\n");
+    }
+
+    DescReader *slot = new (mem) DescReader();
+    slot->epoch = 0;
+    slot->depth = 0;
+    slot->inUse = true;
+    hsaDescReaders.push_back(slot);
+
+    return descReader.slot = slot;
+}
+
+// The oldest epoch a thread is still in a call from, or the current epoch
+// if no thread is in one. Every call entered before it has left.
+static uint64_t
+hsaOldestDescReader()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t oldest = hsaDescEpoch.load();
+
+    std::lock_guard<std::mutex> guard(hsaDescReaderLock);
+
+    for (auto slot : hsaDescReaders) {
+        uint64_t epoch = slot->epoch.load();
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    return oldest;
+}
+
+// Scope of an API call that reads the descriptor of a kernel a concurrent
+// reload may switch.
+struct DescReadGuard {
+    DescReadGuard() : reader(hsaDescReader())
+    {
+        if (reader->depth++ == 0) {
+            reader->epoch.store(hsaDescEpoch.load());
+            // the epoch must be visible before any descriptor is read
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    ~DescReadGuard()
+    {
+        if (--reader->depth == 0) {
+            reader->epoch.store(0, std::memory_order_release);
+        }
+    }
+
+    DescReader *reader;
+};
+
+// guards the one-time load of the driver state
+static std::once_flag hsaDriverInitFlag;
+// what the load returned; every later hsaDriverInit returns it too
+static cl_int hsaDriverStatus = CL_SUCCESS;
+
+// kernels loaded from the driver, indexed once by hsaDriverInit
+static HsaKernelTable hsaDriverKernels;
+// the driver's code-object cache, if hsaDriverInit mapped one
+static const HsaCodeObjectHeader *hsaCodeObject;
+// the driver state serialized on demand for CL_PROGRAM_BINARIES
+static std::vector<uint8_t> hsaDriverImage;
+static std::once_flag hsaDriverImageFlag;
+
 cl_uint _cl_device_id::nextID = 0;
+std::atomic<uint64_t> _cl_kernel::nextID(0);
+
+// Argument state of the kernels in thread-local mode: one clone per kernel
+// per thread, keyed by kernel ID so a recycled kernel address never finds
+// a stale clone. The kernel owns the clones and frees them with itself,
+// whichever threads made them.
+struct threadArgState {
+    std::map<uint64_t, _cl_kernel*> kernels;
+};
+
+static thread_local threadArgState threadArgs;
+
+// Return the kernel whose arguments the calling thread sets and launches.
+// In thread-local mode that is the thread's clone, made from the shared
+// kernel's arguments on first use.
+static _cl_kernel *
+argState(_cl_kernel *kernel)
+{
+    // pairs with the release store in clSetKernelExecInfo
+    if (!kernel->threadLocalArgs.load(std::memory_order_acquire)) {
+        return kernel;
+    }
+
+    _cl_kernel *&clone = threadArgs.kernels[kernel->ID];
+    if (!clone) {
+        clone = new _cl_kernel(*kernel);
+
+        std::lock_guard<std::mutex> guard(kernel->clonesLock);
+        kernel->clones.push_back(clone);
+    } else if (clone->desc != kernel->desc) {
+        // the program was reloaded since the clone was made
+        clone->setDesc(kernel->desc);
+    }
+
+    return clone;
+}
 
 // The current version of the compiler adds six implicit arguments to an
 // OpenCL Kernel. This was 3 before, and now it's become 6. CLOC or other
@@ -93,34 +334,376 @@ clFatal(const char *s)
     exit(0);
 }
 
+// Identify the driver node and the running executable without talking to
+// the driver. Returns 0 if either cannot be identified, which never
+// matches a snapshot.
+static uint64_t
+hsaDriverFingerprint()
+{
+    struct stat dev, exe;
+    if (stat("/dev/hsa", &dev) || stat("/proc/self/exe", &exe)) {
+        return 0;
+    }
+
+    uint64_t id[] = {
+        (uint64_t)dev.st_rdev, (uint64_t)dev.st_ino,
+        (uint64_t)dev.st_mtime, (uint64_t)dev.st_ctime,
+        (uint64_t)exe.st_dev, (uint64_t)exe.st_ino,
+        (uint64_t)exe.st_size, (uint64_t)exe.st_mtime,
+    };
+
+    return hsaCodeObjectChecksum((const uint8_t*)id, sizeof(id)) | 1;
+}
+
+// Fill in the header of a code-object image for the given section sizes
+// and the device parameters of the running driver. The checksum is left
+// for hsaSealCodeObject.
 static void
-hsaDriverInit()
+hsaInitCodeObject(HsaCodeObjectHeader *hdr, const HsaDriverSizes &sizes)
 {
-    // skip if already initialized
-    if (hsaKernelInfo)
+    memset(hdr, 0, sizeof(*hdr));
+
+    hdr->magic = HSA_CODE_OBJECT_MAGIC;
+    hdr->version = HSA_CODE_OBJECT_VERSION;
+    hdr->numKernels = sizes.num_kernels;
+    hdr->stringTableSize = sizes.string_table_size;
+    hdr->codeSize = sizes.code_size;
+    hdr->readonlySize = sizes.readonly_size;
+    hdr->numCUs = numCUs;
+    hdr->vecSize = VecSize;
+    hdr->kernelInfoSize = sizeof(HsaKernelInfo);
+    hdr->driverFingerprint = hsaDriverFingerprint();
+
+    hdr->kernelInfoOffs = sizeof(*hdr);
+    hdr->stringTableOffs =
+        hdr->kernelInfoOffs + hdr->numKernels * sizeof(HsaKernelInfo);
+    hdr->codeOffs = hsaCodeObjectAlign(hdr->stringTableOffs +
+                                       hdr->stringTableSize);
+    hdr->readonlyOffs = hdr->codeOffs + hsaCodeObjectAlign(hdr->codeSize);
+    hdr->size = hdr->readonlyOffs + hsaCodeObjectAlign(hdr->readonlySize);
+}
+
+// True if [offs, offs + len) lies within [0, size), written so that no sum
+// can wrap.
+static bool
+hsaInBounds(uint64_t offs, uint64_t len, uint64_t size)
+{
+    return offs <= size && len <= size - offs;
+}
+
+// Hash and checksum the sections of an image and store its header in
+// place. A header whose sections lie outside the image gets no content
+// hash; hsaValidCodeObject turns such an image down anyway.
+static void
+hsaSealCodeObject(std::vector<uint8_t> &image, HsaCodeObjectHeader *hdr)
+{
+    hdr->contentHash = 0;
+    if (hsaInBounds(hdr->codeOffs, hdr->codeSize, image.size()) &&
+        hsaInBounds(hdr->readonlyOffs, hdr->readonlySize, image.size())) {
+        hdr->contentHash =
+            hsaCodeObjectContentHash(*hdr, image.data() + hdr->codeOffs,
+                                     image.data() + hdr->readonlyOffs);
+    }
+    hdr->checksum = hsaCodeObjectChecksum(&image[sizeof(*hdr)],
+                                          hdr->size - sizeof(*hdr));
+    memcpy(&image[0], hdr, sizeof(*hdr));
+}
+
+// Serialize the driver state into a code-object image.
+static void
+hsaBuildCodeObject(std::vector<uint8_t> &image)
+{
+    HsaCodeObjectHeader hdr;
+    hsaInitCodeObject(&hdr, hsaDriverSizes);
+
+    image.assign(hdr.size, 0);
+    memcpy(&image[hdr.kernelInfoOffs], hsaKernelInfo,
+           hdr.numKernels * sizeof(HsaKernelInfo));
+    memcpy(&image[hdr.stringTableOffs], hsaStringTable,
+           hdr.stringTableSize);
+    memcpy(&image[hdr.codeOffs], hsaCode, hdr.codeSize);
+    if (hdr.readonlySize) {
+        memcpy(&image[hdr.readonlyOffs], hsaReadonly, hdr.readonlySize);
+    }
+
+    hsaSealCodeObject(image, &hdr);
+}
+
+// Write a code-object image to path. The image is written under a
+// temporary name and renamed into place, so processes mapping the cache
+// concurrently never see a partial file.
+static void
+hsaWriteCodeObject(const char *path, const uint8_t *image, size_t size)
+{
+    std::string tmp_path = std::string(path) + "." +
+                           std::to_string(getpid());
+    FILE *f = fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+        DPRINT("hsaWriteCodeObject(): cannot create %s\n", tmp_path.c_str());
         return;
+    }
+
+    bool ok = fwrite(image, 1, size, f) == size;
+    ok = !fclose(f) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path)) {
+        DPRINT("hsaWriteCodeObject(): cannot write %s\n", path);
+        unlink(tmp_path.c_str());
+    }
+}
+
+// Check the header, section bounds, kernel entries and checksum of a
+// code-object image. Everything the kernel table is built from is checked,
+// so a crafted image cannot send a lookup outside the image.
+static bool
+hsaValidCodeObject(const uint8_t *image, size_t size)
+{
+    if (size < sizeof(HsaCodeObjectHeader)) {
+        return false;
+    }
+
+    const HsaCodeObjectHeader *hdr = (const HsaCodeObjectHeader*)image;
+    uint64_t kernel_info_size =
+        (uint64_t)hdr->numKernels * sizeof(HsaKernelInfo);
+
+    // the sections follow the header in order, without overlapping
+    if (hdr->magic != HSA_CODE_OBJECT_MAGIC ||
+        hdr->version != HSA_CODE_OBJECT_VERSION ||
+        hdr->kernelInfoSize != sizeof(HsaKernelInfo) ||
+        hdr->size != size ||
+        hdr->kernelInfoOffs < sizeof(*hdr) ||
+        !hsaInBounds(hdr->kernelInfoOffs, kernel_info_size,
+                     hdr->stringTableOffs) ||
+        !hsaInBounds(hdr->stringTableOffs, hdr->stringTableSize,
+                     hdr->codeOffs) ||
+        hdr->codeOffs % HSA_CODE_OBJECT_ALIGN ||
+        !hsaInBounds(hdr->codeOffs, hdr->codeSize, hdr->readonlyOffs) ||
+        hdr->readonlyOffs % HSA_CODE_OBJECT_ALIGN ||
+        !hsaInBounds(hdr->readonlyOffs, hdr->readonlySize, hdr->size)) {
+        return false;
+    }
+
+    // names are read up to their terminator
+    if (hdr->stringTableSize &&
+        image[hdr->stringTableOffs + hdr->stringTableSize - 1]) {
+        return false;
+    }
+
+    const HsaKernelInfo *kernel_info =
+        (const HsaKernelInfo*)(image + hdr->kernelInfoOffs);
+
+    for (uint32_t i = 0; i < hdr->numKernels; ++i) {
+        if (kernel_info[i].name_offs >= hdr->stringTableSize ||
+            kernel_info[i].code_offs >= hdr->codeSize) {
+            return false;
+        }
+    }
+
+    // the content hash also covers the header, so an image whose offsets
+    // or device parameters were changed after sealing is not loaded
+    return hdr->checksum == hsaCodeObjectChecksum(image + sizeof(*hdr),
+                                                  hdr->size - sizeof(*hdr)) &&
+           hdr->contentHash ==
+               hsaCodeObjectContentHash(*hdr, image + hdr->codeOffs,
+                                        image + hdr->readonlyOffs);
+}
+
+// Map a code-object image read-only and shared. Returns the header at the
+// start of the mapping, or nullptr if the file is missing or invalid.
+static const HsaCodeObjectHeader *
+hsaMapCodeObject(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(HsaCodeObjectHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, st.st_size, PROT_READ | PROT_EXEC,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+
+    if (!hsaValidCodeObject((const uint8_t*)base, st.st_size)) {
+        DPRINT("hsaMapCodeObject(): ignoring invalid image %s\n", path);
+        munmap(base, st.st_size);
+        return nullptr;
+    }
+
+    return (const HsaCodeObjectHeader*)base;
+}
+
+// The compiler emits kernel symbols as __OpenCL_<name>_kernel. The index
+// is keyed on <name> alone so lookups can hash the caller's string as is.
+static const char KERNEL_SYM_PREFIX[] = "__OpenCL_";
+static const char KERNEL_SYM_SUFFIX[] = "_kernel";
+static const size_t KERNEL_SYM_PREFIX_LEN = sizeof(KERNEL_SYM_PREFIX) - 1;
+static const size_t KERNEL_SYM_SUFFIX_LEN = sizeof(KERNEL_SYM_SUFFIX) - 1;
+
+// Return the OpenCL name inside a kernel symbol and its length, or nullptr
+// if the symbol does not have the compiler's decoration.
+static const char *
+kernelSymbolName(const char *sym, size_t *len)
+{
+    size_t sym_len = strlen(sym);
+
+    if (sym_len < KERNEL_SYM_PREFIX_LEN + KERNEL_SYM_SUFFIX_LEN ||
+        strncmp(sym, KERNEL_SYM_PREFIX, KERNEL_SYM_PREFIX_LEN) ||
+        strcmp(sym + sym_len - KERNEL_SYM_SUFFIX_LEN, KERNEL_SYM_SUFFIX)) {
+        return nullptr;
+    }
+
+    *len = sym_len - KERNEL_SYM_PREFIX_LEN - KERNEL_SYM_SUFFIX_LEN;
+
+    return sym + KERNEL_SYM_PREFIX_LEN;
+}
+
+static void
+hsaBuildKernelTable(HsaKernelTable *table, const HsaKernelInfo *kernel_info,
+                    const char *string_table, uint32_t num_kernels,
+                    const uint8_t *code, const uint8_t *readonly,
+                    uint32_t readonly_size)
+{
+    table->kernels.clear();
+
+    // keep the load factor at or below one half
+    size_t slots = 2;
+    while (slots < 2 * (size_t)num_kernels) {
+        slots <<= 1;
+    }
+
+    table->index.assign(slots, -1);
+
+    for (uint32_t i = 0; i < num_kernels; ++i) {
+        size_t len;
+        const char *name =
+            kernelSymbolName(&string_table[kernel_info[i].name_offs], &len);
+        if (!name) {
+            continue;
+        }
+
+        size_t slot = hsaCodeObjectChecksum((const uint8_t*)name, len) &
+                      (slots - 1);
+        while (table->index[slot] >= 0) {
+            slot = (slot + 1) & (slots - 1);
+        }
+
+        table->index[slot] = table->kernels.size();
+        table->kernels.emplace_back();
+
+        const HsaKernelInfo *kinfo = &kernel_info[i];
+        kernelDesc &desc = table->kernels.back();
+        desc.name.assign(name, len);
+        desc.code = &code[kinfo->code_offs];
+        desc.binary = nullptr;
+        desc.readonly = readonly;
+        desc.readonlySize = readonly_size;
+        desc.privateMemSize = kinfo->private_mem_size;
+        desc.spillMemSize = kinfo->spill_mem_size;
+        desc.staticLdsSize = kinfo->static_lds_size;
+        desc.sRegCount = kinfo->sRegCount;
+        desc.dRegCount = kinfo->dRegCount;
+        desc.cRegCount = kinfo->cRegCount;
+    }
+}
+
+// Find the kernel table entry for an OpenCL kernel name, or nullptr.
+static kernelDesc *
+hsaFindKernel(HsaKernelTable *table, const char *kernel_name)
+{
+    if (table->index.empty()) {
+        return nullptr;
+    }
+
+    size_t len = strlen(kernel_name);
+    size_t mask = table->index.size() - 1;
+    size_t slot =
+        hsaCodeObjectChecksum((const uint8_t*)kernel_name, len) & mask;
+
+    for (; table->index[slot] >= 0; slot = (slot + 1) & mask) {
+        kernelDesc *desc = &table->kernels[table->index[slot]];
+
+        if (desc->name.size() == len &&
+            !memcmp(desc->name.data(), kernel_name, len)) {
+            return desc;
+        }
+    }
+
+    return nullptr;
+}
+
+// Give up on a driver load: close the driver, drop the tables read so
+// far so no entry point sees half of them, and say why.
+static cl_int
+hsaDriverLoadFailed(int fd, const char *what)
+{
+    fprintf(stderr, "%s failed\n", what);
+    close(fd);
+
+    delete[] hsaKernelInfo;
+    delete[] hsaStringTable;
+    hsaKernelInfo = nullptr;
+    hsaStringTable = nullptr;
+
+    return CL_DEVICE_NOT_AVAILABLE;
+}
+
+static cl_int
+hsaDriverLoad()
+{
+    // skip if the snapshot already provided the driver state
+    if (hsaKernelInfo)
+        return CL_SUCCESS;
 
-    DPRINT("hsaDriverInit()");
+    DPRINT("hsaDriverLoad()");
 
     int fd = open("/dev/hsa", O_RDONLY);
     if (fd < 0) {
         fprintf(stderr, "Failed to open /dev/hsa\n");
-        exit(1);
+        return CL_DEVICE_NOT_AVAILABLE;
     }
 
     int status;
 
     status = ioctl(fd, HSA_GET_SIZES, &hsaDriverSizes);
     if (status) {
-        fprintf(stderr, "HSA_GET_SIZES failed\n");
-        exit(1);
+        return hsaDriverLoadFailed(fd, "HSA_GET_SIZES");
     }
 
-    DPRINT("hsaDriverInit(): found %d kernels\n", hsaDriverSizes.num_kernels);
+    DPRINT("hsaDriverLoad(): found %d kernels\n", hsaDriverSizes.num_kernels);
 
     hsaKernelInfo = new HsaKernelInfo[hsaDriverSizes.num_kernels];
     hsaStringTable = new char[hsaDriverSizes.string_table_size];
 
+    status = ioctl(fd, HSA_GET_KINFO, hsaKernelInfo);
+    if (status) {
+        return hsaDriverLoadFailed(fd, "HSA_GET_KINFO");
+    }
+    DPRINT("HSA_GET_KINFO\n");
+
+    status = ioctl(fd, HSA_GET_STRINGS, hsaStringTable);
+    if (status) {
+        return hsaDriverLoadFailed(fd, "HSA_GET_STRINGS");
+    }
+    DPRINT("HSA_GET_STRINGS\n");
+
+    status = ioctl(fd, HSA_GET_CU_CNT, (cl_uint*)(&numCUs));
+    if (status) {
+        return hsaDriverLoadFailed(fd, "HSA_GET_CU_CNT");
+    }
+
+    status = ioctl(fd, HSA_GET_VSZ, (cl_uint*)(&VecSize));
+    if (status) {
+        return hsaDriverLoadFailed(fd, "HSA_GET_VSZ");
+    }
+
     // The simulator fetches a cache block at a time. This behavior may result
     // in fetching beyond the code region. If this happens, the simulator
     // expects the values fetched to be nullptr. In reality, a more elegant
@@ -128,961 +711,1476 @@ hsaDriverInit()
     uint32_t pad = hsaDriverSizes.code_size % 4096;
     pad = (pad == 0) ? 0 : 4096 - pad;
     uint32_t padded_code_size = hsaDriverSizes.code_size + pad;
+    uint32_t padded_readonly_size = 0;
     int fp = open("/dev/zero", O_RDONLY);
-    hsaCode = (uint8_t*)mmap(nullptr, padded_code_size, PROT_EXEC,
-                             MAP_PRIVATE, fp, 0);
+    void *code = mmap(nullptr, padded_code_size, PROT_EXEC, MAP_PRIVATE,
+                      fp, 0);
+    void *readonly = nullptr;
 
     if (hsaDriverSizes.readonly_size > 0) {
         pad = hsaDriverSizes.readonly_size % 4096;
         pad = (pad == 0) ? 0 : 4096 - pad;
-        uint32_t padded_readonly_size = hsaDriverSizes.readonly_size + pad;
-        hsaReadonly = (uint8_t*)mmap(nullptr, padded_readonly_size,
-                                     PROT_READ, MAP_PRIVATE, fp, 0);
-        fprintf(stderr, "hsaReadonly = %llx\n", hsaReadonly);
-    } else {
-        hsaReadonly = nullptr;
+        padded_readonly_size = hsaDriverSizes.readonly_size + pad;
+        readonly = mmap(nullptr, padded_readonly_size, PROT_READ,
+                        MAP_PRIVATE, fp, 0);
+        fprintf(stderr, "hsaReadonly = %p\n", readonly);
     }
 
-    DPRINT("\t%d %d %d\n\t%p %p %p\n", hsaDriverSizes.num_kernels,
-           hsaDriverSizes.string_table_size, hsaDriverSizes.code_size,
-           hsaKernelInfo, hsaStringTable, hsaCode);
+    close(fp);
 
-    status = ioctl(fd, HSA_GET_KINFO, hsaKernelInfo);
-    if (status) {
-        fprintf(stderr, "HSA_GET_KINFO failed\n");
-        exit(1);
+    if (code == MAP_FAILED || readonly == MAP_FAILED) {
+        if (code != MAP_FAILED) {
+            munmap(code, padded_code_size);
+        }
+        if (readonly && readonly != MAP_FAILED) {
+            munmap(readonly, padded_readonly_size);
+        }
+        return hsaDriverLoadFailed(fd, "mapping the code segments");
     }
-    DPRINT("HSA_GET_KINFO\n");
 
-    status = ioctl(fd, HSA_GET_STRINGS, hsaStringTable);
-    if (status) {
-        fprintf(stderr, "HSA_GET_STRINGS failed\n");
-        exit(1);
+    DPRINT("\t%d %d %d\n\t%p %p %p\n", hsaDriverSizes.num_kernels,
+           hsaDriverSizes.string_table_size, hsaDriverSizes.code_size,
+           hsaKernelInfo, hsaStringTable, code);
+
+    const char *failed = nullptr;
+    if (ioctl(fd, HSA_GET_CODE, code)) {
+        failed = "HSA_GET_CODE";
+    } else if (readonly && ioctl(fd, HSA_GET_READONLY_DATA, readonly)) {
+        failed = "HSA_GET_READONLY_DATA";
     }
-    DPRINT("HSA_GET_STRINGS\n");
 
-    status = ioctl(fd, HSA_GET_CODE, hsaCode);
-    if (status) {
-        fprintf(stderr, "HSA_GET_CODE failed\n");
-        exit(1);
+    if (failed) {
+        munmap(code, padded_code_size);
+        if (readonly) {
+            munmap(readonly, padded_readonly_size);
+        }
+        return hsaDriverLoadFailed(fd, failed);
     }
     DPRINT("HSA_GET_CODE\n");
 
-    if (hsaDriverSizes.readonly_size > 0) {
-        status = ioctl(fd, HSA_GET_READONLY_DATA, hsaReadonly);
-        if (status) {
-            fprintf(stderr, "HSA_GET_READONLY_DATA failed\n");
-            exit(1);
+    close(fd);
+
+    hsaCode = (const uint8_t*)code;
+    hsaReadonly = (const uint8_t*)readonly;
+
+    // The code and read-only segments are the bulk of the driver state. If
+    // a cached image holds the same kernel table, device parameters, code
+    // and read-only data, map its segments shared and drop the private
+    // copies, so that every process running these kernels shares one copy.
+    const char *cache_path = getenv("HSA_CODE_OBJECT_CACHE");
+    const HsaCodeObjectHeader *cache =
+        cache_path ? hsaMapCodeObject(cache_path) : nullptr;
+
+    HsaCodeObjectHeader hdr;
+    hsaInitCodeObject(&hdr, hsaDriverSizes);
+
+    if (cache && cache->numKernels == hsaDriverSizes.num_kernels &&
+        cache->stringTableSize == hsaDriverSizes.string_table_size &&
+        cache->codeSize == hsaDriverSizes.code_size &&
+        cache->readonlySize == hsaDriverSizes.readonly_size &&
+        !memcmp((const uint8_t*)cache + cache->kernelInfoOffs, hsaKernelInfo,
+                cache->numKernels * sizeof(HsaKernelInfo)) &&
+        !memcmp((const uint8_t*)cache + cache->stringTableOffs,
+                hsaStringTable, cache->stringTableSize) &&
+        cache->contentHash ==
+            hsaCodeObjectContentHash(hdr, hsaCode, hsaReadonly)) {
+        munmap((void*)hsaCode, padded_code_size);
+        if (hsaReadonly) {
+            munmap((void*)hsaReadonly, padded_readonly_size);
         }
-        DPRINT("HSA_GET_READONLY_DATA\n");
-    } else {
-        hsaReadonly = nullptr;
+
+        hsaCodeObject = cache;
+        hsaCode = (const uint8_t*)cache + cache->codeOffs;
+        hsaReadonly = cache->readonlySize ?
+            (const uint8_t*)cache + cache->readonlyOffs : nullptr;
+        DPRINT("hsaDriverLoad(): mapped code from %s\n", cache_path);
+
+        hsaBuildKernelTable(&hsaDriverKernels, hsaKernelInfo, hsaStringTable,
+                            hsaDriverSizes.num_kernels, hsaCode,
+                            hsaReadonly, hsaDriverSizes.readonly_size);
+
+        // the kernels are unchanged but the fingerprint is not; refresh
+        // it so the next warm start can skip the driver
+        if (cache->driverFingerprint != hsaDriverFingerprint()) {
+            std::vector<uint8_t> image;
+            hsaBuildCodeObject(image);
+            hsaWriteCodeObject(cache_path, image.data(), image.size());
+        }
+        return CL_SUCCESS;
     }
 
-    status = ioctl(fd, HSA_GET_CU_CNT, (cl_uint*)(&numCUs));
-    if (status) {
-        fprintf(stderr, "HSA_GET_CU_CNT failed\n");
-        exit(1);
+    if (cache) {
+        munmap((void*)cache, cache->size);
     }
 
-    status = ioctl(fd, HSA_GET_VSZ, (cl_uint*)(&VecSize));
-    if (status) {
-        fprintf(stderr, "HSA_GET_VSZ failed\n");
-        exit(1);
+    hsaBuildKernelTable(&hsaDriverKernels, hsaKernelInfo, hsaStringTable,
+                        hsaDriverSizes.num_kernels, hsaCode, hsaReadonly,
+                        hsaDriverSizes.readonly_size);
+
+    // populate the cache for the next process
+    if (cache_path) {
+        hsaBuildCodeObject(hsaDriverImage);
+        hsaWriteCodeObject(cache_path, hsaDriverImage.data(),
+                           hsaDriverImage.size());
     }
+
+    return CL_SUCCESS;
 }
 
-// opencl api implementation
+// Load the driver state exactly once. Callers that race with the
+// background initializer block until it has finished. Returns
+// CL_DEVICE_NOT_AVAILABLE if the driver could not be loaded.
+static cl_int
+hsaDriverInit()
+{
+    std::call_once(hsaDriverInitFlag, [] {
+        hsaDriverStatus = hsaDriverLoad();
+    });
 
-/* Platform API */
-CL_API_ENTRY cl_int CL_API_CALL
-clGetPlatformIDs(cl_uint num_entries, cl_platform_id *platforms,
-                 cl_uint *num_platforms)
-CL_API_SUFFIX__VERSION_1_0
+    return hsaDriverStatus;
+}
+
+// Warm start: if the code-object cache was captured from this driver and
+// executable, take the kernel table, string table, code and device
+// parameters straight from the mapped image. hsaDriverInit then has
+// nothing left to do and the driver is never opened.
+//
+// Nothing short of asking the driver tells that its kernels were rebuilt,
+// since they do not come from the executable, so the warm start is only
+// taken when HSA_CODE_OBJECT_WARM_START is set: whoever sets it vouches
+// that the kernels have not changed since the cache was written. Without
+// it, hsaDriverLoad reads the kernels from the driver and shares the
+// cached image only if its content matches.
+static void
+hsaLoadSnapshot()
 {
-    DPRINT("clGetPlatformIDs()\n");
+    if (!getenv("HSA_CODE_OBJECT_WARM_START")) {
+        return;
+    }
 
-    if (!theOnlyPlatform) {
-        theOnlyPlatform = new platform();
+    const char *cache_path = getenv("HSA_CODE_OBJECT_CACHE");
+    const HsaCodeObjectHeader *hdr =
+        cache_path ? hsaMapCodeObject(cache_path) : nullptr;
+    if (!hdr) {
+        return;
     }
 
-    if ((!num_entries && platforms) ||
-       (!num_platforms && !platforms)) {
-        return CL_INVALID_VALUE;
-    } else if ((platforms) && (num_entries > 0)) {
-       platforms[0] = theOnlyPlatform->getID();
-    } else if (num_platforms) {
-        *num_platforms = 1;
+    const uint8_t *image = (const uint8_t*)hdr;
+
+    // The fingerprint says which driver and executable the image was
+    // captured from; the content hash says the header and the sections are
+    // the ones captured, so an image patched or rewritten under the same
+    // fingerprint is not run.
+    uint64_t fingerprint = hsaDriverFingerprint();
+    if (!fingerprint || hdr->driverFingerprint != fingerprint ||
+        hdr->contentHash !=
+            hsaCodeObjectContentHash(*hdr, image + hdr->codeOffs,
+                                     image + hdr->readonlyOffs)) {
+        DPRINT("hsaLoadSnapshot(): %s is stale\n", cache_path);
+        munmap((void*)hdr, hdr->size);
+        return;
     }
 
-    return CL_SUCCESS;
+    hsaDriverSizes.num_kernels = hdr->numKernels;
+    hsaDriverSizes.string_table_size = hdr->stringTableSize;
+    hsaDriverSizes.code_size = hdr->codeSize;
+    hsaDriverSizes.readonly_size = hdr->readonlySize;
+    numCUs = hdr->numCUs;
+    VecSize = hdr->vecSize;
+
+    hsaStringTable = (const char*)image + hdr->stringTableOffs;
+    hsaCode = image + hdr->codeOffs;
+    hsaReadonly = hdr->readonlySize ? image + hdr->readonlyOffs : nullptr;
+    hsaCodeObject = hdr;
+
+    // marks the driver state as initialized
+    hsaKernelInfo = (const HsaKernelInfo*)(image + hdr->kernelInfoOffs);
+
+    hsaBuildKernelTable(&hsaDriverKernels, hsaKernelInfo, hsaStringTable,
+                        hsaDriverSizes.num_kernels, hsaCode, hsaReadonly,
+                        hsaDriverSizes.readonly_size);
+
+    DPRINT("hsaLoadSnapshot(): started from %s\n", cache_path);
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-clGetPlatformInfo(cl_platform_id platform, cl_platform_info param_name,
-                  size_t param_value_size, void *param_value,
-                  size_t *param_value_size_ret)
-CL_API_SUFFIX__VERSION_1_0
-{
-    DPRINT("clGetPlatformInfo()\n");
+// Tries the snapshot when the library is loaded. Defined after the driver
+// state so that state is constructed before it and destroyed after it.
+// Without a snapshot, setting HSA_ASYNC_DRIVER_INIT makes clGetPlatformIDs
+// start hsaDriverInit on a background thread, so the driver loads while
+// the application sets up its context. Entry points that need the driver
+// state still call hsaDriverInit, wait only if the load has not finished
+// and see its result. The thread is joined when the library is unloaded,
+// before the state it fills in goes away.
+static struct HsaDriverLoader {
+    HsaDriverLoader()
+    {
+        hsaLoadSnapshot();
+        warm = hsaKernelInfo != nullptr;
+    }
 
-    if (!platform || platform->ID != theOnlyPlatform->getID()->ID) {
-        return CL_INVALID_PLATFORM;
+    ~HsaDriverLoader()
+    {
+        if (thread.joinable()) {
+            thread.join();
+        }
     }
 
-    if (param_value_size_ret) {
-        *param_value_size_ret = 0;
+    void
+    start()
+    {
+        std::call_once(startFlag, [this] {
+            if (!warm && getenv("HSA_ASYNC_DRIVER_INIT")) {
+                thread = std::thread(hsaDriverInit);
+            }
+        });
     }
 
-    char *ret = (char*)param_value;
-    const char *src;
+    bool warm;
+    std::once_flag startFlag;
+    std::thread thread;
+} hsaDriverLoader;
 
-    switch(param_name) {
-      case CL_PLATFORM_PROFILE:
-        src = "FULL_PROFILE";
-        if (param_value_size > strlen(src)) {
-            strcpy(ret, src);
-            if (param_value_size_ret) {
-                *param_value_size_ret = sizeof(src);
-            }
+// Return the code-object image of the kernels loaded from the driver,
+// serializing it on first use unless a mapped cache already holds it.
+static cl_int
+hsaDriverCodeObject(const uint8_t **image, size_t *size)
+{
+    cl_int ret = hsaDriverInit();
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    if (hsaCodeObject) {
+        *image = (const uint8_t*)hsaCodeObject;
+        *size = hsaCodeObject->size;
+        return CL_SUCCESS;
+    }
+
+    // hsaDriverInit may already have built it for the cache
+    std::call_once(hsaDriverImageFlag, [] {
+        if (hsaDriverImage.empty()) {
+            hsaBuildCodeObject(hsaDriverImage);
         }
-        break;
-      case CL_PLATFORM_VERSION:
-        src = "OpenCL 1.0";
-        if (param_value_size > strlen(src)) {
-            strcpy(ret, src);
-            if (param_value_size_ret) {
-                *param_value_size_ret = sizeof(src);
-            }
-        }
-        break;
-      case CL_PLATFORM_NAME:
-        src = "ATI Stream";
-        if (param_value_size > strlen(src)) {
-            strcpy(ret, src);
-            if (param_value_size_ret) {
-                *param_value_size_ret = sizeof(src);
-            }
-        }
-        break;
-      case CL_PLATFORM_VENDOR:
-        src = "Advanced Micro Devices, Inc.";
-        if (param_value_size > strlen(src)) {
-            strcpy(ret, src);
-            if (param_value_size_ret) {
-                *param_value_size_ret = sizeof(src);
-            }
-        }
-        break;
-      case CL_PLATFORM_EXTENSIONS:
-        src = "";
-        if (param_value_size > strlen(src)) {
-            strcpy(ret, src);
-            if (param_value_size_ret) {
-                *param_value_size_ret = sizeof(src);
-            }
-        }
-        break;
-      default:
-        return CL_INVALID_VALUE;
-    }
+    });
+
+    *image = hsaDriverImage.data();
+    *size = hsaDriverImage.size();
 
     return CL_SUCCESS;
 }
 
-CL_API_ENTRY cl_context CL_API_CALL
-clCreateContextFromType(const cl_context_properties *properties,
-                        cl_device_type device_type,
-                        void (CL_CALLBACK *pfn_notify)(const char *,
-                                                       const void *,
-                                                       size_t, void *),
-                        void *user_data, cl_int *errcode_ret)
-CL_API_SUFFIX__VERSION_1_0
+// Index the kernels of a mapped code-object image. The binary starts with
+// the single reference of the program it is loaded for.
+static HsaProgramBinary *
+hsaNewProgramBinary(const HsaCodeObjectHeader *hdr, bool owns_mapping)
 {
-    DPRINT("clCreateContextFromType()\n");
+    HsaProgramBinary *binary = new HsaProgramBinary();
+    binary->hdr = hdr;
+    binary->ownsMapping = owns_mapping;
+    binary->refCount = 1;
+
+    const uint8_t *base = (const uint8_t*)hdr;
+    hsaBuildKernelTable(&binary->kernels,
+                        (const HsaKernelInfo*)(base + hdr->kernelInfoOffs),
+                        (const char*)base + hdr->stringTableOffs,
+                        hdr->numKernels, base + hdr->codeOffs,
+                        hdr->readonlySize ? base + hdr->readonlyOffs
+                                          : nullptr,
+                        hdr->readonlySize);
+
+    for (auto &desc : binary->kernels.kernels) {
+        desc.binary = binary;
+    }
 
-    cl_int ret = CL_SUCCESS;
+    return binary;
+}
 
-    if (!properties) {
-        ret = CL_INVALID_PLATFORM;
-    } else if (!pfn_notify && user_data) {
-        ret = CL_INVALID_VALUE;
-    } else if (pfn_notify) {
-        clFatal("clCreateContextFromType: pfn_notify not implemented\n");
+// Make a validated code-object image executable without copying it when
+// possible. An image identical to the driver's code-object cache shares that
+// mapping. Otherwise, if HSA_CODE_OBJECT_CACHE_DIR is set, the image is
+// stored there under its content hash and mapped shared, so only the first
+// process to load a binary writes it. As a last resort the image is copied
+// into a private mapping.
+static HsaProgramBinary *
+hsaLoadCodeObject(const uint8_t *image, size_t size)
+{
+    const HsaCodeObjectHeader *src = (const HsaCodeObjectHeader*)image;
+    const HsaCodeObjectHeader *hdr = nullptr;
+    bool owns_mapping = true;
+
+    // the content hash covers the header as well as the sections, so a
+    // match runs the same code with the same layout and device parameters
+    if (hsaCodeObject && hsaCodeObject->size == src->size &&
+        hsaCodeObject->contentHash == src->contentHash) {
+        hdr = hsaCodeObject;
+        owns_mapping = false;
     }
 
-    int prop_idx = 0;
-    while (properties[prop_idx]) {
-        _cl_platform_id *prop;
-        switch (properties[prop_idx]) {
-          case CL_CONTEXT_PLATFORM:
-            prop = (_cl_platform_id*)(properties[prop_idx + 1]);
-            if (prop->ID != theOnlyPlatform->getID()->ID) {
-                ret = CL_INVALID_PLATFORM;
-            }
-            break;
-          default:
-            ret = CL_INVALID_VALUE;
+    const char *cache_dir = getenv("HSA_CODE_OBJECT_CACHE_DIR");
+    if (!hdr && cache_dir) {
+        char name[32];
+        snprintf(name, sizeof(name), "/hsaco-%016llx",
+                 (unsigned long long)src->contentHash);
+        std::string path = std::string(cache_dir) + name;
+
+        hdr = hsaMapCodeObject(path.c_str());
+        if (hdr && (hdr->size != src->size ||
+                    hdr->contentHash != src->contentHash)) {
+            munmap((void*)hdr, hdr->size);
+            hdr = nullptr;
+        }
+
+        if (!hdr) {
+            hsaWriteCodeObject(path.c_str(), image, size);
+            hdr = hsaMapCodeObject(path.c_str());
         }
-        prop_idx += 2;
     }
 
-    if (ret != CL_SUCCESS) {
-        if (errcode_ret) {
-            *errcode_ret = ret;
+    if (!hdr) {
+        void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return nullptr;
         }
 
-        return nullptr;
+        memcpy(base, image, size);
+        mprotect(base, size, PROT_READ | PROT_EXEC);
+        hdr = (const HsaCodeObjectHeader*)base;
     }
 
-    _cl_context *context;
-    ret = theOnlyPlatform->addContext(device_type, &context);
-    if (errcode_ret) {
-        *errcode_ret = ret;
+    return hsaNewProgramBinary(hdr, owns_mapping);
+}
+
+// Unmap the retired binaries no call can still be using and no dispatch
+// can still be running.
+static void
+hsaReclaimBinaries()
+{
+    std::lock_guard<std::mutex> guard(hsaBinaryLock);
+
+    if (hsaRetiredBinaries.empty()) {
+        return;
     }
 
-    if (ret == CL_SUCCESS) {
-        return context;
-    } else {
-        return nullptr;
+    // The calls entered before this have left, and their launches are in
+    // the rings: an idle queue has run them all, a busy one has run those
+    // of the calls before its last clFinish.
+    uint64_t safe = hsaOldestDescReader();
+
+    for (auto queue : liveQueues) {
+        if (queue->ringHead != queue->ringTail || *queue->numDispLeft > 0) {
+            safe = std::min(safe, queue->drainedEpoch.load());
+        }
     }
-}
 
-CL_API_ENTRY cl_context CL_API_CALL
-clCreateContext(const cl_context_properties *properties, cl_uint num_devices,
-                const cl_device_id *devices,
-                void (CL_CALLBACK *pfn_notify)(const char*, const void*,
-                                               size_t, void*),
-                void *user_data, cl_int *errcode_ret)
-CL_API_SUFFIX__VERSION_1_0
-{
-    if (!properties) {
-        _cl_context *context;
-        theOnlyPlatform->addContext(CL_DEVICE_TYPE_GPU, &context);
+    size_t kept = 0;
 
-        if (errcode_ret) {
-            *errcode_ret = CL_SUCCESS;
+    for (auto binary : hsaRetiredBinaries) {
+        if (binary->retireEpoch >= safe) {
+            hsaRetiredBinaries[kept++] = binary;
+            continue;
         }
 
-        return context;
+        if (binary->ownsMapping) {
+            munmap((void*)binary->hdr, binary->hdr->size);
+        }
+
+        delete binary;
     }
 
-    return clCreateContextFromType(properties, CL_DEVICE_TYPE_GPU, pfn_notify,
-                                   user_data,errcode_ret);
+    hsaRetiredBinaries.resize(kept);
 }
-CL_API_ENTRY cl_int CL_API_CALL
-clGetContextInfo(cl_context context, cl_context_info param_name,
-                 size_t param_value_size, void *param_value,
-                 size_t *param_value_size_ret)
-CL_API_SUFFIX__VERSION_1_0
+
+void
+hsaRetainProgramBinary(HsaProgramBinary *binary)
 {
-    DPRINT("clGetContextInfo()\n");
+    ++binary->refCount;
+}
 
-    if (!theOnlyPlatform->isContextValid(context)) {
-        return CL_INVALID_CONTEXT;
+void
+hsaReleaseProgramBinary(HsaProgramBinary *binary)
+{
+    if (--binary->refCount == 0) {
+        {
+            std::lock_guard<std::mutex> guard(hsaBinaryLock);
+            // calls entering from now on cannot reach the binary
+            binary->retireEpoch = hsaDescEpoch.fetch_add(1);
+            hsaRetiredBinaries.push_back(binary);
+        }
+        hsaReclaimBinaries();
     }
+}
 
-    switch (param_name) {
-      case CL_CONTEXT_REFERENCE_COUNT:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_uint);
-        }
+// Read the current kernels straight from the driver into a new code-object
+// image, leaving the state loaded by hsaDriverInit alone.
+static bool
+hsaReadDriverCodeObject(std::vector<uint8_t> &image)
+{
+    int fd = open("/dev/hsa", O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_uint)) {
-                *((cl_uint*)(param_value)) = context->getRefCount();
-            } else {
-                return CL_INVALID_VALUE;
-            }
-        }
+    HsaDriverSizes sizes;
+    HsaCodeObjectHeader hdr;
+    bool ok = !ioctl(fd, HSA_GET_SIZES, &sizes);
 
-        break;
-      case CL_CONTEXT_DEVICES:
-        if (param_value_size_ret) {
-           *param_value_size_ret =
-               sizeof(cl_device_id) * context->getNumDevices();
-        }
+    if (ok) {
+        hsaInitCodeObject(&hdr, sizes);
+        image.assign(hdr.size, 0);
 
-        if (param_value) {
-            if (param_value_size >=
-                sizeof(cl_device_id) * context->getNumDevices()) {
-                (*((cl_device_id *)(param_value))) = context->devList;
-            } else {
-                return CL_INVALID_VALUE;
-            }
-        }
-        break;
-      case CL_CONTEXT_PROPERTIES:
-        clFatal("clGetContextInfo: CL_CONTEXT_PROPERTIES not "
-                "yet implemented\n");
-        break;
-      default:
-        return CL_INVALID_VALUE;
+        ok = !ioctl(fd, HSA_GET_KINFO, &image[hdr.kernelInfoOffs]) &&
+             !ioctl(fd, HSA_GET_STRINGS, &image[hdr.stringTableOffs]) &&
+             !ioctl(fd, HSA_GET_CODE, &image[hdr.codeOffs]) &&
+             (!hdr.readonlySize ||
+              !ioctl(fd, HSA_GET_READONLY_DATA, &image[hdr.readonlyOffs]));
     }
 
-    return CL_SUCCESS;
+    close(fd);
+
+    if (!ok) {
+        DPRINT("hsaReadDriverCodeObject(): driver query failed\n");
+        return false;
+    }
+
+    hsaSealCodeObject(image, &hdr);
+
+    return true;
 }
 
-/* Command Queue APIs */
-CL_API_ENTRY cl_command_queue CL_API_CALL
-clCreateCommandQueue(cl_context context, cl_device_id device,
-                     cl_command_queue_properties properties,
-                     cl_int *errcode_ret)
-CL_API_SUFFIX__VERSION_1_0
-{
-    DPRINT("clCreateCommandQueue()\n");
+// Largest pattern accepted by clEnqueueFillBuffer. Every legal pattern size
+// is a power of two that divides it, so one line holds a whole number of
+// pattern repetitions.
+static const size_t FILL_LINE_SIZE = 128;
 
-    if (!theOnlyPlatform->isContextValid(context)) {
-        if (errcode_ret) {
-            *errcode_ret = CL_INVALID_CONTEXT;
-        }
+// Fills at least this large bypass the cache with non-temporal stores so
+// they do not evict the working set of the host or the dispatcher.
+static const size_t FILL_STREAM_THRESHOLD = 1024 * 1024;
 
-        return nullptr;
+static void
+fillPattern(char *dst, const void *pattern, size_t pattern_size, size_t size)
+{
+    // replicate the pattern over two lines so a full line can be loaded
+    // starting at any phase of the pattern
+    alignas(16) char line[2 * FILL_LINE_SIZE];
+    for (size_t i = 0; i < sizeof(line); i += pattern_size) {
+        memcpy(line + i, pattern, pattern_size);
     }
 
-    if (device->type != context->getDevType()
-        && !context->isValidDev(device)) {
-        if (errcode_ret) {
-            *errcode_ret = CL_INVALID_DEVICE;
+    // store the leading bytes needed to reach a 16 byte boundary
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    head = std::min(head, size);
+    memcpy(dst, line, head);
+    dst += head;
+    size -= head;
+
+    // the bytes following the head continue the pattern at phase 'head'
+    const char *src = line + head;
+    __m128i v0 = _mm_loadu_si128((const __m128i*)(src + 0));
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(src + 16));
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(src + 32));
+    __m128i v3 = _mm_loadu_si128((const __m128i*)(src + 48));
+    __m128i v4 = _mm_loadu_si128((const __m128i*)(src + 64));
+    __m128i v5 = _mm_loadu_si128((const __m128i*)(src + 80));
+    __m128i v6 = _mm_loadu_si128((const __m128i*)(src + 96));
+    __m128i v7 = _mm_loadu_si128((const __m128i*)(src + 112));
+
+    if (size >= FILL_STREAM_THRESHOLD) {
+        for (; size >= FILL_LINE_SIZE; size -= FILL_LINE_SIZE) {
+            __m128i *d = (__m128i*)dst;
+            _mm_stream_si128(d + 0, v0);
+            _mm_stream_si128(d + 1, v1);
+            _mm_stream_si128(d + 2, v2);
+            _mm_stream_si128(d + 3, v3);
+            _mm_stream_si128(d + 4, v4);
+            _mm_stream_si128(d + 5, v5);
+            _mm_stream_si128(d + 6, v6);
+            _mm_stream_si128(d + 7, v7);
+            dst += FILL_LINE_SIZE;
+        }
+        // order the streaming stores before the completion is signaled
+        _mm_sfence();
+    } else {
+        for (; size >= FILL_LINE_SIZE; size -= FILL_LINE_SIZE) {
+            __m128i *d = (__m128i*)dst;
+            _mm_store_si128(d + 0, v0);
+            _mm_store_si128(d + 1, v1);
+            _mm_store_si128(d + 2, v2);
+            _mm_store_si128(d + 3, v3);
+            _mm_store_si128(d + 4, v4);
+            _mm_store_si128(d + 5, v5);
+            _mm_store_si128(d + 6, v6);
+            _mm_store_si128(d + 7, v7);
+            dst += FILL_LINE_SIZE;
         }
+    }
 
-        return nullptr;
+    // each line is a whole number of patterns, so the tail keeps the phase
+    memcpy(dst, src, size);
+}
+
+// Rows up to this many bytes are moved with a few unaligned vector loads
+// and stores instead of a call to memcpy.
+static const size_t RECT_NARROW_ROW = 64;
+
+static inline void
+copyRow(char *dst, const char *src, size_t size)
+{
+    if (size >= 16 && size <= RECT_NARROW_ROW) {
+        // the final vector overlaps the previous one when size is not a
+        // multiple of 16
+        for (size_t i = 0; i + 16 < size; i += 16) {
+            _mm_storeu_si128((__m128i*)(dst + i),
+                             _mm_loadu_si128((const __m128i*)(src + i)));
+        }
+        _mm_storeu_si128((__m128i*)(dst + size - 16),
+                         _mm_loadu_si128((const __m128i*)(src + size - 16)));
+    } else if (size >= 8 && size < 16) {
+        _mm_storel_epi64((__m128i*)dst,
+                         _mm_loadl_epi64((const __m128i*)src));
+        _mm_storel_epi64((__m128i*)(dst + size - 8),
+                         _mm_loadl_epi64((const __m128i*)(src + size - 8)));
+    } else {
+        memcpy(dst, src, size);
     }
+}
 
-    if (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
-        clWarn("clCreateCommandQueue: CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE "
-               "not yet implemented\n");
+// Resolve the default pitches of a rectangular region and check that they
+// are large enough to hold it and that a slice of rows does not wrap.
+static cl_int
+rectPitches(const size_t *region, size_t *row_pitch, size_t *slice_pitch)
+{
+    if (!region || !region[0] || !region[1] || !region[2]) {
+        return CL_INVALID_VALUE;
     }
-    if (properties & CL_QUEUE_PROFILING_ENABLE) {
-        clWarn("clCreateCommandQueue: CL_QUEUE_PROFILING_ENABLE not yet "
-               "implemented\n");
+
+    if (*row_pitch == 0) {
+        *row_pitch = region[0];
+    } else if (*row_pitch < region[0]) {
+        return CL_INVALID_VALUE;
     }
-    if (properties & ~(CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE
-        | CL_QUEUE_PROFILING_ENABLE)) {
-        if (errcode_ret) {
-            *errcode_ret = CL_INVALID_QUEUE_PROPERTIES;
-        }
 
-        return nullptr;
+    if (*row_pitch > SIZE_MAX / region[1]) {
+        return CL_INVALID_VALUE;
     }
 
-    _cl_command_queue *CQ = device->addCQ();
-    if (errcode_ret) {
-        *errcode_ret = CL_SUCCESS;
+    if (*slice_pitch == 0) {
+        *slice_pitch = region[1] * *row_pitch;
+    } else if (*slice_pitch < region[1] * *row_pitch ||
+               *slice_pitch % *row_pitch) {
+        return CL_INVALID_VALUE;
     }
 
-    return CQ;
+    return CL_SUCCESS;
 }
 
-CL_API_ENTRY cl_mem CL_API_CALL
-clCreateBuffer(cl_context context, cl_mem_flags flags, size_t size,
-               void *host_ptr, cl_int *errcode_ret)
-CL_API_SUFFIX__VERSION_1_0
+// Byte offset one past the last byte of a rectangular region, with
+// pitches checked by rectPitches. Returns false if it does not fit a
+// size_t, since a wrapped extent would pass any bounds check.
+static bool
+rectExtent(const size_t *origin, const size_t *region, size_t row_pitch,
+           size_t slice_pitch, size_t *extent)
 {
-    DPRINT("clCreateBuffer()\n");
+    if (origin[0] > SIZE_MAX - region[0] ||
+        origin[1] > SIZE_MAX - region[1] ||
+        origin[2] > SIZE_MAX - region[2]) {
+        return false;
+    }
 
-    _cl_mem *buf;
+    size_t last_slice = origin[2] + region[2] - 1;
+    size_t last_row = origin[1] + region[1] - 1;
+    size_t row_end = origin[0] + region[0];
 
-    if (flags & CL_MEM_USE_HOST_PTR) {
-        buf = (_cl_mem *)host_ptr;
-        if (errcode_ret)
-            *errcode_ret = buf ? CL_SUCCESS :
-                                 CL_MEM_OBJECT_ALLOCATION_FAILURE;
-        DPRINT("returning from clCreateBuffer()\n");
-        return buf;
-    } else {
-        // Ensure the allocated buffer is cache block aligned so that
-        // coalescing is maximized and bandwidth is reduced.
-        posix_memalign((void**)&buf, 64, size);
+    if (last_slice > SIZE_MAX / slice_pitch ||
+        last_row > SIZE_MAX / row_pitch) {
+        return false;
     }
-    if (buf && (flags & CL_MEM_COPY_HOST_PTR)) {
-        memcpy(buf, host_ptr, size);
+
+    size_t slices = last_slice * slice_pitch;
+    size_t rows = last_row * row_pitch;
+
+    if (rows > SIZE_MAX - slices || row_end > SIZE_MAX - slices - rows) {
+        return false;
     }
-    if (errcode_ret)
-        *errcode_ret = buf ? CL_SUCCESS :
-                             CL_MEM_OBJECT_ALLOCATION_FAILURE;
-    memTracker.insert(buf);
-    DPRINT("returning from clCreateBuffer()\n");
 
-    return buf;
+    *extent = slices + rows + row_end;
+    return true;
 }
 
-CL_API_ENTRY cl_program CL_API_CALL
-clCreateProgramWithSource(cl_context context, cl_uint count,
-                          const char **strings, const size_t *lengths,
-                          cl_int *errcode_ret)
-CL_API_SUFFIX__VERSION_1_0
+static void
+copyRect(char *dst, const size_t *dst_origin, size_t dst_row_pitch,
+         size_t dst_slice_pitch, const char *src, const size_t *src_origin,
+         size_t src_row_pitch, size_t src_slice_pitch, const size_t *region)
 {
-    _cl_program *program;
-    // addSource sets the program
-    cl_int err = context->addSource(count, strings, lengths, &program);
-    // we set the error code if the programmer
-    // did not pass nullptr for errcode_ret
-    if (errcode_ret)
-      *errcode_ret = err;
+    dst += dst_origin[2] * dst_slice_pitch + dst_origin[1] * dst_row_pitch +
+           dst_origin[0];
+    src += src_origin[2] * src_slice_pitch + src_origin[1] * src_row_pitch +
+           src_origin[0];
+
+    size_t width = region[0];
+    size_t rows = region[1];
+    size_t slices = region[2];
+
+    // collapse rows, and then slices, that are contiguous on both sides
+    // into a single longer copy
+    if (src_row_pitch == width && dst_row_pitch == width) {
+        width *= rows;
+        rows = 1;
+        if (src_slice_pitch == width && dst_slice_pitch == width) {
+            width *= slices;
+            slices = 1;
+        }
+    }
 
-    return program;
+    for (size_t z = 0; z < slices; ++z) {
+        char *d = dst + z * dst_slice_pitch;
+        const char *s = src + z * src_slice_pitch;
+        for (size_t y = 0; y < rows; ++y) {
+            copyRow(d, s, width);
+            d += dst_row_pitch;
+            s += src_row_pitch;
+        }
+    }
 }
 
-extern CL_API_ENTRY cl_program CL_API_CALL
-clCreateProgramWithBinary(cl_context, cl_uint, const cl_device_id*,
-                          const size_t*, const unsigned char**,
-                          cl_int*, cl_int*)
-CL_API_SUFFIX__VERSION_1_0
+// Whether two regions of one buffer laid out with the same pitches share
+// a byte. This is the test of the OpenCL specification for
+// clEnqueueCopyBufferRect: the regions are apart if their spans are, or if
+// either fits in the gap the other leaves within a row or a slice.
+static bool
+rectsOverlap(const size_t *src_origin, const size_t *dst_origin,
+             const size_t *region, size_t row_pitch, size_t slice_pitch)
 {
-    DPRINT("clCreateProgramWithBinary()\n");
-    clWarn("clCreateProgramWithBinary unimplemented\n");
-}
+    size_t slice_size = (region[1] - 1) * row_pitch + region[0];
+    size_t block_size = (region[2] - 1) * slice_pitch + slice_size;
+    size_t src_start = src_origin[2] * slice_pitch +
+                       src_origin[1] * row_pitch + src_origin[0];
+    size_t dst_start = dst_origin[2] * slice_pitch +
+                       dst_origin[1] * row_pitch + dst_origin[0];
+
+    if (dst_start + block_size <= src_start ||
+        src_start + block_size <= dst_start) {
+        return false;
+    }
 
-CL_API_ENTRY cl_int CL_API_CALL
-clBuildProgram(cl_program program, cl_uint num_devices,
-               const cl_device_id *device_list, const char *options,
-               void (CL_CALLBACK *pfn_notify)(cl_program program,
-                                              void *user_data),
-               void *user_data)
-CL_API_SUFFIX__VERSION_1_0
-{
-    DPRINT("clBuildProgram()\n");
+    size_t src_dx = src_origin[0] % row_pitch;
+    size_t dst_dx = dst_origin[0] % row_pitch;
+    if ((dst_dx >= src_dx + region[0] &&
+         dst_dx + region[0] <= src_dx + row_pitch) ||
+        (src_dx >= dst_dx + region[0] &&
+         src_dx + region[0] <= dst_dx + row_pitch)) {
+        return false;
+    }
 
-    clWarn("clBuildProgram unimplemented\n");
+    size_t src_dy = (src_origin[1] * row_pitch + src_origin[0]) % slice_pitch;
+    size_t dst_dy = (dst_origin[1] * row_pitch + dst_origin[0]) % slice_pitch;
+    if ((dst_dy >= src_dy + slice_size &&
+         dst_dy + slice_size <= src_dy + slice_pitch) ||
+        (src_dy >= dst_dy + slice_size &&
+         src_dy + slice_size <= dst_dy + slice_pitch)) {
+        return false;
+    }
 
-    return CL_SUCCESS;
+    return true;
 }
 
-extern CL_API_ENTRY cl_int CL_API_CALL
-clGetProgramInfo(cl_program program, cl_program_info param_name,
-                 size_t param_value_size, void *param_value,
-                 size_t *param_value_size_ret)
-CL_API_SUFFIX__VERSION_1_0
-{
-    DPRINT("clGetProgramInfo()\n");
-    clWarn("clGetProgramInfo unimplemented\n");
+static const size_t IMAGE_TILE_DIM = 1 << CL_IMAGE_TILE_LOG2_HSA;
 
-    switch(param_name) {
-      case CL_PROGRAM_REFERENCE_COUNT:
-        clFatal("clGetProgramInfo: CL_PROGRAM_REFERENCE_COUNT not "
-                "yet implemented\n");
-        break;
-      case CL_PROGRAM_CONTEXT:
-        clFatal("clGetProgramInfo: CL_PROGRAM_CONTEXT not yet "
-                "implemented\n");
-        break;
-      case CL_PROGRAM_NUM_DEVICES:
-        clFatal("clGetProgramInfo: CL_PROGRAM_NUM_DEVICES not yet "
-                "implemented\n");
-        break;
-      case CL_PROGRAM_DEVICES:
-        clFatal("clGetProgramInfo: CL_PROGRAM_DEVICES not yet implemented\n");
-        break;
-      case CL_PROGRAM_SOURCE:
-        clFatal("clGetProgramInfo: CL_PROGRAM_SOURCE not yet implemented\n");
+// bytes per texel of an image format, or 0 if it is not supported
+static size_t
+imageElementSize(const cl_image_format *format)
+{
+    size_t channel_size;
+    switch (format->image_channel_data_type) {
+      case CL_SNORM_INT8:
+      case CL_UNORM_INT8:
+      case CL_SIGNED_INT8:
+      case CL_UNSIGNED_INT8:
+        channel_size = 1;
         break;
-      case CL_PROGRAM_BINARY_SIZES:
-        clFatal("clGetProgramInfo: CL_PROGRAM_BINARY_SIZES not yet "
-                "implemented\n");
+      case CL_SNORM_INT16:
+      case CL_UNORM_INT16:
+      case CL_SIGNED_INT16:
+      case CL_UNSIGNED_INT16:
+      case CL_HALF_FLOAT:
+        channel_size = 2;
         break;
-      case CL_PROGRAM_BINARIES:
-        clFatal("clGetProgramInfo: CL_PROGRAM_BINARIES not yet "
-                "implemented\n");
+      case CL_SIGNED_INT32:
+      case CL_UNSIGNED_INT32:
+      case CL_FLOAT:
+        channel_size = 4;
         break;
+      case CL_UNORM_SHORT_565:
+      case CL_UNORM_SHORT_555:
+        return format->image_channel_order == CL_RGB ? 2 : 0;
+      case CL_UNORM_INT_101010:
+        return format->image_channel_order == CL_RGB ? 4 : 0;
       default:
-        return CL_INVALID_VALUE;
+        return 0;
     }
 
-    return CL_SUCCESS;
+    switch (format->image_channel_order) {
+      case CL_R:
+      case CL_A:
+        return channel_size;
+      case CL_INTENSITY:
+      case CL_LUMINANCE:
+        // only defined for formats with 8 or more bits per channel
+        return format->image_channel_data_type == CL_SIGNED_INT8 ||
+               format->image_channel_data_type == CL_UNSIGNED_INT8 ||
+               format->image_channel_data_type == CL_SIGNED_INT16 ||
+               format->image_channel_data_type == CL_UNSIGNED_INT16 ||
+               format->image_channel_data_type == CL_SIGNED_INT32 ||
+               format->image_channel_data_type == CL_UNSIGNED_INT32 ?
+               0 : channel_size;
+      case CL_RG:
+      case CL_RA:
+        return 2 * channel_size;
+      case CL_RGBA:
+        return 4 * channel_size;
+      case CL_BGRA:
+      case CL_ARGB:
+        return channel_size == 1 ? 4 : 0;
+      default:
+        return 0;
+    }
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-clGetProgramBuildInfo(cl_program, cl_device_id, cl_program_build_info,
-                      size_t, void*, size_t*)
-CL_API_SUFFIX__VERSION_1_0
+// position of texel (x, y) on the Morton curve of an 8x8 tile
+static inline uint32_t
+mortonIndex(uint32_t x, uint32_t y)
 {
-    DPRINT("clGetProgramBuildInfo()\n");
-    clWarn("clGetProgramBuildInfo unimplemented\n");
+    return (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2) |
+           ((x & 4) << 2) | ((y & 4) << 3);
 }
 
-/* Kernel Object APIs */
-CL_API_ENTRY cl_kernel CL_API_CALL
-clCreateKernel(cl_program program, const char *kernel_name,
-               cl_int *errcode_ret)
-CL_API_SUFFIX__VERSION_1_0
+// Move a full 8x8 tile of 4 or 8 byte texels between linear host rows and
+// Morton order. Every 2x2 quad of the tile is contiguous, so a quad is put
+// together from two host rows with one 64-bit unpack.
+static void
+swizzleTile(char *tile, char *host, size_t row_pitch, size_t element_size,
+            bool to_image)
 {
-    DPRINT("clCreateKernel()\n");
+    for (uint32_t y = 0; y < IMAGE_TILE_DIM; y += 2) {
+        char *row0 = host + y * row_pitch;
+        char *row1 = row0 + row_pitch;
+
+        if (element_size == 4) {
+            for (uint32_t x = 0; x < IMAGE_TILE_DIM; x += 4) {
+                __m128i *quad0 = (__m128i*)(tile + mortonIndex(x, y) * 4);
+                __m128i *quad1 = (__m128i*)(tile + mortonIndex(x + 2, y) * 4);
+                __m128i *r0 = (__m128i*)(row0 + x * 4);
+                __m128i *r1 = (__m128i*)(row1 + x * 4);
+
+                if (to_image) {
+                    __m128i a = _mm_loadu_si128(r0);
+                    __m128i b = _mm_loadu_si128(r1);
+                    _mm_store_si128(quad0, _mm_unpacklo_epi64(a, b));
+                    _mm_store_si128(quad1, _mm_unpackhi_epi64(a, b));
+                } else {
+                    __m128i a = _mm_load_si128(quad0);
+                    __m128i b = _mm_load_si128(quad1);
+                    _mm_storeu_si128(r0, _mm_unpacklo_epi64(a, b));
+                    _mm_storeu_si128(r1, _mm_unpackhi_epi64(a, b));
+                }
+            }
+        } else {
+            for (uint32_t x = 0; x < IMAGE_TILE_DIM; x += 2) {
+                __m128i *quad = (__m128i*)(tile + mortonIndex(x, y) * 8);
+                __m128i *r0 = (__m128i*)(row0 + x * 8);
+                __m128i *r1 = (__m128i*)(row1 + x * 8);
+
+                if (to_image) {
+                    _mm_store_si128(quad, _mm_loadu_si128(r0));
+                    _mm_store_si128(quad + 1, _mm_loadu_si128(r1));
+                } else {
+                    _mm_storeu_si128(r0, _mm_load_si128(quad));
+                    _mm_storeu_si128(r1, _mm_load_si128(quad + 1));
+                }
+            }
+        }
+    }
+}
 
-    // init driver in case this is the first call.  this call will
-    // return if the driver is already initialized.
-    hsaDriverInit();
+// Copy a region between an image and linear host memory with the given
+// pitches, tiling on the way in and untiling on the way out.
+static void
+transferImage(const cl_image_layout_hsa *img, const size_t *origin,
+              const size_t *region, char *host, size_t row_pitch,
+              size_t slice_pitch, bool to_image)
+{
+    size_t es = img->element_size;
+    size_t x_end = origin[0] + region[0];
+    size_t y_end = origin[1] + region[1];
+
+    for (size_t z = 0; z < region[2]; ++z) {
+        char *slice = (char*)img->data + (origin[2] + z) * img->slice_size;
+        char *host_slice = host + z * slice_pitch;
+
+        for (size_t ty = origin[1] / IMAGE_TILE_DIM;
+             ty * IMAGE_TILE_DIM < y_end; ++ty) {
+            size_t y0 = ty * IMAGE_TILE_DIM;
+
+            for (size_t tx = origin[0] / IMAGE_TILE_DIM;
+                 tx * IMAGE_TILE_DIM < x_end; ++tx) {
+                size_t x0 = tx * IMAGE_TILE_DIM;
+                char *tile = slice +
+                    (ty * img->tiles_per_row + tx) * img->tile_size;
+
+                bool full_tile = x0 >= origin[0] &&
+                                 x0 + IMAGE_TILE_DIM <= x_end &&
+                                 y0 >= origin[1] &&
+                                 y0 + IMAGE_TILE_DIM <= y_end;
+
+                if (full_tile && (es == 4 || es == 8)) {
+                    swizzleTile(tile, host_slice +
+                                (y0 - origin[1]) * row_pitch +
+                                (x0 - origin[0]) * es,
+                                row_pitch, es, to_image);
+                    continue;
+                }
 
-    const int MAX_KERNEL_NAME_LENGTH = 256; // totally arbitrary
-    char long_kernel_name[MAX_KERNEL_NAME_LENGTH];
-    snprintf(long_kernel_name, MAX_KERNEL_NAME_LENGTH,
-             "__OpenCL_%s_kernel", kernel_name);
+                // partial tiles and other texel sizes go texel by texel
+                size_t y_lo = std::max(y0, origin[1]);
+                size_t y_hi = std::min(y0 + IMAGE_TILE_DIM, y_end);
+                size_t x_lo = std::max(x0, origin[0]);
+                size_t x_hi = std::min(x0 + IMAGE_TILE_DIM, x_end);
+
+                for (size_t y = y_lo; y < y_hi; ++y) {
+                    char *host_row = host_slice + (y - origin[1]) * row_pitch;
+                    for (size_t x = x_lo; x < x_hi; ++x) {
+                        char *texel = tile + mortonIndex(x, y) * es;
+                        char *h = host_row + (x - origin[0]) * es;
+                        if (to_image) {
+                            memcpy(texel, h, es);
+                        } else {
+                            memcpy(h, texel, es);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static cl_mem
+createImage(cl_mem_flags flags, const cl_image_format *image_format,
+            size_t width, size_t height, size_t depth, size_t row_pitch,
+            size_t slice_pitch, void *host_ptr, cl_int *errcode_ret)
+{
+    cl_int ret = CL_SUCCESS;
+    size_t es = image_format ? imageElementSize(image_format) : 0;
+    size_t max_dim = depth > 1 ? MAX_IMAGE3D_DIM : MAX_IMAGE2D_DIM;
+
+    if (!image_format) {
+        ret = CL_INVALID_IMAGE_FORMAT_DESCRIPTOR;
+    } else if (!es) {
+        ret = CL_IMAGE_FORMAT_NOT_SUPPORTED;
+    } else if (!width || !height || !depth || width > max_dim ||
+               height > max_dim || depth > max_dim) {
+        ret = CL_INVALID_IMAGE_SIZE;
+    } else if (flags & CL_MEM_USE_HOST_PTR) {
+        // tiled storage cannot alias a linear host allocation
+        ret = CL_INVALID_VALUE;
+    } else if (!host_ptr != !(flags & CL_MEM_COPY_HOST_PTR)) {
+        ret = CL_INVALID_HOST_PTR;
+    } else {
+        if (row_pitch == 0) {
+            row_pitch = width * es;
+        }
+        if (slice_pitch == 0) {
+            slice_pitch = row_pitch * height;
+        }
+        if (row_pitch < width * es || slice_pitch < row_pitch * height) {
+            ret = CL_INVALID_IMAGE_SIZE;
+        }
+    }
 
-    DPRINT("clCreateKernel() %s\n", long_kernel_name);
+    cl_image_layout_hsa *img = nullptr;
+    void *data = nullptr;
 
-    _cl_kernel *kernel = nullptr;
-    for (int i = 0; i < hsaDriverSizes.num_kernels; ++i) {
-        const HsaKernelInfo *kinfo = &hsaKernelInfo[i];
-        const char *chk_name = &hsaStringTable[kinfo->name_offs];
-        if (!strcmp(long_kernel_name, chk_name)) {
-            kernel = new _cl_kernel(kernel_name, &hsaCode[kinfo->code_offs],
-            kinfo->sRegCount, kinfo->dRegCount,
-            kinfo->cRegCount, kinfo->private_mem_size,
-            kinfo->spill_mem_size,
-            kinfo->static_lds_size);
-            break;
-         }
+    if (ret == CL_SUCCESS) {
+        img = new cl_image_layout_hsa();
+        img->width = width;
+        img->height = height;
+        img->depth = depth;
+        img->element_size = es;
+        img->tiles_per_row = divCeil(width, IMAGE_TILE_DIM);
+        img->tiles_per_column = divCeil(height, IMAGE_TILE_DIM);
+        img->tile_size = IMAGE_TILE_DIM * IMAGE_TILE_DIM * es;
+        img->slice_size =
+            img->tile_size * img->tiles_per_row * img->tiles_per_column;
+        img->channel_order = image_format->image_channel_order;
+        img->channel_data_type = image_format->image_channel_data_type;
+
+        if (posix_memalign(&data, 64, img->slice_size * depth)) {
+            delete img;
+            img = nullptr;
+            ret = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        } else {
+            img->data = (cl_ulong)data;
+        }
     }
 
-    if (!kernel) {
-        fprintf(stderr, "Can't find kernel %s\n", kernel_name);
-        if (errcode_ret)
-            *errcode_ret = CL_INVALID_KERNEL_NAME;
+    if (errcode_ret) {
+        *errcode_ret = ret;
+    }
 
+    if (ret != CL_SUCCESS) {
         return nullptr;
     }
 
-    cl_int tmp = program->addFunction(kernel);
+    if (host_ptr) {
+        size_t origin[3] = { 0, 0, 0 };
+        size_t region[3] = { width, height, depth };
+        transferImage(img, origin, region, (char*)host_ptr, row_pitch,
+                      slice_pitch, true);
+    }
 
-    if (tmp == CL_SUCCESS) {
-        if (errcode_ret) {
-            *errcode_ret = tmp;
-        }
-        return kernel;
-    } else {
-        if (errcode_ret)
-            *errcode_ret = CL_BUILD_ERROR;
+    cl_mem image = (cl_mem)img;
+    imageTracker.insert(image);
 
-        return nullptr;
-    }
+    return image;
 }
 
-/* Device APIs */
-CL_API_ENTRY cl_int CL_API_CALL
-clGetDeviceIDs(cl_platform_id platform, cl_device_type device_type,
-               cl_uint num_entries, cl_device_id *devices,
-               cl_uint *num_devices)
-CL_API_SUFFIX__VERSION_1_0
+// Look up the extent of a buffer or sub-buffer handle. Returns false for
+// values that are not buffers this runtime handed out.
+static bool
+bufferExtent(cl_mem handle, size_t *size)
 {
-    DPRINT("clGetDeviceIDs()\n");
-
-    if (!platform || platform->ID != theOnlyPlatform->getID()->ID) {
-        return CL_INVALID_PLATFORM;
+    if (memSize.get(handle, size)) {
+        return true;
     }
 
-    if (device_type & ~(CL_DEVICE_TYPE_ALL | CL_DEVICE_TYPE_CPU |
-        CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR |
-        CL_DEVICE_TYPE_DEFAULT) ) {
-        return CL_INVALID_DEVICE_TYPE;
-    }
-
-    if ((!num_entries && devices) || (!num_devices && !devices)) {
-        return CL_INVALID_VALUE;
+    subBufDesc sub_buf;
+    if (subBufTracker.get(handle, &sub_buf)) {
+        *size = sub_buf.size;
+        return true;
     }
 
-    cl_uint max_dev = 0;
-    if (num_devices) {
-        if (device_type & CL_DEVICE_TYPE_ALL) {
-            *num_devices = theOnlyPlatform->numGPUs() +
-                            theOnlyPlatform->numCPUs();
-        } else {
-            *num_devices = 0;
-            if (device_type & CL_DEVICE_TYPE_CPU) {
-                *num_devices += theOnlyPlatform->numGPUs();
-            }
-            if (device_type & CL_DEVICE_TYPE_GPU) {
-                *num_devices += theOnlyPlatform->numCPUs();
-            }
-        }
-        max_dev = *num_devices;
-    }
+    return false;
+}
 
-    cl_uint num_dev_returned = 0;
-    if (devices) {
-        num_dev_returned += theOnlyPlatform->getGPUs(devices, num_entries);
-        num_dev_returned +=
-            theOnlyPlatform->getCPUs(devices, num_entries - num_dev_returned);
-    }
+// SVM allocations by start address, with their sizes. The map is ordered
+// so that a pointer into the middle of an allocation finds it.
+static std::map<uintptr_t, size_t> svmAllocs;
+static std::mutex svmLock;
 
-    if (!(max_dev || num_dev_returned)) {
-        return CL_DEVICE_NOT_FOUND;
+// True if ptr points into a live SVM allocation.
+static bool
+svmContains(const void *ptr)
+{
+    std::lock_guard<std::mutex> guard(svmLock);
+    auto it = svmAllocs.upper_bound((uintptr_t)ptr);
+    if (it == svmAllocs.begin()) {
+        return false;
     }
 
-    return CL_SUCCESS;
+    --it;
+    return (uintptr_t)ptr - it->first < it->second;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-clGetDeviceInfo(cl_device_id device, cl_device_info param_name,
-                size_t param_value_size, void *param_value,
-                size_t *param_value_size_ret)
-CL_API_SUFFIX__VERSION_1_0
+// True if handle is a buffer or sub-buffer that [offset, offset + size)
+// does not fit in. Handles the runtime never sized, such as host pointers
+// passed straight through, pass.
+static bool
+beyondBuffer(cl_mem handle, size_t offset, size_t size)
 {
-    DPRINT("clGetDeviceInfo()\n");
+    size_t extent;
+    return bufferExtent(handle, &extent) &&
+           !hsaInBounds(offset, size, extent);
+}
 
-    // init driver in case this is the first call.  this call will
-    // return if the driver is already initialized.
-    hsaDriverInit();
+// Pages locked for buffers, with the number of locked buffers on each.
+// Buffers can share a page, which stays locked until the last of them is
+// released. The lock is held across mlock and munlock so that a page is
+// never unlocked under a buffer that just counted it.
+static std::map<uintptr_t, uint32_t> lockedPages;
+static std::mutex lockedPagesLock;
 
-    int vector_width = 0;
+// The whole pages covering [handle, handle + size).
+static void
+pageSpan(cl_mem handle, size_t size, char **start, size_t *len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    *start = (char*)((uintptr_t)handle & ~(page - 1));
+    *len = ((char*)handle + size - *start + page - 1) & ~(page - 1);
+}
 
-    if (!theOnlyPlatform->isValidDev(device)) {
-        return CL_INVALID_DEVICE;
+// Lock [start, start + len) for one more buffer. Returns the number of
+// pages no buffer had locked before, or -1 if mlock failed.
+static int64_t
+lockPages(char *start, size_t len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    std::lock_guard<std::mutex> guard(lockedPagesLock);
+
+    if (mlock(start, len)) {
+        return -1;
     }
 
-    if (param_value_size_ret) {
-        *param_value_size_ret = 0;
+    int64_t added = 0;
+    for (size_t offs = 0; offs < len; offs += page) {
+        added += lockedPages[(uintptr_t)start + offs]++ == 0;
     }
 
-    char *strRet = (char*)param_value;
-    const char *strSrc;
-    switch (param_name) {
-      case CL_DEVICE_TYPE:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_device_type);
-        }
+    return added;
+}
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_device_type)) {
-               *((cl_device_type*)(param_value)) = CL_DEVICE_TYPE_GPU;
-            } else {
-               return CL_INVALID_VALUE;
+// Drop one buffer from [start, start + len), unlocking the runs of pages
+// no other buffer holds.
+static void
+unlockPages(char *start, size_t len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    std::lock_guard<std::mutex> guard(lockedPagesLock);
+    char *run = nullptr;
+
+    for (size_t offs = 0; offs <= len; offs += page) {
+        bool last = false;
+
+        if (offs < len) {
+            auto it = lockedPages.find((uintptr_t)start + offs);
+            if (it != lockedPages.end() && --it->second == 0) {
+                lockedPages.erase(it);
+                last = true;
             }
         }
-        break;
-      case CL_DEVICE_VENDOR_ID:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_uint);
+
+        if (last && !run) {
+            run = start + offs;
+        } else if (!last && run) {
+            munlock(run, start + offs - run);
+            run = nullptr;
         }
+    }
+}
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_uint)) {
-               *((cl_uint*)(param_value)) = 0;
+// Fault in the pages of [ptr, ptr + size) on the host so the device does
+// not take the much more expensive faults in its own translation path.
+// Optionally lock them so they stay resident. Returns the number of pages
+// that were not resident beforehand.
+static uint64_t
+prefaultRange(cl_mem handle, size_t size, bool lock,
+              _cl_command_queue *command_queue)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *start;
+    size_t len;
+    pageSpan(handle, size, &start, &len);
+    size_t num_pages = len / page;
+
+    std::vector<unsigned char> resident(num_pages);
+    if (mincore(start, len, resident.data())) {
+        return 0;
+    }
+
+    uint64_t missing = 0;
+    for (size_t i = 0; i < num_pages; ++i) {
+        missing += !(resident[i] & 1);
+    }
+
+    if (lock) {
+        // mlock populates the range as a side effect
+        if (lockedMem.insert(handle, size)) {
+            int64_t added = lockPages(start, len);
+            if (added >= 0) {
+                command_queue->pagesLocked += added;
             } else {
-               return CL_INVALID_VALUE;
+                lockedMem.erase(handle);
             }
         }
-        break;
-      case CL_DEVICE_MAX_COMPUTE_UNITS:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_uint);
+    } else if (missing) {
+#ifdef MADV_POPULATE_WRITE
+        // read-only mappings cannot be populated for writing
+        if (madvise(start, len, MADV_POPULATE_WRITE) &&
+            madvise(start, len, MADV_POPULATE_READ)) {
+            madvise(start, len, MADV_WILLNEED);
         }
-
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_uint)) {
-                *((cl_uint*)(param_value)) = numCUs;
-            } else {
-               return CL_INVALID_VALUE;
+#else
+        madvise(start, len, MADV_WILLNEED);
+        for (size_t i = 0; i < num_pages; ++i) {
+            if (!(resident[i] & 1)) {
+                (void)*(volatile char*)(start + i * page);
             }
         }
-        break;
-      case CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_uint);
-        }
+#endif
+    }
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_uint)) {
-               *((cl_uint*)(param_value)) = MAX_WI_DIM;
-            } else {
-               return CL_INVALID_VALUE;
-            }
+    command_queue->pagesPrefaulted += missing;
+
+    return missing;
+}
+
+static void
+prefaultKernelArgs(_cl_command_queue *command_queue, _cl_kernel *kernel)
+{
+    bool lock = command_queue->properties & CL_QUEUE_PREFAULT_MLOCK_HSA;
+
+    for (size_t i = DEFAULT_OCL_KERN_ARGS; i < kernel->argList.size(); ++i) {
+        const argDesc &arg = kernel->argList[i];
+        if (!arg.hasValue || arg.size != sizeof(cl_mem)) {
+            continue;
         }
-        break;
-      case CL_DEVICE_MAX_WORK_ITEM_SIZES:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(size_t) * 3;
+
+        cl_mem handle = *(cl_mem*)arg.contents();
+        size_t size;
+        if (bufferExtent(handle, &size)) {
+            prefaultRange(handle, size, lock, command_queue);
         }
+    }
+}
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_uint)) {
-                size_t *ret = (size_t*)(param_value);
-                ret[0] = MAX_WI_DIM0;
-                ret[1] = MAX_WI_DIM1;
-                ret[2] = MAX_WI_DIM2;
-            } else {
-               return CL_INVALID_VALUE;
+// Record the argument signature of a kernel from the arguments of a launch
+// that set them all. An argument set with a null value is __local; one
+// holding a memory object or an SVM pointer this runtime handed out is a
+// __global pointer; anything else is passed by value with its natural
+// alignment. The first launch to get here wins when several race on one
+// descriptor.
+static void
+captureArgSignature(const _cl_kernel *kernel, kernelDesc *desc)
+{
+    std::lock_guard<std::mutex> guard(desc->argsLock);
+    if (desc->argsCaptured) {
+        return;
+    }
+
+    size_t num_args = kernel->argList.size() > DEFAULT_OCL_KERN_ARGS ?
+        kernel->argList.size() - DEFAULT_OCL_KERN_ARGS : 0;
+
+    desc->args.resize(num_args);
+
+    for (size_t i = 0; i < num_args; ++i) {
+        const argDesc &arg = kernel->argList[i + DEFAULT_OCL_KERN_ARGS];
+        kernelArgMeta &meta = desc->args[i];
+
+        meta.size = arg.size;
+        meta.isPointer = false;
+        meta.addressQualifier = CL_KERNEL_ARG_ADDRESS_PRIVATE;
+
+        if (arg.localSize) {
+            meta.isPointer = true;
+            meta.addressQualifier = CL_KERNEL_ARG_ADDRESS_LOCAL;
+        } else if (arg.size == sizeof(cl_mem)) {
+            cl_mem handle = *(cl_mem*)arg.contents();
+            size_t size;
+            if (bufferExtent(handle, &size) || imageTracker.get(handle) ||
+                svmContains(handle)) {
+                meta.isPointer = true;
+                meta.addressQualifier = CL_KERNEL_ARG_ADDRESS_GLOBAL;
             }
         }
-        break;
-      case CL_DEVICE_MAX_WORK_GROUP_SIZE:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(size_t);
-        }
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_uint)) {
-               *((size_t*)(param_value)) = MAX_WG_SIZE;
-            } else {
-               return CL_INVALID_VALUE;
-            }
+        // largest power of two dividing the size, as for OpenCL types
+        meta.alignment = std::min<size_t>(meta.size & -meta.size, 128);
+    }
+
+    desc->argsCaptured.store(true, std::memory_order_release);
+}
+
+// Check the arguments of a launch before they are laid out in the kernarg
+// segment. Every argument must be set, since a hole would shift the ones
+// after it. Once the signature is known, the arguments must match it in
+// number, size and kind, whichever instance or thread set them; until
+// then, the first launch whose arguments are all set records it.
+static cl_int
+checkLaunchArgs(const _cl_kernel *kernel, kernelDesc *desc)
+{
+    size_t num_args = kernel->argList.size() > DEFAULT_OCL_KERN_ARGS ?
+        kernel->argList.size() - DEFAULT_OCL_KERN_ARGS : 0;
+
+    for (size_t i = 0; i < num_args; ++i) {
+        const argDesc &arg = kernel->argList[i + DEFAULT_OCL_KERN_ARGS];
+        if (!arg.hasValue && !arg.localSize) {
+            return CL_INVALID_KERNEL_ARGS;
         }
-        break;
-      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(char) : vector_width;
-      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(cl_half) : vector_width;
-      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(short) : vector_width;
-      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(int) : vector_width;
-      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(long) : vector_width;
-      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(float) : vector_width;
-      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(double) : vector_width;
-        DPRINT("vector_width = %d\n", vector_width);
+    }
 
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_uint);
+    if (!desc->argsCaptured.load(std::memory_order_acquire)) {
+        captureArgSignature(kernel, desc);
+        return CL_SUCCESS;
+    }
+
+    const std::vector<kernelArgMeta> &sig = desc->args;
+    if (num_args != sig.size()) {
+        return CL_INVALID_KERNEL_ARGS;
+    }
+
+    for (size_t i = 0; i < num_args; ++i) {
+        const argDesc &arg = kernel->argList[i + DEFAULT_OCL_KERN_ARGS];
+        bool local = sig[i].addressQualifier == CL_KERNEL_ARG_ADDRESS_LOCAL;
+
+        if (local != !!arg.localSize || arg.size != sig[i].size) {
+            return CL_INVALID_KERNEL_ARGS;
         }
+    }
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_uint)) {
-               *((cl_uint*)(param_value)) = vector_width;
-            } else {
-               return CL_INVALID_VALUE;
-            }
+    return CL_SUCCESS;
+}
+
+// Lay out the arguments of a kernel in the kernarg segment. Each argument
+// starts at a multiple of its own size. Fills offsets, if given, and
+// returns the bytes used.
+static size_t
+kernargLayout(const _cl_kernel *kernel, uint32_t *offsets)
+{
+    size_t offset = 0;
+
+    for (size_t i = 0; i < kernel->argList.size(); i++) {
+        size_t size = kernel->argList[i].size;
+
+        if (size && offset % size) {
+            offset += size - offset % size;
         }
-        break;
-      case CL_DEVICE_NATIVE_VECTOR_WIDTH_CHAR:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(char) : vector_width;
-      case CL_DEVICE_NATIVE_VECTOR_WIDTH_HALF:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(cl_half) : vector_width;
-      case CL_DEVICE_NATIVE_VECTOR_WIDTH_SHORT:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(short) : vector_width;
-      case CL_DEVICE_NATIVE_VECTOR_WIDTH_INT:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(int) : vector_width;
-      case CL_DEVICE_NATIVE_VECTOR_WIDTH_LONG:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(long) : vector_width;
-      case CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(float) : vector_width;
-      case CL_DEVICE_NATIVE_VECTOR_WIDTH_DOUBLE:
-        vector_width = !vector_width ?
-            VecSize * sizeof(double) / sizeof(double) : vector_width;
-        DPRINT("vector_width = %d\n", vector_width);
 
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_uint);
+        if (offsets) {
+            offsets[i] = offset;
         }
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_uint)) {
-               *((cl_uint*)(param_value)) = vector_width;
-            } else {
-               return CL_INVALID_VALUE;
+        offset += size;
+    }
+
+    return offset;
+}
+
+// The platform and its devices, created by whichever thread gets here
+// first.
+static platform *
+getPlatform()
+{
+    std::call_once(platformInitFlag, [] {
+        theOnlyPlatform = new platform();
+    });
+
+    return theOnlyPlatform;
+}
+
+// opencl api implementation
+
+/* Platform API */
+CL_API_ENTRY cl_int CL_API_CALL
+clGetPlatformIDs(cl_uint num_entries, cl_platform_id *platforms,
+                 cl_uint *num_platforms)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetPlatformIDs()\n");
+
+    hsaDriverLoader.start();
+
+    if ((!num_entries && platforms) ||
+       (!num_platforms && !platforms)) {
+        return CL_INVALID_VALUE;
+    } else if ((platforms) && (num_entries > 0)) {
+       platforms[0] = getPlatform()->getID();
+    } else if (num_platforms) {
+        *num_platforms = 1;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clGetPlatformInfo(cl_platform_id platform, cl_platform_info param_name,
+                  size_t param_value_size, void *param_value,
+                  size_t *param_value_size_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetPlatformInfo()\n");
+
+    if (!platform || platform->ID != getPlatform()->getID()->ID) {
+        return CL_INVALID_PLATFORM;
+    }
+
+    if (param_value_size_ret) {
+        *param_value_size_ret = 0;
+    }
+
+    char *ret = (char*)param_value;
+    const char *src;
+
+    switch(param_name) {
+      case CL_PLATFORM_PROFILE:
+        src = "FULL_PROFILE";
+        if (param_value_size > strlen(src)) {
+            strcpy(ret, src);
+            if (param_value_size_ret) {
+                *param_value_size_ret = sizeof(src);
             }
         }
         break;
-      case CL_DEVICE_MAX_CLOCK_FREQUENCY:
-        clWarn("clGetDeviceInfo: ignoring request for "
-               "CL_DEVICE_MAX_CLOCK_FREQUENCY...\n");
-        break;
-      case CL_DEVICE_ADDRESS_BITS:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_uint);
-        }
-
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_uint)) {
-               *((cl_uint*)(param_value)) = sizeof(void*) * 8;
-            } else {
-               return CL_INVALID_VALUE;
+      case CL_PLATFORM_VERSION:
+        src = "OpenCL 1.0";
+        if (param_value_size > strlen(src)) {
+            strcpy(ret, src);
+            if (param_value_size_ret) {
+                *param_value_size_ret = sizeof(src);
             }
         }
         break;
-        clWarn("clGetDeviceInfo: ignoring request for "
-               "CL_DEVICE_ADDRESS_BITS...\n");
-        break;
-      case CL_DEVICE_MAX_MEM_ALLOC_SIZE:
-        clWarn("clGetDeviceInfo: ignoring request for "
-               "CL_DEVICE_MAX_MEM_ALLOC_SIZE...\n");
-        break;
-      case CL_DEVICE_IMAGE_SUPPORT:
-        clWarn("clGetDeviceInfo: ignoring request for "
-               "CL_DEVICE_IMAGE_SUPPORT...\n");
-        break;
-      case CL_DEVICE_MAX_READ_IMAGE_ARGS:
-        clWarn("clGetDeviceInfo: ignoring request for "
-               "CL_DEVICE_MAX_READ_IMAGE_ARGS...\n");
-        break;
-      case CL_DEVICE_MAX_WRITE_IMAGE_ARGS:
-        clWarn("clGetDeviceInfo: CL_DEVICE_MAX_WRITE_IMAGE_ARGS not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_IMAGE2D_MAX_WIDTH:
-        clWarn("clGetDeviceInfo: CL_DEVICE_IMAGE2D_MAX_WIDTH not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_IMAGE2D_MAX_HEIGHT:
-        clWarn("clGetDeviceInfo: CL_DEVICE_IMAGE2D_MAX_HEIGHT not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_IMAGE3D_MAX_WIDTH:
-        clWarn("clGetDeviceInfo: CL_DEVICE_IMAGE3D_MAX_WIDTH not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_IMAGE3D_MAX_HEIGHT:
-        clWarn("clGetDeviceInfo: CL_DEVICE_IMAGE3D_MAX_HEIGHT not "
-               "implemented\n");
-        break;
-     case CL_DEVICE_IMAGE3D_MAX_DEPTH:
-        clWarn("clGetDeviceInfo: CL_DEVICE_IMAGE3D_MAX_DEPTH not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_MAX_SAMPLERS:
-        clWarn("clGetDeviceInfo: CL_DEVICE_MAX_SAMPLERS not implemented\n");
-        break;
-      case CL_DEVICE_MAX_PARAMETER_SIZE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_MAX_PARAMETER_SIZE not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_MEM_BASE_ADDR_ALIGN:
-        clWarn("clGetDeviceInfo: CL_DEVICE_MEM_BASE_ADDR_ALIGN not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_SINGLE_FP_CONFIG:
-        clWarn("clGetDeviceInfo: CL_DEVICE_SINGLE_FP_CONFIG not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_DOUBLE_FP_CONFIG:
-        clWarn("clGetDeviceInfo: CL_DEVICE_DOUBLE_FP_CONFIG not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_GLOBAL_MEM_CACHE_TYPE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_GLOBAL_MEM_CACHE_TYPE not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_GLOBAL_MEM_CACHE_SIZE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_GLOBAL_MEM_CACHE_SIZE not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_GLOBAL_MEM_SIZE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_GLOBAL_MEM_SIZE not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_MAX_CONSTANT_ARGS:
-        clWarn("clGetDeviceInfo: CL_DEVICE_MAX_CONSTANT_ARGS not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_LOCAL_MEM_TYPE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_LOCAL_MEM_TYPE not implemented\n");
-        break;
-      case CL_DEVICE_LOCAL_MEM_SIZE:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(unsigned long long);
+      case CL_PLATFORM_NAME:
+        src = "ATI Stream";
+        if (param_value_size > strlen(src)) {
+            strcpy(ret, src);
+            if (param_value_size_ret) {
+                *param_value_size_ret = sizeof(src);
+            }
         }
-
-        if (param_value) {
-            if (param_value_size >= sizeof(unsigned long long)) {
-               *((unsigned long long*)(param_value)) = MAX_LDS_SIZE;
-            } else {
-               return CL_INVALID_VALUE;
+        break;
+      case CL_PLATFORM_VENDOR:
+        src = "Advanced Micro Devices, Inc.";
+        if (param_value_size > strlen(src)) {
+            strcpy(ret, src);
+            if (param_value_size_ret) {
+                *param_value_size_ret = sizeof(src);
             }
         }
         break;
-      case CL_DEVICE_ERROR_CORRECTION_SUPPORT:
-        clWarn("clGetDeviceInfo: CL_DEVICE_ERROR_CORRECTION_SUPPORT not "
-               "implemented\n");
+      case CL_PLATFORM_EXTENSIONS:
+        src = "";
+        if (param_value_size > strlen(src)) {
+            strcpy(ret, src);
+            if (param_value_size_ret) {
+                *param_value_size_ret = sizeof(src);
+            }
+        }
         break;
-      case CL_DEVICE_PROFILING_TIMER_RESOLUTION:
-        clWarn("clGetDeviceInfo: CL_DEVICE_PROFILING_TIMER_RESOLUTION not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_ENDIAN_LITTLE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_ENDIAN_LITTLE not implemented\n");
-        break;
-      case CL_DEVICE_HOST_UNIFIED_MEMORY:
-        clWarn("clGetDeviceInfo: CL_DEVICE_HOST_UNIFIED_MEMORY not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_AVAILABLE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_AVAILABLE not implemented\n");
-        break;
-      case CL_DEVICE_COMPILER_AVAILABLE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_COMPILER_AVAILABLE not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_EXECUTION_CAPABILITIES:
-        clWarn("clGetDeviceInfo: CL_DEVICE_EXECUTION_CAPABILITIES not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_QUEUE_PROPERTIES:
-        clWarn("clGetDeviceInfo: CL_DEVICE_QUEUE_PROPERTIES not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_PLATFORM:
-        clWarn("clGetDeviceInfo: CL_DEVICE_PLATFORM not implemented\n");
-        break;
-      case CL_DEVICE_NAME:
-        strSrc = "HSAIL-GPU";
+      default:
+        return CL_INVALID_VALUE;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_context CL_API_CALL
+clCreateContextFromType(const cl_context_properties *properties,
+                        cl_device_type device_type,
+                        void (CL_CALLBACK *pfn_notify)(const char *,
+                                                       const void *,
+                                                       size_t, void *),
+                        void *user_data, cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clCreateContextFromType()\n");
+
+    cl_int ret = CL_SUCCESS;
+
+    if (!properties) {
+        ret = CL_INVALID_PLATFORM;
+    } else if (!pfn_notify && user_data) {
+        ret = CL_INVALID_VALUE;
+    } else if (pfn_notify) {
+        clFatal("clCreateContextFromType: pfn_notify not implemented\n");
+    }
+
+    int prop_idx = 0;
+    while (properties[prop_idx]) {
+        _cl_platform_id *prop;
+        switch (properties[prop_idx]) {
+          case CL_CONTEXT_PLATFORM:
+            prop = (_cl_platform_id*)(properties[prop_idx + 1]);
+            if (prop->ID != getPlatform()->getID()->ID) {
+                ret = CL_INVALID_PLATFORM;
+            }
+            break;
+          default:
+            ret = CL_INVALID_VALUE;
+        }
+        prop_idx += 2;
+    }
+
+    if (ret != CL_SUCCESS) {
+        if (errcode_ret) {
+            *errcode_ret = ret;
+        }
+
+        return nullptr;
+    }
+
+    _cl_context *context;
+    ret = getPlatform()->addContext(device_type, &context);
+    if (errcode_ret) {
+        *errcode_ret = ret;
+    }
+
+    if (ret == CL_SUCCESS) {
+        return context;
+    } else {
+        return nullptr;
+    }
+}
+
+CL_API_ENTRY cl_context CL_API_CALL
+clCreateContext(const cl_context_properties *properties, cl_uint num_devices,
+                const cl_device_id *devices,
+                void (CL_CALLBACK *pfn_notify)(const char*, const void*,
+                                               size_t, void*),
+                void *user_data, cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    // the devices of a context are all of one type, that of the first
+    cl_device_type device_type = num_devices && devices ?
+        devices[0]->type : CL_DEVICE_TYPE_GPU;
+
+    if (!properties) {
+        _cl_context *context = nullptr;
+        cl_int ret = getPlatform()->addContext(device_type, &context);
+
+        if (errcode_ret) {
+            *errcode_ret = ret;
+        }
+
+        return context;
+    }
+
+    return clCreateContextFromType(properties, device_type, pfn_notify,
+                                   user_data,errcode_ret);
+}
+CL_API_ENTRY cl_int CL_API_CALL
+clGetContextInfo(cl_context context, cl_context_info param_name,
+                 size_t param_value_size, void *param_value,
+                 size_t *param_value_size_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetContextInfo()\n");
+
+    if (!getPlatform()->isContextValid(context)) {
+        return CL_INVALID_CONTEXT;
+    }
+
+    switch (param_name) {
+      case CL_CONTEXT_REFERENCE_COUNT:
         if (param_value_size_ret) {
-            *param_value_size_ret = strlen(strSrc) + 1;
+            *param_value_size_ret = sizeof(cl_uint);
         }
 
         if (param_value) {
-            if (param_value_size >= strlen(strSrc) + 1) {
-               strcpy (strRet, strSrc);
+            if (param_value_size >= sizeof(cl_uint)) {
+                *((cl_uint*)(param_value)) = context->getRefCount();
             } else {
-               return CL_INVALID_VALUE;
+                return CL_INVALID_VALUE;
             }
         }
+
         break;
-      case CL_DEVICE_VENDOR:
-        clWarn("clGetDeviceInfo: CL_DEVICE_VENDOR not implemented\n");
-        break;
-      case CL_DRIVER_VERSION:
-        clWarn("clGetDeviceInfo: CL_DRIVER_VERSION not implemented\n");
-        break;
-      case CL_DEVICE_OPENCL_C_VERSION:
-        clWarn("clGetDeviceInfo: CL_DEVICE_OPENCL_C_VERSION not "
-               "implemented\n");
-        break;
-      case CL_DEVICE_PROFILE:
-        clWarn("clGetDeviceInfo: CL_DEVICE_PROFILE not implemented\n");
-        break;
-      case CL_DEVICE_VERSION:
-        clWarn("clGetDeviceInfo: CL_DEVICE_VERSION not implemented\n");
-        break;
-      case CL_DEVICE_EXTENSIONS:
-        strSrc = "cl_khr_byte_addressable_store";
+      case CL_CONTEXT_DEVICES:
         if (param_value_size_ret) {
-            *param_value_size_ret = strlen(strSrc) + 1;
+           *param_value_size_ret =
+               sizeof(cl_device_id) * context->getNumDevices();
         }
 
         if (param_value) {
-            if (param_value_size >= strlen(strSrc) + 1) {
-               strcpy (strRet, strSrc);
+            if (param_value_size >=
+                sizeof(cl_device_id) * context->getNumDevices()) {
+                (*((cl_device_id *)(param_value))) = context->devList;
             } else {
-               return CL_INVALID_VALUE;
+                return CL_INVALID_VALUE;
             }
         }
         break;
+      case CL_CONTEXT_PROPERTIES:
+        clFatal("clGetContextInfo: CL_CONTEXT_PROPERTIES not "
+                "yet implemented\n");
+        break;
       default:
         return CL_INVALID_VALUE;
     }
@@ -1090,475 +2188,3716 @@ CL_API_SUFFIX__VERSION_1_0
     return CL_SUCCESS;
 }
 
-///////////////////////////////////////////////////////////////////////////////
+/* Command Queue APIs */
+CL_API_ENTRY cl_command_queue CL_API_CALL
+clCreateCommandQueue(cl_context context, cl_device_id device,
+                     cl_command_queue_properties properties,
+                     cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clCreateCommandQueue()\n");
+
+    if (!getPlatform()->isContextValid(context)) {
+        if (errcode_ret) {
+            *errcode_ret = CL_INVALID_CONTEXT;
+        }
+
+        return nullptr;
+    }
+
+    if (device->type != context->getDevType()
+        && !context->isValidDev(device)) {
+        if (errcode_ret) {
+            *errcode_ret = CL_INVALID_DEVICE;
+        }
+
+        return nullptr;
+    }
+
+    if (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
+        clWarn("clCreateCommandQueue: CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE "
+               "not yet implemented\n");
+    }
+    if (properties & CL_QUEUE_PROFILING_ENABLE) {
+        clWarn("clCreateCommandQueue: CL_QUEUE_PROFILING_ENABLE not yet "
+               "implemented\n");
+    }
+    if (properties & ~(CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE
+        | CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_PREFAULT_ENABLE_HSA
+        | CL_QUEUE_PREFAULT_MLOCK_HSA | CL_QUEUE_CO_EXECUTE_HSA)) {
+        if (errcode_ret) {
+            *errcode_ret = CL_INVALID_QUEUE_PROPERTIES;
+        }
+
+        return nullptr;
+    }
+
+    // a CPU queue has the host cores to itself already
+    if ((properties & CL_QUEUE_CO_EXECUTE_HSA) &&
+        device->type != CL_DEVICE_TYPE_GPU) {
+        if (errcode_ret) {
+            *errcode_ret = CL_INVALID_QUEUE_PROPERTIES;
+        }
+
+        return nullptr;
+    }
+
+    _cl_command_queue *CQ = device->addCQ(context, properties);
+    {
+        std::lock_guard<std::mutex> guard(hsaBinaryLock);
+        liveQueues.insert(CQ);
+    }
+    if (errcode_ret) {
+        *errcode_ret = CL_SUCCESS;
+    }
+
+    return CQ;
+}
 
 CL_API_ENTRY cl_int CL_API_CALL
-clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size,
-               const void *arg_value)
+clGetCommandQueueInfo(cl_command_queue command_queue,
+                      cl_command_queue_info param_name,
+                      size_t param_value_size, void *param_value,
+                      size_t *param_value_size_ret)
 CL_API_SUFFIX__VERSION_1_0
 {
-    if (!arg_value) {
-        DPRINT("clSetKernelArg(%p, %d, %d, nullptr)\n",
-               (void*)kernel, arg_index, (int)arg_size);
-    } else if (arg_size == 4) {
-        DPRINT("clSetKernelArg(%p, %d, %d, %#x)\n",
-               (void*)kernel, arg_index, (int)arg_size,
-               *(uint32_t*)arg_value);
-    } else if (arg_size == 8) {
-        DPRINT("clSetKernelArg(%p, %d, %d, %#llx)\n",
-               (void*)kernel, arg_index, (int)arg_size,
-               *(uint64_t*)arg_value);
-    } else {
-        DPRINT("clSetKernelArg(%p, %d, %d, %p)\n",
-               (void*)kernel, arg_index, (int)arg_size, arg_value);
+    DPRINT("clGetCommandQueueInfo()\n");
+
+    if (!command_queue) {
+        return CL_INVALID_COMMAND_QUEUE;
+    }
+
+    size_t size;
+    union {
+        cl_context context;
+        cl_device_id device;
+        cl_uint count;
+        cl_command_queue_properties properties;
+        cl_ulong counter;
+    } val;
+
+    switch (param_name) {
+      case CL_QUEUE_CONTEXT:
+        size = sizeof(cl_context);
+        val.context = command_queue->context;
+        break;
+      case CL_QUEUE_DEVICE:
+        size = sizeof(cl_device_id);
+        val.device = command_queue->device;
+        break;
+      case CL_QUEUE_REFERENCE_COUNT:
+        size = sizeof(cl_uint);
+        {
+            cl_int retains = 0;
+            refcmdqueue.get(command_queue, &retains);
+            val.count = retains + 1;
+        }
+        break;
+      case CL_QUEUE_PROPERTIES:
+        size = sizeof(cl_command_queue_properties);
+        val.properties = command_queue->properties;
+        break;
+      case CL_QUEUE_PAGES_PREFAULTED_HSA:
+        size = sizeof(cl_ulong);
+        val.counter = command_queue->pagesPrefaulted;
+        break;
+      case CL_QUEUE_PAGES_LOCKED_HSA:
+        size = sizeof(cl_ulong);
+        val.counter = command_queue->pagesLocked;
+        break;
+      default:
+        return CL_INVALID_VALUE;
+    }
+
+    if (param_value_size_ret) {
+        *param_value_size_ret = size;
+    }
+
+    if (param_value) {
+        if (param_value_size >= size) {
+            memcpy(param_value, &val, size);
+        } else {
+            return CL_INVALID_VALUE;
+        }
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL
+clCreateBuffer(cl_context context, cl_mem_flags flags, size_t size,
+               void *host_ptr, cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clCreateBuffer()\n");
+
+    _cl_mem *buf = nullptr;
+
+    if (flags & CL_MEM_USE_HOST_PTR) {
+        buf = (_cl_mem *)host_ptr;
+        if (errcode_ret)
+            *errcode_ret = buf ? CL_SUCCESS :
+                                 CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        if (buf) {
+            memSize.set(buf, size);
+        }
+        DPRINT("returning from clCreateBuffer()\n");
+        return buf;
+    } else {
+        // Ensure the allocated buffer is cache block aligned so that
+        // coalescing is maximized and bandwidth is reduced.
+        if (posix_memalign((void**)&buf, 64, size)) {
+            buf = nullptr;
+        }
+    }
+    if (buf && (flags & CL_MEM_COPY_HOST_PTR)) {
+        memcpy(buf, host_ptr, size);
+    }
+    if (errcode_ret)
+        *errcode_ret = buf ? CL_SUCCESS :
+                             CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    if (buf) {
+        memTracker.insert(buf);
+        memSize.set(buf, size);
+    }
+    DPRINT("returning from clCreateBuffer()\n");
+
+    return buf;
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL
+clCreateImage(cl_context context, cl_mem_flags flags,
+              const cl_image_format *image_format,
+              const cl_image_desc *image_desc, void *host_ptr,
+              cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clCreateImage()\n");
+
+    if (!image_desc || (image_desc->image_type != CL_MEM_OBJECT_IMAGE2D &&
+                        image_desc->image_type != CL_MEM_OBJECT_IMAGE3D)) {
+        if (errcode_ret) {
+            *errcode_ret = CL_INVALID_IMAGE_DESCRIPTOR;
+        }
+
+        return nullptr;
+    }
+
+    bool is_3d = image_desc->image_type == CL_MEM_OBJECT_IMAGE3D;
+
+    // a 3D image must have a depth of at least 2
+    if (is_3d && image_desc->image_depth < 2) {
+        if (errcode_ret) {
+            *errcode_ret = CL_INVALID_IMAGE_SIZE;
+        }
+
+        return nullptr;
+    }
+
+    return createImage(flags, image_format, image_desc->image_width,
+                       image_desc->image_height,
+                       is_3d ? image_desc->image_depth : 1,
+                       image_desc->image_row_pitch,
+                       is_3d ? image_desc->image_slice_pitch : 0,
+                       host_ptr, errcode_ret);
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL
+clCreateImage2D(cl_context context, cl_mem_flags flags,
+                const cl_image_format *image_format, size_t image_width,
+                size_t image_height, size_t image_row_pitch, void *host_ptr,
+                cl_int *errcode_ret)
+CL_EXT_SUFFIX__VERSION_1_1_DEPRECATED
+{
+    DPRINT("clCreateImage2D()\n");
+
+    return createImage(flags, image_format, image_width, image_height, 1,
+                       image_row_pitch, 0, host_ptr, errcode_ret);
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL
+clCreateImage3D(cl_context context, cl_mem_flags flags,
+                const cl_image_format *image_format, size_t image_width,
+                size_t image_height, size_t image_depth,
+                size_t image_row_pitch, size_t image_slice_pitch,
+                void *host_ptr, cl_int *errcode_ret)
+CL_EXT_SUFFIX__VERSION_1_1_DEPRECATED
+{
+    DPRINT("clCreateImage3D()\n");
+
+    // a 3D image must have a depth of at least 2
+    if (image_depth < 2) {
+        if (errcode_ret) {
+            *errcode_ret = CL_INVALID_IMAGE_SIZE;
+        }
+
+        return nullptr;
+    }
+
+    return createImage(flags, image_format, image_width, image_height,
+                       image_depth, image_row_pitch, image_slice_pitch,
+                       host_ptr, errcode_ret);
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL
+clCreateSubBuffer(cl_mem buffer, cl_mem_flags flags,
+                  cl_buffer_create_type buffer_create_type,
+                  const void *buffer_create_info, cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_1
+{
+    DPRINT("clCreateSubBuffer()\n");
+
+    cl_int ret = CL_SUCCESS;
+    const cl_buffer_region *region =
+        (const cl_buffer_region*)buffer_create_info;
+
+    // sub-buffers of sub-buffers are not allowed
+    if (!buffer || subBufTracker.get(buffer)) {
+        ret = CL_INVALID_MEM_OBJECT;
+    } else if (buffer_create_type != CL_BUFFER_CREATE_TYPE_REGION ||
+               !region) {
+        ret = CL_INVALID_VALUE;
+    } else if (region->size == 0) {
+        ret = CL_INVALID_BUFFER_SIZE;
+    } else if (region->origin > SIZE_MAX - region->size ||
+               beyondBuffer(buffer, region->origin, region->size)) {
+        ret = CL_INVALID_VALUE;
+    } else if (region->origin % MEM_BASE_ADDR_ALIGN) {
+        ret = CL_MISALIGNED_SUB_BUFFER_OFFSET;
+    }
+
+    if (errcode_ret) {
+        *errcode_ret = ret;
+    }
+
+    if (ret != CL_SUCCESS) {
+        return nullptr;
+    }
+
+    // The flat address space lets the sub-buffer alias the parent directly,
+    // so the handle is the address of the region and there is one handle
+    // per origin. A region at origin 0 is the parent itself. Each
+    // sub-buffer holds a reference on its parent until it is released.
+    cl_mem sub_buf = (cl_mem)((char*)buffer + region->origin);
+    clRetainMemObject(buffer);
+
+    if (sub_buf != buffer) {
+        subBufDesc desc = { buffer, region->origin, region->size };
+
+        if (!subBufTracker.insert(sub_buf, desc)) {
+            subBufDesc live;
+            bool same = subBufTracker.get(sub_buf, &live) &&
+                        live.size == region->size;
+
+            clReleaseMemObject(buffer);
+
+            // the handle would stand for two extents
+            if (!same) {
+                DPRINT("clCreateSubBuffer(): %p + %#llx already has a "
+                       "sub-buffer of another size\n", (void*)buffer,
+                       (unsigned long long)region->origin);
+                if (errcode_ret) {
+                    *errcode_ret = CL_INVALID_VALUE;
+                }
+                return nullptr;
+            }
+
+            // an identical region already exists; share its handle
+            clRetainMemObject(sub_buf);
+        }
+    }
+
+    DPRINT("clCreateSubBuffer(): %p + %#llx -> %p\n", (void*)buffer,
+           (unsigned long long)region->origin, (void*)sub_buf);
+
+    return sub_buf;
+}
+
+// Ask the kernel to start reading [offset, offset + size) of a file-backed
+// buffer so that the device finds the pages resident.
+static void
+prefetchFileWindow(cl_mem buffer, const fileBufDesc &desc, size_t offset,
+                   size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *start = (char*)buffer + offset;
+    char *page_start = (char*)((uintptr_t)start & ~(page - 1));
+    char *map_end = (char*)desc.mapBase + desc.mapSize;
+    size_t len = std::min((size_t)(map_end - page_start),
+                          size + (start - page_start));
+
+    madvise(page_start, len, MADV_WILLNEED);
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL
+clCreateBufferFromFileHSA(cl_context context, cl_mem_flags flags, int fd,
+                          cl_ulong offset, size_t size,
+                          cl_file_buffer_flags_hsa file_flags,
+                          size_t window_size, cl_int *errcode_ret)
+CL_EXT_SUFFIX__VERSION_1_1
+{
+    DPRINT("clCreateBufferFromFileHSA()\n");
+
+    cl_int ret = CL_SUCCESS;
+    struct stat st;
+
+    if (!getPlatform()->isContextValid(context)) {
+        ret = CL_INVALID_CONTEXT;
+    } else if (fd < 0 || size == 0) {
+        ret = CL_INVALID_VALUE;
+    } else if (offset > (cl_ulong)std::numeric_limits<off_t>::max()) {
+        // mmap takes the offset as an off_t, which must not truncate it
+        ret = CL_INVALID_VALUE;
+    } else if (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR |
+                        CL_MEM_COPY_HOST_PTR)) {
+        ret = CL_INVALID_VALUE;
+    } else if ((file_flags & CL_FILE_BUFFER_STREAM_HSA) && !window_size) {
+        ret = CL_INVALID_VALUE;
+    } else if (fstat(fd, &st) || offset > (cl_ulong)st.st_size ||
+               size > (cl_ulong)st.st_size - offset) {
+        // pages past the end of the file map, but touching them is SIGBUS
+        ret = CL_INVALID_VALUE;
+    } else if (!(flags & CL_MEM_READ_ONLY) &&
+               (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY) {
+        // a writable shared mapping needs a writable file
+        ret = CL_INVALID_VALUE;
+    }
+
+    if (ret != CL_SUCCESS) {
+        if (errcode_ret) {
+            *errcode_ret = ret;
+        }
+
+        return nullptr;
+    }
+
+    // mmap wants a page-aligned file offset, so map from the start of the
+    // page and hand out a pointer to the first requested byte
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t delta = offset % page;
+    size_t map_size = size + delta;
+
+    int prot = (flags & CL_MEM_READ_ONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+    int map_flags = MAP_SHARED;
+
+    // populating the whole range defeats the purpose of streaming
+    if ((file_flags & CL_FILE_BUFFER_POPULATE_HSA) &&
+        !(file_flags & CL_FILE_BUFFER_STREAM_HSA)) {
+        map_flags |= MAP_POPULATE;
+    }
+
+    void *base = mmap(nullptr, map_size, prot, map_flags, fd, offset - delta);
+    if (base == MAP_FAILED) {
+        if (errcode_ret) {
+            *errcode_ret = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+
+        return nullptr;
+    }
+
+    if (file_flags & (CL_FILE_BUFFER_SEQUENTIAL_HSA |
+                      CL_FILE_BUFFER_STREAM_HSA)) {
+        posix_fadvise(fd, offset, size, POSIX_FADV_SEQUENTIAL);
+        madvise(base, map_size, MADV_SEQUENTIAL);
+    }
+
+    cl_mem buf = (cl_mem)((char*)base + delta);
+    fileBufDesc desc = { base, map_size, 0, 0 };
+
+    if (file_flags & CL_FILE_BUFFER_STREAM_HSA) {
+        desc.windowSize = std::min(window_size, size);
+        prefetchFileWindow(buf, desc, 0, desc.windowSize);
+    }
+
+    fileBufTracker.set(buf, desc);
+    memSize.set(buf, size);
+
+    if (errcode_ret) {
+        *errcode_ret = CL_SUCCESS;
+    }
+
+    DPRINT("clCreateBufferFromFileHSA(): fd %d @ %#llx -> %p\n", fd,
+           (unsigned long long)offset, (void*)buf);
+
+    return buf;
+}
+
+CL_API_ENTRY void * CL_API_CALL
+clSVMAlloc(cl_context context, cl_svm_mem_flags flags, size_t size,
+           cl_uint alignment)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clSVMAlloc()\n");
+
+    // host and device share one coherent flat address space, so every
+    // buffer is fine grained; SVM atomics are not supported
+    if (!size || (flags & CL_MEM_SVM_ATOMICS) ||
+        (alignment & (alignment - 1))) {
+        return nullptr;
+    }
+
+    // SVM allocations come from the same heap as cl_mem buffers and are
+    // tracked like them, so an SVM pointer is also a valid buffer handle
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, std::max<size_t>(alignment, 64), size)) {
+        return nullptr;
+    }
+
+    memTracker.insert((cl_mem)ptr);
+    memSize.set((cl_mem)ptr, size);
+    {
+        std::lock_guard<std::mutex> guard(svmLock);
+        svmAllocs[(uintptr_t)ptr] = size;
+    }
+
+    return ptr;
+}
+
+CL_API_ENTRY void CL_API_CALL
+clSVMFree(cl_context context, void *svm_pointer)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clSVMFree()\n");
+
+    bool svm;
+    {
+        std::lock_guard<std::mutex> guard(svmLock);
+        svm = svmAllocs.erase((uintptr_t)svm_pointer);
+    }
+
+    if (svm) {
+        clReleaseMemObject((cl_mem)svm_pointer);
+    }
+}
+
+CL_API_ENTRY cl_program CL_API_CALL
+clCreateProgramWithSource(cl_context context, cl_uint count,
+                          const char **strings, const size_t *lengths,
+                          cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    _cl_program *program;
+    // addSource sets the program
+    cl_int err = context->addSource(count, strings, lengths, &program);
+    // we set the error code if the programmer
+    // did not pass nullptr for errcode_ret
+    if (errcode_ret)
+      *errcode_ret = err;
+
+    return program;
+}
+
+extern CL_API_ENTRY cl_program CL_API_CALL
+clCreateProgramWithBinary(cl_context context, cl_uint num_devices,
+                          const cl_device_id *device_list,
+                          const size_t *lengths,
+                          const unsigned char **binaries,
+                          cl_int *binary_status, cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clCreateProgramWithBinary()\n");
+
+    cl_int ret = CL_SUCCESS;
+
+    if (!context) {
+        ret = CL_INVALID_CONTEXT;
+    } else if (context->getDevType() == CL_DEVICE_TYPE_CPU) {
+        // code objects hold GPU code; CPU kernels are registered natively
+        ret = CL_INVALID_BINARY;
+    } else if (!num_devices || !device_list || !lengths || !binaries) {
+        ret = CL_INVALID_VALUE;
+    } else {
+        for (cl_uint i = 0; i < num_devices; ++i) {
+            // the same test clCreateCommandQueue applies
+            if (device_list[i]->type != context->getDevType() &&
+                !context->isValidDev(device_list[i])) {
+                ret = CL_INVALID_DEVICE;
+            } else if (!lengths[i] || !binaries[i]) {
+                ret = CL_INVALID_VALUE;
+            }
+        }
+    }
+
+    // the binary must have been built for the vector width of this device
+    if (ret == CL_SUCCESS) {
+        ret = hsaDriverInit();
+    }
+
+    if (ret != CL_SUCCESS) {
+        if (errcode_ret) {
+            *errcode_ret = ret;
+        }
+
+        return nullptr;
+    }
+
+    // There is a single device, so every entry must carry the same code
+    // object; the first one is loaded.
+    for (cl_uint i = 0; i < num_devices; ++i) {
+        const HsaCodeObjectHeader *hdr =
+            (const HsaCodeObjectHeader*)binaries[i];
+        bool valid = hsaValidCodeObject(binaries[i], lengths[i]) &&
+                     hdr->vecSize == VecSize &&
+                     (!i || (lengths[i] == lengths[0] &&
+                             hdr->checksum ==
+                             ((const HsaCodeObjectHeader*)binaries[0])->
+                             checksum));
+
+        if (binary_status) {
+            binary_status[i] = valid ? CL_SUCCESS : CL_INVALID_BINARY;
+        }
+
+        if (!valid) {
+            ret = CL_INVALID_BINARY;
+        }
+    }
+
+    HsaProgramBinary *binary = nullptr;
+    if (ret == CL_SUCCESS) {
+        binary = hsaLoadCodeObject(binaries[0], lengths[0]);
+        if (!binary) {
+            ret = CL_OUT_OF_HOST_MEMORY;
+        }
+    }
+
+    if (errcode_ret) {
+        *errcode_ret = ret;
+    }
+
+    if (ret != CL_SUCCESS) {
+        return nullptr;
+    }
+
+    _cl_program *program = new _cl_program();
+    program->binary = binary;
+
+    return program;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clBuildProgram(cl_program program, cl_uint num_devices,
+               const cl_device_id *device_list, const char *options,
+               void (CL_CALLBACK *pfn_notify)(cl_program program,
+                                              void *user_data),
+               void *user_data)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clBuildProgram()\n");
+
+    clWarn("clBuildProgram unimplemented\n");
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clReloadProgramHSA(cl_program program, const char *code_object_path)
+CL_EXT_SUFFIX__VERSION_1_1
+{
+    DPRINT("clReloadProgramHSA()\n");
+
+    // native kernels do not come from a code object
+    if (!program || program->deviceType == CL_DEVICE_TYPE_CPU) {
+        return CL_INVALID_PROGRAM;
+    }
+
+    cl_int ret = hsaDriverInit();
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    // The new code always lands in a fresh segment: the file is copied
+    // out rather than run from, so it can be rewritten by the next build.
+    HsaProgramBinary *binary = nullptr;
+
+    if (code_object_path) {
+        const HsaCodeObjectHeader *hdr = hsaMapCodeObject(code_object_path);
+        if (!hdr || hdr->vecSize != VecSize) {
+            if (hdr) {
+                munmap((void*)hdr, hdr->size);
+            }
+
+            return CL_INVALID_BINARY;
+        }
+
+        binary = hsaLoadCodeObject((const uint8_t*)hdr, hdr->size);
+        munmap((void*)hdr, hdr->size);
+    } else {
+        std::vector<uint8_t> image;
+        if (!hsaReadDriverCodeObject(image)) {
+            return CL_OUT_OF_RESOURCES;
+        }
+
+        binary = hsaLoadCodeObject(image.data(), image.size());
+    }
+
+    if (!binary) {
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    // New kernels come from the new binary from here on, and the existing
+    // ones, clones included, switch to it by name. A kernel the new binary
+    // no longer has, and every launch plan, keep the old code, which stays
+    // mapped while they reference it and until dispatches already queued
+    // have finished.
+    std::unique_lock<std::mutex> guard(program->kernLock);
+    HsaProgramBinary *old_binary = program->binary;
+    program->binary = binary;
+
+    for (auto kernel : program->kernList) {
+        kernelDesc *desc = hsaFindKernel(&binary->kernels,
+                                         kernel->name.c_str());
+        if (desc) {
+            kernel->setDesc(desc);
+        }
+    }
+    guard.unlock();
+
+    if (old_binary) {
+        hsaReleaseProgramBinary(old_binary);
+    }
+
+    return CL_SUCCESS;
+}
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clGetProgramInfo(cl_program program, cl_program_info param_name,
+                 size_t param_value_size, void *param_value,
+                 size_t *param_value_size_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetProgramInfo()\n");
+    clWarn("clGetProgramInfo unimplemented\n");
+
+    switch(param_name) {
+      case CL_PROGRAM_REFERENCE_COUNT:
+        clFatal("clGetProgramInfo: CL_PROGRAM_REFERENCE_COUNT not "
+                "yet implemented\n");
+        break;
+      case CL_PROGRAM_CONTEXT:
+        clFatal("clGetProgramInfo: CL_PROGRAM_CONTEXT not yet "
+                "implemented\n");
+        break;
+      case CL_PROGRAM_NUM_DEVICES:
+        clFatal("clGetProgramInfo: CL_PROGRAM_NUM_DEVICES not yet "
+                "implemented\n");
+        break;
+      case CL_PROGRAM_DEVICES:
+        clFatal("clGetProgramInfo: CL_PROGRAM_DEVICES not yet implemented\n");
+        break;
+      case CL_PROGRAM_SOURCE:
+        clFatal("clGetProgramInfo: CL_PROGRAM_SOURCE not yet implemented\n");
+        break;
+      case CL_PROGRAM_BINARY_SIZES:
+      case CL_PROGRAM_BINARIES:
+        {
+            const uint8_t *image;
+            size_t size;
+
+            // keeps a reload from retiring the image while it is copied
+            std::lock_guard<std::mutex> guard(program->kernLock);
+            if (program->binary) {
+                image = (const uint8_t*)program->binary->hdr;
+                size = program->binary->hdr->size;
+            } else {
+                cl_int ret = hsaDriverCodeObject(&image, &size);
+                if (ret != CL_SUCCESS) {
+                    return ret;
+                }
+            }
+
+            // one entry for the single device
+            size_t entry_size = param_name == CL_PROGRAM_BINARY_SIZES ?
+                                sizeof(size_t) : sizeof(unsigned char*);
+
+            if (param_value_size_ret) {
+                *param_value_size_ret = entry_size;
+            }
+
+            if (param_value) {
+                if (param_value_size < entry_size) {
+                    return CL_INVALID_VALUE;
+                }
+
+                if (param_name == CL_PROGRAM_BINARY_SIZES) {
+                    *(size_t*)param_value = size;
+                } else if (((unsigned char**)param_value)[0]) {
+                    memcpy(((unsigned char**)param_value)[0], image, size);
+                }
+            }
+        }
+        break;
+      default:
+        return CL_INVALID_VALUE;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clGetProgramBuildInfo(cl_program, cl_device_id, cl_program_build_info,
+                      size_t, void*, size_t*)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetProgramBuildInfo()\n");
+    clWarn("clGetProgramBuildInfo unimplemented\n");
+}
+
+/* Kernel Object APIs */
+// kernels a program can instantiate: those of its binary, if it was created
+// from one or reloaded, or else the kernels loaded from the driver. The
+// caller holds the program's kernLock.
+static HsaKernelTable *
+programKernels(cl_program program)
+{
+    return program && program->binary ? &program->binary->kernels
+                                      : &hsaDriverKernels;
+}
+
+// Native kernels registered for the CPU device. They are never removed,
+// so kernels can point at the descriptors.
+static std::deque<kernelDesc> cpuKernels;
+static std::map<std::string, kernelDesc*> cpuKernelIndex;
+// guards cpuKernels and cpuKernelIndex
+static std::mutex cpuKernelLock;
+
+static kernelDesc *
+cpuFindKernel(const char *kernel_name)
+{
+    std::lock_guard<std::mutex> guard(cpuKernelLock);
+    auto it = cpuKernelIndex.find(kernel_name);
+
+    return it == cpuKernelIndex.end() ? nullptr : it->second;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clRegisterNativeKernelHSA(const char *kernel_name,
+                          cl_native_kernel_fn_hsa entry, cl_uint num_args,
+                          size_t local_mem_size,
+                          cl_native_kernel_flags_hsa flags)
+CL_EXT_SUFFIX__VERSION_1_1
+{
+    DPRINT("clRegisterNativeKernelHSA() %s\n",
+           kernel_name ? kernel_name : "");
+
+    if (!kernel_name || !entry || local_mem_size > MAX_LDS_SIZE ||
+        (flags & ~(cl_native_kernel_flags_hsa)(CL_NATIVE_KERNEL_BARRIER_HSA |
+                   CL_NATIVE_KERNEL_CO_EXECUTE_HSA))) {
+        return CL_INVALID_VALUE;
+    }
+
+    std::lock_guard<std::mutex> guard(cpuKernelLock);
+
+    // kernels created from the name already point at its descriptor
+    if (cpuKernelIndex.count(kernel_name)) {
+        return CL_INVALID_KERNEL_NAME;
+    }
+
+    cpuKernels.emplace_back();
+    kernelDesc &desc = cpuKernels.back();
+
+    desc.name = kernel_name;
+    desc.code = nullptr;
+    desc.binary = nullptr;
+    desc.readonly = nullptr;
+    desc.readonlySize = 0;
+    desc.privateMemSize = 0;
+    desc.spillMemSize = 0;
+    desc.staticLdsSize = local_mem_size;
+    desc.sRegCount = 0;
+    desc.dRegCount = 0;
+    desc.cRegCount = 0;
+    desc.nativeEntry = entry;
+    desc.nativeFlags = flags;
+
+    // the number of arguments is known up front, their sizes are not
+    desc.args.resize(num_args);
+    for (auto &meta : desc.args) {
+        meta.size = 0;
+        meta.alignment = 0;
+        meta.addressQualifier = CL_KERNEL_ARG_ADDRESS_PRIVATE;
+        meta.isPointer = false;
+    }
+    desc.argsCaptured = true;
+
+    cpuKernelIndex[desc.name] = &desc;
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY void CL_API_CALL
+clWorkGroupBarrierHSA(const cl_work_item_hsa *item)
+CL_EXT_SUFFIX__VERSION_1_1
+{
+    cpuDevice::barrier(item);
+}
+
+CL_API_ENTRY cl_kernel CL_API_CALL
+clCreateKernel(cl_program program, const char *kernel_name,
+               cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clCreateKernel()\n");
+
+    bool cpu = program->deviceType == CL_DEVICE_TYPE_CPU;
+
+    // init driver in case this is the first call.  this call will
+    // return if the driver is already initialized. The CPU device runs
+    // without it.
+    cl_int ret = cpu ? CL_SUCCESS : hsaDriverInit();
+    if (ret != CL_SUCCESS) {
+        if (errcode_ret) {
+            *errcode_ret = ret;
+        }
+
+        return nullptr;
+    }
+
+    DPRINT("clCreateKernel() %s\n", kernel_name);
+
+    std::lock_guard<std::mutex> guard(program->kernLock);
+    _cl_kernel *kernel = nullptr;
+    kernelDesc *desc = nullptr;
+    if (kernel_name) {
+        desc = cpu ? cpuFindKernel(kernel_name) :
+                     hsaFindKernel(programKernels(program), kernel_name);
+    }
+    if (desc) {
+        kernel = new _cl_kernel(desc);
+    }
+
+    if (!kernel) {
+        fprintf(stderr, "Can't find kernel %s\n", kernel_name);
+        if (errcode_ret)
+            *errcode_ret = CL_INVALID_KERNEL_NAME;
+
+        return nullptr;
+    }
+
+    cl_int tmp = program->addFunction(kernel);
+
+    if (tmp == CL_SUCCESS) {
+        // the program lives as long as its kernels
+        clRetainProgram(program);
+
+        if (errcode_ret) {
+            *errcode_ret = tmp;
+        }
+        return kernel;
+    } else {
+        if (errcode_ret)
+            *errcode_ret = CL_BUILD_ERROR;
+
+        return nullptr;
+    }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clCreateKernelsInProgram(cl_program program, cl_uint num_kernels,
+                         cl_kernel *kernels, cl_uint *num_kernels_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clCreateKernelsInProgram()\n");
+
+    if (!program) {
+        return CL_INVALID_PROGRAM;
+    }
+
+    bool cpu = program->deviceType == CL_DEVICE_TYPE_CPU;
+
+    cl_int ret = cpu ? CL_SUCCESS : hsaDriverInit();
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    std::unique_lock<std::mutex> guard(program->kernLock);
+    // a CPU program holds every native kernel registered so far
+    std::unique_lock<std::mutex> cpu_guard(cpuKernelLock, std::defer_lock);
+    std::deque<kernelDesc> *descs;
+
+    if (cpu) {
+        cpu_guard.lock();
+        descs = &cpuKernels;
+    } else {
+        descs = &programKernels(program)->kernels;
+    }
+
+    cl_uint count = descs->size();
+
+    if (kernels && num_kernels < count) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (kernels) {
+        // every instance shares its descriptor; only argument state is
+        // allocated per kernel
+        for (cl_uint i = 0; i < count; ++i) {
+            _cl_kernel *kernel = new _cl_kernel(&(*descs)[i]);
+
+            if (program->addFunction(kernel) != CL_SUCCESS) {
+                delete kernel;
+                guard.unlock();
+                while (i--) {
+                    clReleaseKernel(kernels[i]);
+                }
+
+                return CL_OUT_OF_HOST_MEMORY;
+            }
+
+            clRetainProgram(program);
+            kernels[i] = kernel;
+        }
+    }
+
+    if (num_kernels_ret) {
+        *num_kernels_ret = count;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_kernel CL_API_CALL
+clCloneKernel(cl_kernel source_kernel, cl_int *errcode_ret)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clCloneKernel()\n");
+
+    if (!source_kernel) {
+        if (errcode_ret) {
+            *errcode_ret = CL_INVALID_KERNEL;
+        }
+
+        return nullptr;
+    }
+
+    // The clone copies the calling thread's view of the arguments and
+    // joins its source's program, so a reload switches it too and the
+    // program lives as long as it does. It is made under the program's
+    // lock, so a reload cannot slip between the copy and the listing.
+    DescReadGuard guard;
+    cl_program program = source_kernel->program;
+    std::unique_lock<std::mutex> kern_guard;
+    if (program) {
+        kern_guard = std::unique_lock<std::mutex>(program->kernLock);
+    }
+
+    _cl_kernel *kernel = new _cl_kernel(*argState(source_kernel));
+
+    if (program) {
+        program->addFunction(kernel);
+        kern_guard.unlock();
+        clRetainProgram(program);
+    }
+
+    if (errcode_ret) {
+        *errcode_ret = CL_SUCCESS;
+    }
+
+    return kernel;
+}
+
+/* Device APIs */
+CL_API_ENTRY cl_int CL_API_CALL
+clGetDeviceIDs(cl_platform_id platform, cl_device_type device_type,
+               cl_uint num_entries, cl_device_id *devices,
+               cl_uint *num_devices)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetDeviceIDs()\n");
+
+    if (!platform || platform->ID != getPlatform()->getID()->ID) {
+        return CL_INVALID_PLATFORM;
+    }
+
+    if (device_type & ~(CL_DEVICE_TYPE_ALL | CL_DEVICE_TYPE_CPU |
+        CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR |
+        CL_DEVICE_TYPE_DEFAULT) ) {
+        return CL_INVALID_DEVICE_TYPE;
+    }
+
+    if ((!num_entries && devices) || (!num_devices && !devices)) {
+        return CL_INVALID_VALUE;
+    }
+
+    // the GPU is the default device; CL_DEVICE_TYPE_ALL has every bit set
+    bool gpus = device_type & (CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_DEFAULT);
+    bool cpus = device_type & CL_DEVICE_TYPE_CPU;
+
+    cl_uint max_dev = (gpus ? getPlatform()->numGPUs() : 0) +
+                      (cpus ? getPlatform()->numCPUs() : 0);
+    if (num_devices) {
+        *num_devices = max_dev;
+    }
+
+    cl_uint num_dev_returned = 0;
+    if (devices) {
+        if (gpus) {
+            num_dev_returned += getPlatform()->getGPUs(devices, num_entries);
+        }
+        if (cpus) {
+            num_dev_returned +=
+                getPlatform()->getCPUs(devices + num_dev_returned,
+                                       num_entries - num_dev_returned);
+        }
+    }
+
+    if (!(max_dev || num_dev_returned)) {
+        return CL_DEVICE_NOT_FOUND;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clGetDeviceInfo(cl_device_id device, cl_device_info param_name,
+                size_t param_value_size, void *param_value,
+                size_t *param_value_size_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetDeviceInfo()\n");
+
+    int vector_width = 0;
+
+    if (!getPlatform()->isValidDev(device)) {
+        return CL_INVALID_DEVICE;
+    }
+
+    bool cpu = device->type == CL_DEVICE_TYPE_CPU;
+
+    // init driver in case this is the first call.  this call will
+    // return if the driver is already initialized. The CPU device does
+    // not need it.
+    cl_int ret = cpu ? CL_SUCCESS : hsaDriverInit();
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    uint32_t vec_size = cpu ? CPU_VEC_SIZE : VecSize;
+
+    if (param_value_size_ret) {
+        *param_value_size_ret = 0;
+    }
+
+    char *strRet = (char*)param_value;
+    const char *strSrc;
+    switch (param_name) {
+      case CL_DEVICE_TYPE:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_device_type);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_device_type)) {
+               *((cl_device_type*)(param_value)) = device->type;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_VENDOR_ID:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               *((cl_uint*)(param_value)) = 0;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MAX_COMPUTE_UNITS:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+                *((cl_uint*)(param_value)) = cpu ?
+                    cpuDevice::workerCount() : numCUs;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               *((cl_uint*)(param_value)) = MAX_WI_DIM;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MAX_WORK_ITEM_SIZES:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(size_t) * 3;
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+                size_t *ret = (size_t*)(param_value);
+                ret[0] = MAX_WI_DIM0;
+                ret[1] = MAX_WI_DIM1;
+                ret[2] = MAX_WI_DIM2;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MAX_WORK_GROUP_SIZE:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(size_t);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               *((size_t*)(param_value)) = MAX_WG_SIZE;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(char) : vector_width;
+      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(cl_half) : vector_width;
+      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(short) : vector_width;
+      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(int) : vector_width;
+      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(long) : vector_width;
+      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(float) : vector_width;
+      case CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(double) : vector_width;
+        DPRINT("vector_width = %d\n", vector_width);
+
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               *((cl_uint*)(param_value)) = vector_width;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_NATIVE_VECTOR_WIDTH_CHAR:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(char) : vector_width;
+      case CL_DEVICE_NATIVE_VECTOR_WIDTH_HALF:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(cl_half) : vector_width;
+      case CL_DEVICE_NATIVE_VECTOR_WIDTH_SHORT:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(short) : vector_width;
+      case CL_DEVICE_NATIVE_VECTOR_WIDTH_INT:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(int) : vector_width;
+      case CL_DEVICE_NATIVE_VECTOR_WIDTH_LONG:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(long) : vector_width;
+      case CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(float) : vector_width;
+      case CL_DEVICE_NATIVE_VECTOR_WIDTH_DOUBLE:
+        vector_width = !vector_width ?
+            vec_size * sizeof(double) / sizeof(double) : vector_width;
+        DPRINT("vector_width = %d\n", vector_width);
+
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               *((cl_uint*)(param_value)) = vector_width;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MAX_CLOCK_FREQUENCY:
+        clWarn("clGetDeviceInfo: ignoring request for "
+               "CL_DEVICE_MAX_CLOCK_FREQUENCY...\n");
+        break;
+      case CL_DEVICE_ADDRESS_BITS:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               *((cl_uint*)(param_value)) = sizeof(void*) * 8;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+        clWarn("clGetDeviceInfo: ignoring request for "
+               "CL_DEVICE_ADDRESS_BITS...\n");
+        break;
+      case CL_DEVICE_MAX_MEM_ALLOC_SIZE:
+        clWarn("clGetDeviceInfo: ignoring request for "
+               "CL_DEVICE_MAX_MEM_ALLOC_SIZE...\n");
+        break;
+      case CL_DEVICE_IMAGE_SUPPORT:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_bool);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_bool)) {
+               // Images are only reachable through cl_hsa_tiled_image:
+               // there are no samplers or image kernel arguments.
+               *((cl_bool*)(param_value)) = CL_FALSE;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MAX_READ_IMAGE_ARGS:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               *((cl_uint*)(param_value)) = MAX_READ_IMAGE_ARGS;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MAX_WRITE_IMAGE_ARGS:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               *((cl_uint*)(param_value)) = MAX_WRITE_IMAGE_ARGS;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_IMAGE2D_MAX_WIDTH:
+      case CL_DEVICE_IMAGE2D_MAX_HEIGHT:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(size_t);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(size_t)) {
+               *((size_t*)(param_value)) = MAX_IMAGE2D_DIM;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_IMAGE3D_MAX_WIDTH:
+      case CL_DEVICE_IMAGE3D_MAX_HEIGHT:
+      case CL_DEVICE_IMAGE3D_MAX_DEPTH:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(size_t);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(size_t)) {
+               *((size_t*)(param_value)) = MAX_IMAGE3D_DIM;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MAX_SAMPLERS:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               *((cl_uint*)(param_value)) = 0;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MAX_PARAMETER_SIZE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_MAX_PARAMETER_SIZE not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_MEM_BASE_ADDR_ALIGN:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_uint);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_uint)) {
+               // in bits
+               *((cl_uint*)(param_value)) = MEM_BASE_ADDR_ALIGN * 8;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_SINGLE_FP_CONFIG:
+        clWarn("clGetDeviceInfo: CL_DEVICE_SINGLE_FP_CONFIG not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_DOUBLE_FP_CONFIG:
+        clWarn("clGetDeviceInfo: CL_DEVICE_DOUBLE_FP_CONFIG not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_GLOBAL_MEM_CACHE_TYPE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_GLOBAL_MEM_CACHE_TYPE not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_GLOBAL_MEM_CACHE_SIZE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_GLOBAL_MEM_CACHE_SIZE not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_GLOBAL_MEM_SIZE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_GLOBAL_MEM_SIZE not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_MAX_CONSTANT_ARGS:
+        clWarn("clGetDeviceInfo: CL_DEVICE_MAX_CONSTANT_ARGS not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_LOCAL_MEM_TYPE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_LOCAL_MEM_TYPE not implemented\n");
+        break;
+      case CL_DEVICE_LOCAL_MEM_SIZE:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(unsigned long long);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(unsigned long long)) {
+               *((unsigned long long*)(param_value)) = MAX_LDS_SIZE;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_ERROR_CORRECTION_SUPPORT:
+        clWarn("clGetDeviceInfo: CL_DEVICE_ERROR_CORRECTION_SUPPORT not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_PROFILING_TIMER_RESOLUTION:
+        clWarn("clGetDeviceInfo: CL_DEVICE_PROFILING_TIMER_RESOLUTION not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_ENDIAN_LITTLE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_ENDIAN_LITTLE not implemented\n");
+        break;
+      case CL_DEVICE_HOST_UNIFIED_MEMORY:
+        clWarn("clGetDeviceInfo: CL_DEVICE_HOST_UNIFIED_MEMORY not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_AVAILABLE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_AVAILABLE not implemented\n");
+        break;
+      case CL_DEVICE_COMPILER_AVAILABLE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_COMPILER_AVAILABLE not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_EXECUTION_CAPABILITIES:
+        clWarn("clGetDeviceInfo: CL_DEVICE_EXECUTION_CAPABILITIES not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_QUEUE_PROPERTIES:
+        clWarn("clGetDeviceInfo: CL_DEVICE_QUEUE_PROPERTIES not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_PLATFORM:
+        clWarn("clGetDeviceInfo: CL_DEVICE_PLATFORM not implemented\n");
+        break;
+      case CL_DEVICE_NAME:
+        strSrc = "HSAIL-GPU";
+        if (param_value_size_ret) {
+            *param_value_size_ret = strlen(strSrc) + 1;
+        }
+
+        if (param_value) {
+            if (param_value_size >= strlen(strSrc) + 1) {
+               strcpy (strRet, strSrc);
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_VENDOR:
+        clWarn("clGetDeviceInfo: CL_DEVICE_VENDOR not implemented\n");
+        break;
+      case CL_DRIVER_VERSION:
+        clWarn("clGetDeviceInfo: CL_DRIVER_VERSION not implemented\n");
+        break;
+      case CL_DEVICE_OPENCL_C_VERSION:
+        clWarn("clGetDeviceInfo: CL_DEVICE_OPENCL_C_VERSION not "
+               "implemented\n");
+        break;
+      case CL_DEVICE_PROFILE:
+        clWarn("clGetDeviceInfo: CL_DEVICE_PROFILE not implemented\n");
+        break;
+      case CL_DEVICE_VERSION:
+        clWarn("clGetDeviceInfo: CL_DEVICE_VERSION not implemented\n");
+        break;
+      case CL_DEVICE_SVM_CAPABILITIES:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_device_svm_capabilities);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_device_svm_capabilities)) {
+               *((cl_device_svm_capabilities*)(param_value)) =
+                   CL_DEVICE_SVM_COARSE_GRAIN_BUFFER |
+                   CL_DEVICE_SVM_FINE_GRAIN_BUFFER;
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_DEVICE_EXTENSIONS:
+        strSrc = "cl_khr_byte_addressable_store "
+                 "cl_hsa_file_backed_buffer cl_hsa_queue_prefault "
+                 "cl_hsa_tiled_image cl_hsa_kernel_arg_info "
+                 "cl_hsa_thread_local_args cl_hsa_launch_plan "
+                 "cl_hsa_program_reload cl_hsa_native_kernel "
+                 "cl_hsa_co_execution";
+        if (param_value_size_ret) {
+            *param_value_size_ret = strlen(strSrc) + 1;
+        }
+
+        if (param_value) {
+            if (param_value_size >= strlen(strSrc) + 1) {
+               strcpy (strRet, strSrc);
+            } else {
+               return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      default:
+        return CL_INVALID_VALUE;
+    }
+
+    return CL_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Check an argument of a kernel of desc before it is set, on its own and
+// against the kernel's signature once one is known.
+static cl_int
+checkKernelArg(const kernelDesc *desc, cl_uint arg_index, size_t arg_size,
+               const void *arg_value)
+{
+    // a __local argument must ask for a non-zero amount of group memory
+    // that could fit in the LDS
+    if (!arg_value && (arg_size == 0 || arg_size > MAX_LDS_SIZE)) {
+        return CL_INVALID_ARG_SIZE;
+    }
+
+    // before the signature is known, the queue entry bounds the index
+    const std::vector<kernelArgMeta> &sig = desc->args;
+    if (!desc->argsCaptured.load(std::memory_order_acquire)) {
+        if (arg_index >= sizeof(HsaQueueEntry::offsets) /
+                         sizeof(HsaQueueEntry::offsets[0]) -
+                         DEFAULT_OCL_KERN_ARGS) {
+            return CL_INVALID_ARG_INDEX;
+        }
+    } else {
+        if (arg_index >= sig.size()) {
+            return CL_INVALID_ARG_INDEX;
+        }
+
+        const kernelArgMeta &meta = sig[arg_index];
+        bool local = meta.addressQualifier == CL_KERNEL_ARG_ADDRESS_LOCAL;
+
+        if (meta.size && local != !arg_value) {
+            return CL_INVALID_ARG_VALUE;
+        }
+
+        if (meta.size && !local && arg_size != meta.size) {
+            return CL_INVALID_ARG_SIZE;
+        }
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size,
+               const void *arg_value)
+CL_API_SUFFIX__VERSION_1_0
+{
+    if (!arg_value) {
+        DPRINT("clSetKernelArg(%p, %d, %d, nullptr)\n",
+               (void*)kernel, arg_index, (int)arg_size);
+    } else if (arg_size == 4) {
+        DPRINT("clSetKernelArg(%p, %d, %d, %#x)\n",
+               (void*)kernel, arg_index, (int)arg_size,
+               *(uint32_t*)arg_value);
+    } else if (arg_size == 8) {
+        DPRINT("clSetKernelArg(%p, %d, %d, %#llx)\n",
+               (void*)kernel, arg_index, (int)arg_size,
+               *(uint64_t*)arg_value);
+    } else {
+        DPRINT("clSetKernelArg(%p, %d, %d, %p)\n",
+               (void*)kernel, arg_index, (int)arg_size, arg_value);
+    }
+
+    if (!kernel) {
+        return CL_INVALID_KERNEL;
+    }
+
+    DescReadGuard guard;
+    kernel = argState(kernel);
+
+    cl_int ret = checkKernelArg(kernel->desc, arg_index, arg_size, arg_value);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    kernel->addArg(arg_index + DEFAULT_OCL_KERN_ARGS, arg_size, arg_value);
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clSetKernelArgSVMPointer(cl_kernel kernel, cl_uint arg_index,
+                         const void *arg_value)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clSetKernelArgSVMPointer(%p, %d, %p)\n", (void*)kernel,
+           arg_index, arg_value);
+
+    if (!kernel) {
+        return CL_INVALID_KERNEL;
+    }
+
+    // SVM pointers are passed to the kernel exactly like buffer handles
+    DescReadGuard guard;
+    kernel = argState(kernel);
+
+    cl_int ret = checkKernelArg(kernel->desc, arg_index, sizeof(arg_value),
+                                &arg_value);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    kernel->addArg(arg_index + DEFAULT_OCL_KERN_ARGS, sizeof(arg_value),
+                   &arg_value);
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clSetKernelExecInfo(cl_kernel kernel, cl_kernel_exec_info param_name,
+                    size_t param_value_size, const void *param_value)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clSetKernelExecInfo()\n");
+
+    if (!kernel) {
+        return CL_INVALID_KERNEL;
+    }
+
+    if (!param_value) {
+        return CL_INVALID_VALUE;
+    }
+
+    switch (param_name) {
+      case CL_KERNEL_EXEC_INFO_SVM_PTRS:
+        // every SVM allocation is always visible to the device
+        break;
+      case CL_KERNEL_EXEC_INFO_SVM_FINE_GRAIN_SYSTEM:
+        if (param_value_size != sizeof(cl_bool)) {
+            return CL_INVALID_VALUE;
+        }
+
+        if (*(const cl_bool*)param_value) {
+            return CL_INVALID_OPERATION;
+        }
+        break;
+      case CL_KERNEL_EXEC_INFO_THREAD_LOCAL_ARGS_HSA:
+        // must be set before the kernel is shared between threads
+        if (param_value_size != sizeof(cl_bool)) {
+            return CL_INVALID_VALUE;
+        }
+
+        kernel->threadLocalArgs.store(*(const cl_bool*)param_value,
+                                      std::memory_order_release);
+        break;
+      default:
+        return CL_INVALID_VALUE;
+    }
+
+    return CL_SUCCESS;
+}
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueUnmapMemObject(cl_command_queue, cl_mem, void*, cl_uint,
+                        const cl_event*, cl_event*)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clEnqueueUnmapMemObject()\n");
+    clWarn("clEnqueueUnmapMemObject unimplemented\n");
+
+    return CL_SUCCESS;
+}
+
+// Largest work-group of desc that fits on one CU. Every wavefront of a
+// work-group holds its vector registers for the life of the group, so the
+// register footprint bounds how many wavefronts, and therefore work-items,
+// a group may have. Returns 0 if the kernel cannot be launched at all.
+static size_t
+kernelMaxWorkGroupSize(const kernelDesc *desc)
+{
+    // a native kernel's work-group runs on one CPU worker
+    if (desc->nativeEntry) {
+        return MAX_WG_SIZE;
+    }
+
+    if (!VecSize || desc->staticLdsSize > MAX_LDS_SIZE) {
+        return 0;
+    }
+
+    unsigned int regs = desc->sRegCount + 2 * desc->dRegCount +
+                        (desc->cRegCount + 31) / 32;
+    size_t wfs_per_simd = MAX_WFS_PER_SIMD;
+
+    if (regs) {
+        wfs_per_simd = std::min(wfs_per_simd,
+                                (size_t)(VREGS_PER_SIMD / regs));
+    }
+
+    size_t wg_size = wfs_per_simd * NUM_SIMDS_PER_CU * VecSize;
+
+    return std::min(wg_size, (size_t)MAX_WG_SIZE);
+}
+
+// Grid and work-group size of a launch in all three dimensions. The
+// work-group is local_work_size clamped to the grid, or if the caller left
+// it to the runtime, up to 256 work-items along the first dimension.
+static cl_int
+launchGeometry(const _cl_kernel *kernel, cl_uint work_dim,
+               const size_t *global_work_size, const size_t *local_work_size,
+               size_t max_wg_size, size_t *grid, size_t *group)
+{
+    size_t default_wg_size = std::min(max_wg_size, (size_t)256);
+    size_t wg_items = 1;
+
+    if (!global_work_size) {
+        return CL_INVALID_GLOBAL_WORK_SIZE;
+    }
+
+    for (cl_uint i = 0; i < work_dim; ++i) {
+        if (!global_work_size[i]) {
+            return CL_INVALID_GLOBAL_WORK_SIZE;
+        }
+        if (local_work_size && !local_work_size[i]) {
+            return CL_INVALID_WORK_GROUP_SIZE;
+        }
+    }
+
+    for (cl_uint i = 0; i < work_dim; ++i) {
+        grid[i] = global_work_size[i];
+        if (local_work_size) {
+            group[i] = (local_work_size[i] > global_work_size[i]) ?
+                        global_work_size[i] : local_work_size[i];
+            wg_items *= group[i];
+        } else {
+            group[i] = global_work_size[i] > default_wg_size ?
+                default_wg_size : global_work_size[i];
+            // only set 1 dimension automatically
+            for (++i; i < work_dim; ++i) {
+                grid[i] = global_work_size[i];
+                group[i] = 1;
+            }
+            break;
+        }
+    }
+    for (cl_uint i = work_dim; i < 3; ++i) {
+        grid[i] = 1;
+        group[i] = 1;
+    }
+
+    if (wg_items > max_wg_size) {
+        DPRINT("%s work-group of %d exceeds %d\n", kernel->name.c_str(),
+               (int)wg_items, (int)max_wg_size);
+        return CL_INVALID_WORK_GROUP_SIZE;
+    }
+
+    return CL_SUCCESS;
+}
+
+// Fill in a queue entry for a launch of kernel: geometry, arguments,
+// register counts, scratch sizes and group memory. Scratch memory itself
+// is allocated per launch by submitDispatch.
+static cl_int
+buildDispatch(_cl_kernel *kernel, cl_uint work_dim,
+              const size_t *global_work_offset,
+              const size_t *global_work_size,
+              const size_t *local_work_size, HsaQueueEntry *hsa_task)
+{
+    if (work_dim < 1 || work_dim > 3) {
+        return CL_INVALID_WORK_DIMENSION;
+    }
+
+    // the whole entry comes from one build of the kernel, even if the
+    // program is reloaded meanwhile
+    kernelDesc *desc = kernel->desc;
+
+    // native kernels only run on the CPU device
+    if (desc->nativeEntry) {
+        return CL_INVALID_PROGRAM_EXECUTABLE;
+    }
+
+    // the __local arguments may have been resized since the last launch
+    if (kernel->layoutGroupMem() > MAX_LDS_SIZE) {
+        DPRINT("%s needs %d bytes of group memory\n", kernel->name.c_str(),
+               kernel->groupMemSize);
+        return CL_OUT_OF_RESOURCES;
+    }
+
+    cl_int ret = checkLaunchArgs(kernel, desc);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    // the current version of the compiler adds 6 implicit arguments to an
+    // OpenCL kernel
+    if (!global_work_offset) {
+        kernel->addOCLKernelOffsetArgs(0, 0);
+        kernel->addOCLKernelOffsetArgs(1, 0);
+        kernel->addOCLKernelOffsetArgs(2, 0);
+    } else {
+        kernel->addOCLKernelOffsetArgs(0, &global_work_offset[0]);
+        kernel->addOCLKernelOffsetArgs(1, &global_work_offset[1]);
+        kernel->addOCLKernelOffsetArgs(2, &global_work_offset[2]);
+    }
+
+    kernel->addOCLKernelOffsetArgs(3, 0);
+    kernel->addOCLKernelOffsetArgs(4, 0);
+    kernel->addOCLKernelOffsetArgs(5, 0);
+
+    // the runtime has no argument limit, but the queue entry does
+    if (kernel->argList.size() > sizeof(HsaQueueEntry::offsets) /
+                                 sizeof(HsaQueueEntry::offsets[0]) ||
+        kernargLayout(kernel, nullptr) > sizeof(HsaQueueEntry::args)) {
+        DPRINT("%s has too many arguments for a queue entry\n",
+               kernel->name.c_str());
+        return CL_OUT_OF_RESOURCES;
+    }
+
+    size_t max_wg_size = kernelMaxWorkGroupSize(desc);
+
+    if (!max_wg_size) {
+        DPRINT("%s does not fit on a CU\n", kernel->name.c_str());
+        return CL_OUT_OF_RESOURCES;
+    }
+
+    size_t grid[3];
+    size_t group[3];
+    ret = launchGeometry(kernel, work_dim, global_work_size, local_work_size,
+                         max_wg_size, grid, group);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        hsa_task->gdSize[i] = grid[i];
+        hsa_task->wgSize[i] = group[i];
+    }
+
+    //////////////////////////////////////
+    hsa_task->code_ptr = (uint64_t)desc->code;
+
+    // setup arguments
+    hsa_task->num_args = kernel->argList.size();
+    kernargLayout(kernel, hsa_task->offsets);
+
+    for (size_t i = 0; i < kernel->argList.size(); i++) {
+        // copy argument to argument buffer in allocated HSA queue entry
+        const argDesc &arg = kernel->argList[i];
+        int offset = hsa_task->offsets[i];
+        DPRINT("HSA runtime: Offset %d\n", offset);
+        if (arg.hasValue) {
+            memcpy(hsa_task->args + offset, arg.contents(), arg.size);
+        } else if (arg.localSize) {
+            // argument is __local pointer, i.e., LDS offset
+            // must use groupMemOffset instead of contents
+            *(uint64_t*)(hsa_task->args + offset) =
+            (uint64_t)(arg.groupMemOffset);
+        }
+    }
+
+    hsa_task->sRegCount = desc->sRegCount;
+    hsa_task->dRegCount = desc->dRegCount;
+    hsa_task->cRegCount = desc->cRegCount;
+
+    DPRINT("regs: s %d d %d c %d\n", hsa_task->sRegCount,
+           hsa_task->dRegCount, hsa_task->cRegCount);
+
+    // Size private memory for the kernel, the gdSize already
+    // accounts for all the blocks
+    int numWorkItems = hsa_task->gdSize[0] *
+                       hsa_task->gdSize[1] *
+                       hsa_task->gdSize[2];
+    numWorkItems = numWorkItems % VecSize ? numWorkItems + VecSize -
+            (numWorkItems % VecSize) : numWorkItems;
+
+    hsa_task ->privMemPerItem = desc->privateMemSize;
+    hsa_task ->spillMemPerItem = desc->spillMemSize;
+
+    // Total of privMem and spillMem should be calculated with
+    // Total number of wavefronts must be:
+    // (Wavefronts * WavefrontSize)* privMemPerItem/spillMemPerItem.
+    hsa_task->privMemTotal = (desc->privateMemSize * numWorkItems);
+    hsa_task->spillMemTotal = (desc->spillMemSize * numWorkItems);
+
+    // FIXME: There is a mismatch regarding the allcation and use of both
+    // privateMemory and spliiMemory. On this (HSA_runtime), the total memory
+    // for each buufer (spill or priv) is calucalted by muptiplying
+    // total_number of workitems with spill/priv size per workitem.
+    // On hsail GPU side, the accesses to spill/priv memory assumes
+    // there is (VSZ * spill/priv per workitem) for each wavefront.
+    // This becomes a problem when the (total workitems less than number
+    // of wavefronts * VSZ). The multiplication by 8 below is a hack.
+    // should be fixed. The multiply with 8 (below) is to make the allocated
+    // memory for spill buffer large enough. Multipying with 64 would be
+    // the most conservative approach.
+    hsa_task->spillMemTotal = hsa_task->spillMemTotal * 8;
+
+    hsa_task->privMemStart = 0;
+    hsa_task->spillMemStart = 0;
+
+    hsa_task->roMemTotal = desc->readonlySize;
+    hsa_task->roMemStart = (uint64_t)desc->readonly;
+
+    // initialize read-only memory
+
+    // LDS storage will be allocated by CU
+    hsa_task->ldsSize = kernel->groupMemSize;
+    DPRINT("hsa_task->ldsSize=%d\n", hsa_task->ldsSize);
+
+    return CL_SUCCESS;
+}
+
+// Hand every committed entry of the queue's ring to the dispatcher in ring
+// order. One thread per queue publishes at a time; a producer that finds
+// the flag taken leaves its entry to the current publisher, which looks at
+// the ring again after stepping down.
+static void
+publishSubmissions(_cl_command_queue *queue)
+{
+    while (!queue->ringPublishing.exchange(true)) {
+        uint64_t head = queue->ringHead.load(std::memory_order_relaxed);
+
+        for (;;) {
+            submitSlot &slot = queue->ring[head % SUBMIT_RING_SIZE];
+
+            if (slot.seq.load(std::memory_order_acquire) != head + 1) {
+                break;
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(dispatcherLock);
+                memcpy(hsaTaskPtr, &slot.entry, sizeof(HsaQueueEntry));
+
+                // notify the dispatch engine that the task params are
+                // complete
+                *dispatcherDoorbell = 0;
+            }
+
+            slot.seq.store(head + SUBMIT_RING_SIZE, std::memory_order_release);
+            queue->ringHead.store(++head, std::memory_order_release);
+        }
+
+        queue->ringPublishing = false;
+
+        // a commit that landed after the scan found the flag still taken
+        if (queue->ring[head % SUBMIT_RING_SIZE].seq != head + 1) {
+            break;
+        }
+    }
+}
+
+// Wait until every entry reserved on the queue has reached the dispatcher.
+static void
+drainSubmissions(_cl_command_queue *queue)
+{
+    while (queue->ringHead != queue->ringTail) {
+        publishSubmissions(queue);
+        std::this_thread::yield();
+    }
+}
+
+// Wait until the CPU device has finished every launch it runs for the
+// queue. Its workers run on the cores of the host, so give them the one
+// this thread would spin on.
+static void
+waitForHostDispatches(_cl_command_queue *queue)
+{
+    // the acquire orders the caller's reads after the workers' writes
+    while (queue->hostDispLeft.load(std::memory_order_acquire) > 0) {
+        std::this_thread::yield();
+    }
+}
+
+// Wait until the queue has no dispatch left. The CPU device commits the
+// GPU dispatches chained after its launches, so it goes first.
+static void
+waitForDispatches(_cl_command_queue *queue)
+{
+    waitForHostDispatches(queue);
+    drainSubmissions(queue);
+
+    while (__atomic_load_n(queue->numDispLeft, __ATOMIC_ACQUIRE) > 0) {
+    }
+}
+
+// Allocate the scratch memory of a queue entry built by buildDispatch and
+// commit a copy of it to the queue's submission ring. With an event the
+// entry is owned by the event and freed on its release; without one it is
+// freed here.
+static void
+commitDispatch(_cl_command_queue *command_queue, HsaQueueEntry *hsa_task,
+               _cl_event *event)
+{
+    HostState *host_state = nullptr;
+
+    if (event) {
+        host_state = (HostState*)malloc(sizeof(HostState));
+        host_state->event = (uint64_t)event;
+    }
+
+    hsa_task->depends = (uint64_t)host_state;
+
+    // Point the dispatcher to counter variable (tracking # of dispatches)
+    // polled by runtime
+    hsa_task->numDispLeft = (uint64_t)command_queue->numDispLeft;
+
+    hsa_task->privMemStart = hsa_task->privMemTotal > 0 ?
+        (uint64_t)malloc(hsa_task->privMemTotal) : 0;
+    DPRINT("hsa_task->privMemTotal=%d\n", hsa_task->privMemTotal);
+    DPRINT("hsa_task->privMemStart=%p\n", (void*)hsa_task->privMemStart);
+
+    hsa_task->spillMemStart = hsa_task->spillMemTotal > 0 ?
+        (uint64_t)malloc(hsa_task->spillMemTotal) : 0;
+    DPRINT("hsa_task->spillMemTotal=%d\n", hsa_task->spillMemTotal);
+    DPRINT("hsa_task->spillMemStart=%p\n", (void*)hsa_task->spillMemStart);
+
+    // Point the dispatcher to done variables polled by runtime
+    if (event) {
+        hsa_task->addrToNotify = (uint64_t)&event->done;
+        event->hsaTaskPtr = hsa_task;
+    } else {
+        hsa_task->addrToNotify = 0;
+    }
+
+    uint64_t pos = command_queue->ringTail.fetch_add(1,
+                                                     std::memory_order_relaxed);
+    submitSlot &slot = command_queue->ring[pos % SUBMIT_RING_SIZE];
+
+    // the ring is full; help drain it until the slot comes free
+    while (slot.seq.load(std::memory_order_acquire) != pos) {
+        publishSubmissions(command_queue);
+        std::this_thread::yield();
+    }
+
+    memcpy(&slot.entry, hsa_task, sizeof(HsaQueueEntry));
+    slot.seq = pos + 1;
+
+    if (!event) {
+        std::lock_guard<std::mutex> guard(command_queue->scratchLock);
+        if (hsa_task->privMemStart) {
+            command_queue->scratch.push_back((void*)hsa_task->privMemStart);
+        }
+        if (hsa_task->spillMemStart) {
+            command_queue->scratch.push_back((void*)hsa_task->spillMemStart);
+        }
+        free(hsa_task);
+    }
+
+    publishSubmissions(command_queue);
+}
+
+// Commit a queue entry built by buildDispatch for kernel, with a new
+// event if the caller asked for one.
+static void
+submitDispatch(_cl_command_queue *command_queue, _cl_kernel *kernel,
+               HsaQueueEntry *hsa_task, cl_event *event)
+{
+    DPRINT("launching %s\n", kernel->name.c_str());
+
+    if (command_queue->properties & CL_QUEUE_PREFAULT_ENABLE_HSA) {
+        prefaultKernelArgs(command_queue, kernel);
+    }
+
+    if (event) {
+#if 1
+        *event = hsa_signal_create();
+#else
+        *event = new _cl_event();
+#endif
+    }
+
+    commitDispatch(command_queue, hsa_task, event ? *event : nullptr);
+}
+
+// Build a CPU device launch of the native kernel desc with the arguments
+// set on kernel. The argument values are copied into the launch, so they
+// can be set again as soon as this returns.
+static cl_int
+buildCpuLaunch(_cl_kernel *kernel, const kernelDesc *desc, cl_uint work_dim,
+               const size_t *global_work_offset,
+               const size_t *global_work_size, const size_t *local_work_size,
+               cpuLaunch **launch_ret)
+{
+    if (work_dim < 1 || work_dim > 3) {
+        return CL_INVALID_WORK_DIMENSION;
+    }
+
+    if (!desc->nativeEntry) {
+        return CL_INVALID_PROGRAM_EXECUTABLE;
+    }
+
+    if (kernel->layoutGroupMem(desc->staticLdsSize) > MAX_LDS_SIZE) {
+        DPRINT("%s needs %d bytes of group memory\n", kernel->name.c_str(),
+               kernel->groupMemSize);
+        return CL_OUT_OF_RESOURCES;
+    }
+
+    size_t grid[3];
+    size_t group[3];
+    cl_int ret = launchGeometry(kernel, work_dim, global_work_size,
+                                local_work_size, kernelMaxWorkGroupSize(desc),
+                                grid, group);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    cpuLaunch *launch = new cpuLaunch();
+    launch->entry = desc->nativeEntry;
+    launch->barriers = desc->nativeFlags & CL_NATIVE_KERNEL_BARRIER_HSA;
+    launch->workDim = work_dim;
+    launch->groupMemSize = kernel->groupMemSize;
+
+    for (cl_uint i = 0; i < 3; ++i) {
+        launch->globalSize[i] = grid[i];
+        launch->localSize[i] = group[i];
+        launch->firstGroup[i] = 0;
+        launch->numGroups[i] = divCeil(grid[i], group[i]);
+        launch->globalOffset[i] = global_work_offset && i < work_dim ?
+                                  global_work_offset[i] : 0;
+    }
+
+    // every argument the kernel was registered with must be set
+    for (size_t i = 0; i < desc->args.size(); ++i) {
+        size_t slot = i + DEFAULT_OCL_KERN_ARGS;
+        const argDesc *arg = slot < kernel->argList.size() ?
+                             &kernel->argList[slot] : nullptr;
+
+        if (!arg || (!arg->hasValue && !arg->localSize)) {
+            delete launch;
+            return CL_INVALID_KERNEL_ARGS;
+        }
+
+        if (arg->localSize) {
+            launch->addArg(nullptr, 0, arg->groupMemOffset);
+        } else {
+            launch->addArg(arg->contents(), arg->size, -1);
+        }
+    }
+
+    launch->event = nullptr;
+    launch->joinFlag = nullptr;
+    launch->startAfter = nullptr;
+
+    *launch_ret = launch;
+    return CL_SUCCESS;
+}
+
+// Launch a native kernel on the CPU device.
+static cl_int
+cpuEnqueueNDRange(_cl_command_queue *command_queue, _cl_kernel *kernel,
+                  cl_uint work_dim, const size_t *global_work_offset,
+                  const size_t *global_work_size,
+                  const size_t *local_work_size, cl_event *event)
+{
+    cpuLaunch *launch;
+    cl_int ret = buildCpuLaunch(kernel, kernel->desc, work_dim,
+                                global_work_offset, global_work_size,
+                                local_work_size, &launch);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    launch->queue = command_queue;
+    launch->dispLeft = &command_queue->hostDispLeft;
+
+    if (event) {
+        *event = new _cl_event();
+        (*event)->onHost = true;
+        launch->event = *event;
+    }
+
+    DPRINT("launching %s on the CPU\n", kernel->name.c_str());
+    cpuDevice::get()->submit(launch);
+
+    return CL_SUCCESS;
+}
+
+// Work-items per nanosecond a kernel was last measured at on each device
+// of a co-executed launch, 0 until measured.
+struct coExecRate {
+    coExecRate() : gpu(0), cpu(0) { }
+
+    double gpu;
+    double cpu;
+};
+
+// guarded by coExecLock, keyed by kernel name so the rates outlive the
+// kernel objects and program reloads
+static std::map<std::string, coExecRate> coExecRates;
+static std::mutex coExecLock;
+
+// GPU share of a kernel not measured yet, and the least share either
+// device gets, so that both keep being measured
+static const double CO_EXEC_INITIAL_GPU_SHARE = 0.5;
+static const double CO_EXEC_MIN_SHARE = 1.0 / 16;
+
+// Part of the next co-executed launch of the kernel to give the GPU: the
+// share that has both devices finish at the same time at the measured
+// rates.
+static double
+coExecGpuShare(const std::string &kernel_name)
+{
+    std::lock_guard<std::mutex> guard(coExecLock);
+    auto it = coExecRates.find(kernel_name);
+
+    if (it == coExecRates.end() || !it->second.gpu || !it->second.cpu) {
+        return CO_EXEC_INITIAL_GPU_SHARE;
+    }
+
+    double share = it->second.gpu / (it->second.gpu + it->second.cpu);
+
+    return std::min(std::max(share, CO_EXEC_MIN_SHARE),
+                    1 - CO_EXEC_MIN_SHARE);
+}
+
+// Fold the run times of a co-executed launch into the kernel's rates. The
+// average with the previous rate smooths out a single noisy launch while
+// still following a change in the input within a few launches.
+static void
+coExecRecord(const std::string &kernel_name, size_t gpu_items,
+             uint64_t gpu_ns, size_t cpu_items, uint64_t cpu_ns)
+{
+    if (!gpu_ns || !cpu_ns) {
+        return;
+    }
+
+    double gpu = (double)gpu_items / gpu_ns;
+    double cpu = (double)cpu_items / cpu_ns;
+
+    std::lock_guard<std::mutex> guard(coExecLock);
+    coExecRate &rate = coExecRates[kernel_name];
+
+    rate.gpu = rate.gpu ? (rate.gpu + gpu) / 2 : gpu;
+    rate.cpu = rate.cpu ? (rate.cpu + cpu) / 2 : cpu;
+
+    DPRINT("%s: GPU %f, CPU %f work-items/ns\n", kernel_name.c_str(),
+           rate.gpu, rate.cpu);
+}
+
+static bool
+eventDone(_cl_event *event)
+{
+    return __atomic_load_n(&event->done, __ATOMIC_ACQUIRE);
+}
+
+// Commit a GPU dispatch of a co-execution queue and make its event the one
+// the CPU part of the next split launch starts after. Returns the event of
+// the dispatch committed before it, with a reference for the caller, or
+// nullptr if that one is done.
+static _cl_event *
+coCommitDispatch(_cl_command_queue *queue, HsaQueueEntry *hsa_task,
+                 _cl_event *event)
+{
+    std::lock_guard<std::mutex> guard(queue->coLock);
+    _cl_event *prev = queue->coLastGpu;
+
+    commitDispatch(queue, hsa_task, event);
+    clRetainEvent(event);
+    queue->coLastGpu = event;
+
+    for (size_t i = 0; i < queue->coRetired.size();) {
+        if (eventDone(queue->coRetired[i])) {
+            clReleaseEvent(queue->coRetired[i]);
+            queue->coRetired[i] = queue->coRetired.back();
+            queue->coRetired.pop_back();
+        } else {
+            ++i;
+        }
+    }
+
+    if (!prev) {
+        return nullptr;
+    }
+
+    if (eventDone(prev)) {
+        clReleaseEvent(prev);
+        return nullptr;
+    }
+
+    queue->coRetired.push_back(prev);
+    clRetainEvent(prev);
+    return prev;
+}
+
+// Drop the references a co-execution queue holds to the events of its GPU
+// dispatches, all of which are done.
+static void
+coReleaseEvents(_cl_command_queue *queue)
+{
+    std::lock_guard<std::mutex> guard(queue->coLock);
+
+    for (auto retired : queue->coRetired) {
+        clReleaseEvent(retired);
+    }
+    queue->coRetired.clear();
+
+    if (queue->coLastGpu) {
+        clReleaseEvent(queue->coLastGpu);
+        queue->coLastGpu = nullptr;
+    }
+}
+
+// Launch a kernel on a co-execution queue. If a native kernel of the same
+// name is registered for co-execution, the NDRange is split along its
+// last dimension at a work-group boundary: the GPU runs the leading part
+// as an NDRange of its own, which keeps the IDs of the whole, and the CPU
+// device runs the remaining groups of the whole NDRange. The CPU part is
+// joined to the GPU part's event, so the launch's event and the queue's
+// count of host dispatches cover the whole launch.
+//
+// Nothing waits on the calling thread. The launches run in order through
+// the CPU device's chain of the queue: a GPU dispatch is committed once
+// the CPU parts before it have finished, by the worker that finished the
+// last of them, and a CPU part starts once the GPU dispatches before its
+// own one are done.
+static cl_int
+coEnqueueNDRange(_cl_command_queue *command_queue, _cl_kernel *kernel,
+                 cl_uint work_dim, const size_t *global_work_offset,
+                 const size_t *global_work_size,
+                 const size_t *local_work_size, cl_event *event)
+{
+    kernelDesc *desc = kernel->desc;
+    const kernelDesc *cpu_desc = cpuFindKernel(kernel->name.c_str());
+
+    size_t grid[3];
+    size_t group[3];
+    size_t gpu_units = 0;
+    size_t units = 0;
+    cl_uint dim = work_dim - 1;
+
+    if (cpu_desc &&
+        (cpu_desc->nativeFlags & CL_NATIVE_KERNEL_CO_EXECUTE_HSA) &&
+        work_dim >= 1 && work_dim <= 3) {
+        cl_int ret = launchGeometry(kernel, work_dim, global_work_size,
+                                    local_work_size,
+                                    std::min(kernelMaxWorkGroupSize(desc),
+                                             kernelMaxWorkGroupSize(cpu_desc)),
+                                    grid, group);
+        if (ret != CL_SUCCESS) {
+            return ret;
+        }
+
+        units = divCeil(grid[dim], group[dim]);
+        gpu_units = (size_t)(coExecGpuShare(kernel->name) * units + 0.5);
+        gpu_units = std::min(std::max(gpu_units, (size_t)1), units - 1);
+    }
+
+    // too small to split, or nothing to run it on the CPU
+    if (units < 2) {
+        HsaQueueEntry *hsa_task =
+            (HsaQueueEntry*)malloc(sizeof(HsaQueueEntry));
+
+        cl_int ret = buildDispatch(kernel, work_dim, global_work_offset,
+                                   global_work_size, local_work_size,
+                                   hsa_task);
+        if (ret != CL_SUCCESS) {
+            free(hsa_task);
+            return ret;
+        }
+
+        DPRINT("launching %s\n", kernel->name.c_str());
+        if (command_queue->properties & CL_QUEUE_PREFAULT_ENABLE_HSA) {
+            prefaultKernelArgs(command_queue, kernel);
+        }
+
+        // the queue tracks every GPU dispatch, so it always gets an event
+        cl_event gpu_event = hsa_signal_create();
+        if (event) {
+            clRetainEvent(gpu_event);
+            *event = gpu_event;
+        }
+
+        if (!command_queue->hostDispLeft.load(std::memory_order_acquire)) {
+            _cl_event *prev = coCommitDispatch(command_queue, hsa_task,
+                                               gpu_event);
+            if (prev) {
+                clReleaseEvent(prev);
+            }
+            clReleaseEvent(gpu_event);
+
+            return CL_SUCCESS;
+        }
+
+        // a launch of no groups that commits the dispatch in its turn
+        cpuLaunch *launch = new cpuLaunch();
+        launch->queue = command_queue;
+        launch->dispLeft = &command_queue->hostDispLeft;
+        launch->onStart = [=](cpuLaunch*) {
+            _cl_event *prev = coCommitDispatch(command_queue, hsa_task,
+                                               gpu_event);
+            if (prev) {
+                clReleaseEvent(prev);
+            }
+            clReleaseEvent(gpu_event);
+        };
+
+        cpuDevice::get()->submit(launch);
+
+        return CL_SUCCESS;
+    }
+
+    size_t gpu_offset[3] = { 0, 0, 0 };
+    size_t gpu_grid[3];
+
+    for (cl_uint i = 0; i < work_dim; ++i) {
+        if (global_work_offset) {
+            gpu_offset[i] = global_work_offset[i];
+        }
+        gpu_grid[i] = grid[i];
+    }
+
+    gpu_grid[dim] = gpu_units * group[dim];
+
+    // build both parts before submitting either, so a launch that fails
+    // runs nowhere
+    cpuLaunch *launch;
+    cl_int ret = buildCpuLaunch(kernel, cpu_desc, work_dim, gpu_offset,
+                                grid, group, &launch);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    launch->firstGroup[dim] = gpu_units;
+    launch->numGroups[dim] -= gpu_units;
+
+    HsaQueueEntry *hsa_task = (HsaQueueEntry*)malloc(sizeof(HsaQueueEntry));
+
+    ret = buildDispatch(kernel, work_dim, gpu_offset, gpu_grid, group,
+                        hsa_task);
+    if (ret != CL_SUCCESS) {
+        free(hsa_task);
+        delete launch;
+        return ret;
+    }
+
+    if (command_queue->properties & CL_QUEUE_PREFAULT_ENABLE_HSA) {
+        prefaultKernelArgs(command_queue, kernel);
+    }
+
+    cl_event gpu_event = hsa_signal_create();
+
+    size_t gpu_items = 1;
+    size_t cpu_items = 1;
+
+    for (cl_uint i = 0; i < work_dim; ++i) {
+        gpu_items *= gpu_grid[i];
+        cpu_items *= i == dim ? grid[i] - gpu_grid[i] : grid[i];
+    }
+
+    std::string name = kernel->name;
+
+    launch->queue = command_queue;
+    launch->dispLeft = &command_queue->hostDispLeft;
+    launch->joinFlag = &gpu_event->done;
+    launch->onStart = [=](cpuLaunch *l) {
+        // the GPU part runs alongside the CPU part, which reads what the
+        // GPU dispatches before it wrote
+        l->startAfter = coCommitDispatch(command_queue, hsa_task,
+                                         gpu_event);
+    };
+    launch->onFinish = [=](const cpuLaunch *l) {
+        // without profiling times from the dispatcher, take when the
+        // CPU device first saw the GPU part done, which it watches from
+        // the commit of the GPU part
+        uint64_t gpu_ns = gpu_event->end > gpu_event->start ?
+                          gpu_event->end - gpu_event->start :
+                          l->joinNs - l->startNs;
+
+        coExecRecord(name, gpu_items, gpu_ns, cpu_items,
+                     l->endNs - l->beginNs);
+        clReleaseEvent(gpu_event);
+    };
+
+    if (event) {
+        *event = new _cl_event();
+        (*event)->onHost = true;
+        launch->event = *event;
+    }
+
+    DPRINT("co-executing %s: %d of %d work-groups on the GPU\n",
+           kernel->name.c_str(), (int)gpu_units, (int)units);
+    cpuDevice::get()->submit(launch);
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueNDRangeKernel(cl_command_queue command_queue, cl_kernel kernel,
+                       cl_uint work_dim, const size_t *global_work_offset,
+                       const size_t *global_work_size,
+                       const size_t *local_work_size,
+                       cl_uint num_events_in_wait_list,
+                       const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clEnqueueNDRangeKernel()\n");
+
+    // held until the entry is in the ring, after which the queue counts
+    // the dispatch
+    DescReadGuard guard;
+    kernel = argState(kernel);
+
+    if (command_queue->device->type == CL_DEVICE_TYPE_CPU) {
+        return cpuEnqueueNDRange(command_queue, kernel, work_dim,
+                                 global_work_offset, global_work_size,
+                                 local_work_size, event);
+    }
+
+    if (command_queue->properties & CL_QUEUE_CO_EXECUTE_HSA) {
+        return coEnqueueNDRange(command_queue, kernel, work_dim,
+                                global_work_offset, global_work_size,
+                                local_work_size, event);
+    }
+
+    HsaQueueEntry *hsa_task = (HsaQueueEntry*)malloc(sizeof(HsaQueueEntry));
+
+    cl_int ret = buildDispatch(kernel, work_dim, global_work_offset,
+                               global_work_size, local_work_size, hsa_task);
+    if (ret != CL_SUCCESS) {
+        free(hsa_task);
+        return ret;
+    }
+
+    submitDispatch(command_queue, kernel, hsa_task, event);
+
+    return CL_SUCCESS;
+}
+
+// A kernel launch frozen at creation: a queue entry with the geometry,
+// argument layout, register counts and scratch sizes already filled in,
+// and the argument block it was built from. The plan holds a reference on
+// its queue.
+struct _cl_launch_plan_hsa {
+    _cl_command_queue *queue;
+    _cl_kernel *args;
+    HsaQueueEntry entry;
+};
+
+CL_API_ENTRY cl_launch_plan_hsa CL_API_CALL
+clCreateLaunchPlanHSA(cl_command_queue command_queue, cl_kernel kernel,
+                      cl_uint work_dim, const size_t *global_work_offset,
+                      const size_t *global_work_size,
+                      const size_t *local_work_size, cl_int *errcode_ret)
+CL_EXT_SUFFIX__VERSION_1_1
+{
+    DPRINT("clCreateLaunchPlanHSA()\n");
+
+    cl_int ret = CL_SUCCESS;
+    cl_launch_plan_hsa plan = nullptr;
+
+    if (!command_queue) {
+        ret = CL_INVALID_COMMAND_QUEUE;
+    } else if (command_queue->device->type == CL_DEVICE_TYPE_CPU) {
+        // a plan is a prebuilt dispatcher queue entry
+        ret = CL_INVALID_COMMAND_QUEUE;
+    } else if (!kernel) {
+        ret = CL_INVALID_KERNEL;
+    } else if (!global_work_size) {
+        ret = CL_INVALID_GLOBAL_WORK_SIZE;
+    } else {
+        plan = new _cl_launch_plan_hsa();
+        plan->queue = command_queue;
+        DescReadGuard guard;
+        plan->args = new _cl_kernel(*argState(kernel));
+
+        ret = buildDispatch(plan->args, work_dim, global_work_offset,
+                            global_work_size, local_work_size, &plan->entry);
+        if (ret != CL_SUCCESS) {
+            delete plan->args;
+            delete plan;
+            plan = nullptr;
+        } else {
+            clRetainCommandQueue(command_queue);
+        }
+    }
+
+    if (errcode_ret) {
+        *errcode_ret = ret;
+    }
+
+    return plan;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clSetLaunchPlanArgHSA(cl_launch_plan_hsa plan, cl_uint arg_index,
+                      size_t arg_size, const void *arg_value)
+CL_EXT_SUFFIX__VERSION_1_1
+{
+    DPRINT("clSetLaunchPlanArgHSA(%p, %d, %d)\n", (void*)plan, arg_index,
+           (int)arg_size);
+
+    if (!plan) {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_int ret = checkKernelArg(plan->args->desc, arg_index, arg_size,
+                                arg_value);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    cl_uint i = arg_index + DEFAULT_OCL_KERN_ARGS;
+    if (i >= plan->args->argList.size()) {
+        return CL_INVALID_ARG_INDEX;
+    }
+
+    // the layout is frozen: values can change, sizes and group memory
+    // cannot
+    const argDesc &arg = plan->args->argList[i];
+    if (!arg_value || !arg.hasValue) {
+        return CL_INVALID_ARG_VALUE;
+    }
+
+    if (arg_size != arg.size) {
+        return CL_INVALID_ARG_SIZE;
+    }
+
+    plan->args->addArg(i, arg_size, arg_value);
+    memcpy(plan->entry.args + plan->entry.offsets[i], arg_value, arg_size);
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueLaunchPlanHSA(cl_launch_plan_hsa plan,
+                       cl_uint num_events_in_wait_list,
+                       const cl_event *event_wait_list, cl_event *event)
+CL_EXT_SUFFIX__VERSION_1_1
+{
+    DPRINT("clEnqueueLaunchPlanHSA(%p)\n", (void*)plan);
+
+    if (!plan) {
+        return CL_INVALID_VALUE;
+    }
+
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+        (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
+
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+
+    HsaQueueEntry *hsa_task = (HsaQueueEntry*)malloc(sizeof(HsaQueueEntry));
+    memcpy(hsa_task, &plan->entry, sizeof(HsaQueueEntry));
+
+    submitDispatch(plan->queue, plan->args, hsa_task, event);
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clReleaseLaunchPlanHSA(cl_launch_plan_hsa plan)
+CL_EXT_SUFFIX__VERSION_1_1
+{
+    DPRINT("clReleaseLaunchPlanHSA()\n");
+
+    if (!plan) {
+        return CL_INVALID_VALUE;
+    }
+
+    clReleaseCommandQueue(plan->queue);
+    delete plan->args;
+    delete plan;
+
+    return CL_SUCCESS;
+}
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clGetKernelArgInfo(cl_kernel kernel, cl_uint arg_indx,
+                   cl_kernel_arg_info param_name, size_t param_value_size,
+                   void *param_value, size_t *param_value_size_ret)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clGetKernelArgInfo()\n");
+
+    if (!kernel) {
+        return CL_INVALID_KERNEL;
+    }
+
+    DescReadGuard guard;
+    const kernelDesc *desc = kernel->desc;
+    const std::vector<kernelArgMeta> &sig = desc->args;
+
+    // nothing is known before the first launch
+    if (!desc->argsCaptured.load(std::memory_order_acquire)) {
+        return CL_KERNEL_ARG_INFO_NOT_AVAILABLE;
+    }
+
+    if (arg_indx >= sig.size()) {
+        return CL_INVALID_ARG_INDEX;
+    }
+
+    const kernelArgMeta &meta = sig[arg_indx];
+    size_t size;
+    union {
+        cl_kernel_arg_address_qualifier address;
+        cl_kernel_arg_access_qualifier access;
+        cl_kernel_arg_type_qualifier type;
+        size_t bytes;
+        cl_bool pointer;
+    } value;
+
+    switch (param_name) {
+      case CL_KERNEL_ARG_ADDRESS_QUALIFIER:
+        value.address = meta.addressQualifier;
+        size = sizeof(value.address);
+        break;
+      case CL_KERNEL_ARG_ACCESS_QUALIFIER:
+        value.access = CL_KERNEL_ARG_ACCESS_NONE;
+        size = sizeof(value.access);
+        break;
+      case CL_KERNEL_ARG_TYPE_QUALIFIER:
+        value.type = CL_KERNEL_ARG_TYPE_NONE;
+        size = sizeof(value.type);
+        break;
+      case CL_KERNEL_ARG_SIZE_HSA:
+        value.bytes = meta.size;
+        size = sizeof(value.bytes);
+        break;
+      case CL_KERNEL_ARG_ALIGNMENT_HSA:
+        value.bytes = meta.alignment;
+        size = sizeof(value.bytes);
+        break;
+      case CL_KERNEL_ARG_IS_POINTER_HSA:
+        value.pointer = meta.isPointer ? CL_TRUE : CL_FALSE;
+        size = sizeof(value.pointer);
+        break;
+      case CL_KERNEL_ARG_TYPE_NAME:
+      case CL_KERNEL_ARG_NAME:
+        // the code object carries no argument names or types
+        return CL_KERNEL_ARG_INFO_NOT_AVAILABLE;
+      default:
+        return CL_INVALID_VALUE;
+    }
+
+    if (param_value_size_ret) {
+        *param_value_size_ret = size;
+    }
+
+    if (param_value) {
+        if (param_value_size < size) {
+            return CL_INVALID_VALUE;
+        }
+
+        memcpy(param_value, &value, size);
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clGetKernelWorkGroupInfo(cl_kernel kernel, cl_device_id device,
+                         cl_kernel_work_group_info param_name,
+                         size_t param_value_size, void *param_value,
+                         size_t *param_value_size_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetKernelWorkGroupInfo()\n");
+
+    if (!kernel) {
+        return CL_INVALID_KERNEL;
+    }
+
+    DescReadGuard guard;
+    const kernelDesc *desc = kernel->desc;
+
+    // the wavefront width and CU limits are the ones clGetDeviceInfo
+    // reports, so load them from the driver if no call has yet. A native
+    // kernel runs one work-item at a time on a CPU worker.
+    bool cpu = desc->nativeEntry ||
+               (device && device->type == CL_DEVICE_TYPE_CPU);
+    cl_int ret = cpu ? CL_SUCCESS : hsaDriverInit();
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    size_t wf_size = cpu ? 1 : VecSize;
+
+    switch (param_name) {
+      case CL_KERNEL_WORK_GROUP_SIZE:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(size_t);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(size_t)) {
+                *((size_t*)(param_value)) = kernelMaxWorkGroupSize(desc);
+            } else {
+                return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_KERNEL_COMPILE_WORK_GROUP_SIZE:
+        // the driver's kernel info carries no reqd_work_group_size, so
+        // report it as unspecified
+        if(param_value_size_ret) {
+            *param_value_size_ret = sizeof(size_t) * 3;
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(size_t) * 3) {
+                size_t *dest = (size_t*)param_value;
+                dest[0] = 0;
+                dest[1] = 0;
+                dest[2] = 0;
+            } else {
+                return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(size_t);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(size_t)) {
+                *((size_t*)(param_value)) = wf_size;
+            } else {
+                return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_KERNEL_PRIVATE_MEM_SIZE:
+        // spilled registers live in private scratch alongside the
+        // kernel's own private variables
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_ulong);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_ulong)) {
+                *((cl_ulong*)(param_value)) =
+                    (cl_ulong)desc->privateMemSize + desc->spillMemSize;
+            } else {
+                return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_KERNEL_LOCAL_MEM_SIZE:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_ulong);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_ulong)) {
+                *((cl_ulong*)(param_value)) =
+                    argState(kernel)->layoutGroupMem();
+            } else {
+                return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      default:
+        return CL_INVALID_VALUE;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clWaitForEvents(cl_uint num_events, const cl_event *event_list)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clWaitForEvents()\n");
+
+    for (cl_uint i = 0; i < num_events; ++i) {
+        // set by a CPU device worker; mwait is only allowed in the
+        // simulator
+        if (event_list[i]->onHost) {
+            while (!__atomic_load_n(&event_list[i]->done, __ATOMIC_ACQUIRE)) {
+                std::this_thread::yield();
+            }
+            continue;
+        }
+
+        while (!event_list[i]->done) {
+            __builtin_ia32_monitor ((void *)&event_list[i]->done, 0, 0);
+#if 1
+            __builtin_ia32_mwait(0, 0);
+#else
+            asm("hlt");
+#endif
+        }
+    }
+    return CL_SUCCESS;
+}
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clGetEventInfo(cl_event event, cl_event_info param_name,
+               size_t param_value_size, void *param_value,
+               size_t *param_value_size_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetEventInfo()\n");
+
+    switch (param_name) {
+      case CL_EVENT_COMMAND_QUEUE:
+        clFatal("CL_EVENT_COMMAND_QUEUE: clGetEventInfo not yet "
+                "implemented\n");
+        break;
+      case CL_EVENT_COMMAND_TYPE:
+        clFatal("CL_EVENT_COMMAND_TYPE: clGetEventInfo not yet "
+                "implemented\n");
+        break;
+      case CL_EVENT_COMMAND_EXECUTION_STATUS:
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(cl_int);
+        }
+
+        if (param_value) {
+            if (param_value_size >= sizeof(cl_int)) {
+                if(event->done) {
+                    *((cl_int*)(param_value)) = CL_COMPLETE;
+                } else {
+                    *((cl_int*)(param_value)) = CL_RUNNING;
+                }
+            } else {
+                return CL_INVALID_VALUE;
+            }
+        }
+        break;
+      case CL_EVENT_REFERENCE_COUNT:
+        clFatal("CL_EVENT_REFERENCE_COUNT: clGetEventInfo not yet "
+                "implemented\n");
+        break;
+      default:
+        return CL_INVALID_VALUE;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clReleaseEvent(cl_event event)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clReleaseEvent()\n");
+
+    if (!dropRef(refevent, event)) {
+        return CL_SUCCESS;
+    }
+
+    if (event->hsaTaskPtr) {
+        if (event->hsaTaskPtr->privMemStart) {
+            free((void*)(event->hsaTaskPtr->privMemStart));
+        }
+        if (event->hsaTaskPtr->spillMemStart) {
+            free((char*)(event->hsaTaskPtr->spillMemStart));
+        }
+        free(event->hsaTaskPtr);
+    }
+    delete event;
+    return CL_SUCCESS;
+}
+
+/* Profiling APIs */
+extern CL_API_ENTRY cl_int CL_API_CALL
+clGetEventProfilingInfo(cl_event event, cl_profiling_info param_name,
+                        size_t param_value_size, void *param_value,
+                        size_t *param_value_size_ret)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clGetEventProfilingInfo()\n");
+
+    if (param_value_size_ret) {
+        *param_value_size_ret = 0;
+    }
+
+    switch (param_name) {
+      case CL_PROFILING_COMMAND_START:
+        assert(param_value_size >= sizeof(uint64_t));
+        *((uint64_t*)param_value) = event->start;
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(uint64_t);
+        }
+        break;
+      case CL_PROFILING_COMMAND_END:
+        assert(param_value_size >= sizeof(uint64_t));
+        *((uint64_t*)param_value) = event->end;
+        if (param_value_size_ret) {
+            *param_value_size_ret = sizeof(uint64_t);
+        }
+        break;
+      default:
+        return CL_INVALID_VALUE;
+    }
+    return CL_SUCCESS;
+}
+
+/* Flush and Finish APIs */
+extern CL_API_ENTRY cl_int CL_API_CALL
+clFlush(cl_command_queue command_queue)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clFlush()\n");
+    waitForDispatches(command_queue);
+    // asm("hlt") does not work here because there
+    // is a race if the dispatcher called cpu->wakeup()
+    // when the CPU is awake and hlt is the next CPU instruction
+    // to be executed
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clFinish(cl_command_queue  command_queue) CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clFinish()\n");
+
+    // the launches of the calls that left before this are in the ring
+    uint64_t epoch = hsaOldestDescReader();
+
+    // the scratch of event-less launches committed so far; they are done
+    // once the ring has drained and the dispatches left reach 0
+    std::vector<void*> scratch;
+    {
+        std::lock_guard<std::mutex> guard(command_queue->scratchLock);
+        scratch.swap(command_queue->scratch);
+    }
+
+    waitForDispatches(command_queue);
+    command_queue->drainedEpoch = epoch;
+
+    for (auto mem : scratch) {
+        free(mem);
+    }
+    coReleaseEvents(command_queue);
+    // asm("hlt") does not work here because there
+    // is a race if the dispatcher called cpu->wakeup()
+    // when the CPU is awake and hlt is the next CPU instruction
+    // to be executed
+
+    // code retired by a reload may have been waiting on this queue
+    hsaReclaimBinaries();
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueReadBuffer(cl_command_queue command_queue, cl_mem buffer,
+                    cl_bool blocking_read, size_t offset, size_t size,
+                    void *ptr, cl_uint num_events_in_wait_list,
+                    const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clEnqueueReadBuffer()\n");
+    // make sure buffer and ptr are not nullptr pointers
+    if (!(buffer && ptr)) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (beyondBuffer(buffer, offset, size)) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (event) {
+        *event = new _cl_event();
+    }
+
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+        (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
+
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    clFinish(command_queue);
+    if ((void*)buffer != ptr) {
+        memcpy(ptr, (char*)buffer+offset, size);
+    }
+
+    if (event) {
+        (*event)->done = true;
+    }
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueWriteBuffer(cl_command_queue command_queue, cl_mem buffer,
+                     cl_bool blocking_write, size_t offset, size_t size,
+                     const void *ptr, cl_uint num_events_in_wait_list,
+                     const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clEnqueueWriteBuffer()\n");
+
+    if (!(buffer && ptr)) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (beyondBuffer(buffer, offset, size)) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (event) {
+        *event = new _cl_event();
+    }
+
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+       (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
+
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    if ((void*)buffer != ptr) {
+        memcpy((char *)buffer+offset, ptr, size);
+    }
+
+    if (event) {
+        (*event)->done = true;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueCopyBuffer(cl_command_queue command_queue, cl_mem src_buffer,
+                    cl_mem dst_buffer, size_t src_offset, size_t dst_offset,
+                    size_t size, cl_uint num_events_in_wait_list,
+                    const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clEnqueueCopyBuffer()\n");
+
+    if (!src_buffer) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (!dst_buffer) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (beyondBuffer(src_buffer, src_offset, size) ||
+        beyondBuffer(dst_buffer, dst_offset, size)) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (event) {
+        *event = new _cl_event();
+    }
+
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+       (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
+
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+
+    if (((char*)(dst_buffer)+dst_offset) !=
+        ((char*)(src_buffer)+src_offset)) {
+        memcpy(((char*)(dst_buffer)+dst_offset),
+               ((char*)(src_buffer)+src_offset), size);
+    }
+
+    if (event) {
+        (*event)->done = true;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueReadBufferRect(cl_command_queue command_queue, cl_mem buffer,
+                        cl_bool blocking_read, const size_t *buffer_origin,
+                        const size_t *host_origin, const size_t *region,
+                        size_t buffer_row_pitch, size_t buffer_slice_pitch,
+                        size_t host_row_pitch, size_t host_slice_pitch,
+                        void *ptr, cl_uint num_events_in_wait_list,
+                        const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_1
+{
+    DPRINT("clEnqueueReadBufferRect()\n");
+
+    if (!buffer) {
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    if (!(ptr && buffer_origin && host_origin)) {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_int ret = rectPitches(region, &buffer_row_pitch, &buffer_slice_pitch);
+    if (ret == CL_SUCCESS) {
+        ret = rectPitches(region, &host_row_pitch, &host_slice_pitch);
+    }
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    size_t extent;
+    if (!rectExtent(buffer_origin, region, buffer_row_pitch,
+                    buffer_slice_pitch, &extent) ||
+        beyondBuffer(buffer, 0, extent)) {
+        return CL_INVALID_VALUE;
+    }
+
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+        (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
+
+    if (event) {
+        *event = new _cl_event();
+    }
+
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    clFinish(command_queue);
+    copyRect((char*)ptr, host_origin, host_row_pitch, host_slice_pitch,
+             (const char*)buffer, buffer_origin, buffer_row_pitch,
+             buffer_slice_pitch, region);
+
+    if (event) {
+        (*event)->done = true;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueWriteBufferRect(cl_command_queue command_queue, cl_mem buffer,
+                         cl_bool blocking_write, const size_t *buffer_origin,
+                         const size_t *host_origin, const size_t *region,
+                         size_t buffer_row_pitch, size_t buffer_slice_pitch,
+                         size_t host_row_pitch, size_t host_slice_pitch,
+                         const void *ptr, cl_uint num_events_in_wait_list,
+                         const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_1
+{
+    DPRINT("clEnqueueWriteBufferRect()\n");
+
+    if (!buffer) {
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    if (!(ptr && buffer_origin && host_origin)) {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_int ret = rectPitches(region, &buffer_row_pitch, &buffer_slice_pitch);
+    if (ret == CL_SUCCESS) {
+        ret = rectPitches(region, &host_row_pitch, &host_slice_pitch);
+    }
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
+
+    size_t extent;
+    if (!rectExtent(buffer_origin, region, buffer_row_pitch,
+                    buffer_slice_pitch, &extent) ||
+        beyondBuffer(buffer, 0, extent)) {
+        return CL_INVALID_VALUE;
     }
 
-    kernel->addArg(arg_index + DEFAULT_OCL_KERN_ARGS, arg_size, arg_value);
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+       (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
 
-    return CL_SUCCESS;
-}
+    if (event) {
+        *event = new _cl_event();
+    }
 
-extern CL_API_ENTRY cl_int CL_API_CALL
-clEnqueueUnmapMemObject(cl_command_queue, cl_mem, void*, cl_uint,
-                        const cl_event*, cl_event*)
-CL_API_SUFFIX__VERSION_1_0
-{
-    DPRINT("clEnqueueUnmapMemObject()\n");
-    clWarn("clEnqueueUnmapMemObject unimplemented\n");
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    clFinish(command_queue);
+    copyRect((char*)buffer, buffer_origin, buffer_row_pitch,
+             buffer_slice_pitch, (const char*)ptr, host_origin,
+             host_row_pitch, host_slice_pitch, region);
+
+    if (event) {
+        (*event)->done = true;
+    }
 
     return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-clEnqueueNDRangeKernel(cl_command_queue command_queue, cl_kernel kernel,
-                       cl_uint work_dim, const size_t *global_work_offset,
-                       const size_t *global_work_size,
-                       const size_t *local_work_size,
-                       cl_uint num_events_in_wait_list,
-                       const cl_event *event_wait_list, cl_event *event)
-CL_API_SUFFIX__VERSION_1_0
+clEnqueueCopyBufferRect(cl_command_queue command_queue, cl_mem src_buffer,
+                        cl_mem dst_buffer, const size_t *src_origin,
+                        const size_t *dst_origin, const size_t *region,
+                        size_t src_row_pitch, size_t src_slice_pitch,
+                        size_t dst_row_pitch, size_t dst_slice_pitch,
+                        cl_uint num_events_in_wait_list,
+                        const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_1
 {
-    DPRINT("clEnqueueNDRangeKernel()\n");
-    HsaQueueEntry *hsa_task = (HsaQueueEntry*)malloc(sizeof(HsaQueueEntry));
-    HostState *host_state = (HostState*)malloc(sizeof(HostState));
+    DPRINT("clEnqueueCopyBufferRect()\n");
 
-    // the current version of the compiler adds 6 implicit arguments to an
-    // OpenCL kernel
-    if (!global_work_offset) {
-        kernel->addOCLKernelOffsetArgs(0, 0);
-        kernel->addOCLKernelOffsetArgs(1, 0);
-        kernel->addOCLKernelOffsetArgs(2, 0);
-    } else {
-        kernel->addOCLKernelOffsetArgs(0, &global_work_offset[0]);
-        kernel->addOCLKernelOffsetArgs(1, &global_work_offset[1]);
-        kernel->addOCLKernelOffsetArgs(2, &global_work_offset[2]);
+    if (!(src_buffer && dst_buffer)) {
+        return CL_INVALID_MEM_OBJECT;
     }
 
-    kernel->addOCLKernelOffsetArgs(3, 0);
-    kernel->addOCLKernelOffsetArgs(4, 0);
-    kernel->addOCLKernelOffsetArgs(5, 0);
+    if (!(src_origin && dst_origin)) {
+        return CL_INVALID_VALUE;
+    }
 
-    if (event) {
-#if 1
-        *event = hsa_signal_create();
-#else
-        *event = new _cl_event();
-#endif
+    cl_int ret = rectPitches(region, &src_row_pitch, &src_slice_pitch);
+    if (ret == CL_SUCCESS) {
+        ret = rectPitches(region, &dst_row_pitch, &dst_slice_pitch);
+    }
+    if (ret != CL_SUCCESS) {
+        return ret;
     }
 
-    hsa_task->depends = (uint64_t)host_state;
-    host_state->event = event ? (uint64_t)(*event) : 0;
+    size_t src_end, dst_end;
 
-    if (work_dim < 1 || work_dim > 3) {
-        return CL_INVALID_WORK_DIMENSION;
+    if (!rectExtent(src_origin, region, src_row_pitch, src_slice_pitch,
+                    &src_end) ||
+        !rectExtent(dst_origin, region, dst_row_pitch, dst_slice_pitch,
+                    &dst_end) ||
+        beyondBuffer(src_buffer, 0, src_end) ||
+        beyondBuffer(dst_buffer, 0, dst_end)) {
+        return CL_INVALID_VALUE;
     }
 
-    for (cl_uint i = 0; i < work_dim; ++i) {
-        hsa_task->gdSize[i] = global_work_size[i];
-        if (local_work_size) {
-            hsa_task->wgSize[i] = (local_work_size[i] > global_work_size[i]) ?
-                                   global_work_size[i] : local_work_size[i];
-        } else {
-            hsa_task->wgSize[i] = global_work_size[i] > 256 ?
-                256 : global_work_size[i];
-            // only set 1 dimension automatically
-            for (++i; i < work_dim; ++i)
-                hsa_task->wgSize[i] = 1;
-            break;
-        }
+    const char *src_lo = (const char*)src_buffer + src_origin[2] *
+        src_slice_pitch + src_origin[1] * src_row_pitch + src_origin[0];
+    const char *dst_lo = (const char*)dst_buffer + dst_origin[2] *
+        dst_slice_pitch + dst_origin[1] * dst_row_pitch + dst_origin[0];
+
+    if (src_buffer == dst_buffer && src_row_pitch != dst_row_pitch &&
+        src_slice_pitch != dst_slice_pitch) {
+        return CL_INVALID_VALUE;
     }
-    for (cl_uint i = work_dim; i < 3; ++i) {
-        hsa_task->gdSize[i] = 1;
-        hsa_task->wgSize[i] = 1;
+
+    if (src_buffer == dst_buffer && src_row_pitch == dst_row_pitch &&
+        src_slice_pitch == dst_slice_pitch) {
+        if (rectsOverlap(src_origin, dst_origin, region, src_row_pitch,
+                         src_slice_pitch)) {
+            return CL_MEM_COPY_OVERLAP;
+        }
+    } else if (src_lo < (const char*)dst_buffer + dst_end &&
+               dst_lo < (const char*)src_buffer + src_end) {
+        // sub-buffers of one buffer share its memory; reject regions
+        // whose spans overlap there
+        return CL_MEM_COPY_OVERLAP;
     }
 
-    // allocate space for WF context
-    int numWgTotal = 1;
-    int wfPerWgTotal = 1;
-    for (int i = 0; i < 3; ++i) {
-        numWgTotal *= divCeil(hsa_task->gdSize[i], hsa_task->wgSize[i]);
-        wfPerWgTotal *= (hsa_task->wgSize[i] + VecSize - 1) / VecSize;
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+       (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
     }
-    int numCtx = numWgTotal * wfPerWgTotal;
 
-    //////////////////////////////////////
-    hsa_task->code_ptr = (uint64_t)kernel->code;
-    DPRINT("launching %s\n", kernel->name);
+    if (event) {
+        *event = new _cl_event();
+    }
 
-    // setup arguments
-    hsa_task->num_args = kernel->maxArgIdx + 1;
-    int offset = 0;
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    clFinish(command_queue);
+    copyRect((char*)dst_buffer, dst_origin, dst_row_pitch, dst_slice_pitch,
+             (const char*)src_buffer, src_origin, src_row_pitch,
+             src_slice_pitch, region);
 
-    for (cl_uint i = 0; i <= kernel->maxArgIdx; i++) {
-        // copy argument to argument buffer in allocated HSA queue entry
-        DPRINT("HSA runtime: Offset %d\n", offset);
-        hsa_task->offsets[i] = offset;
-        if (kernel->argList[i].contents) {
-            memcpy(hsa_task->args + offset, kernel->argList[i].contents,
-                   kernel->argList[i].size);
-        } else {
-            // argument is __local pointer, i.e., LDS offset
-            // must use groupMemOffset instead of contents
-            *(uint64_t*)(hsa_task->args + offset) =
-            (uint64_t)(kernel->argList[i].groupMemOffset);
-        }
+    if (event) {
+        (*event)->done = true;
+    }
 
-        offset += kernel->argList[i].size;
+    return CL_SUCCESS;
+}
 
-        if (i != kernel->maxArgIdx) {
-            int pad = offset % kernel->argList[i + 1].size;
-            pad = !pad ? 0 : kernel->argList[i + 1].size - pad;
-            offset += pad;
-        }
+// Validate an image region and resolve the default host pitches.
+static cl_int
+imageRegion(cl_mem image, const size_t *origin, const size_t *region,
+            size_t *row_pitch, size_t *slice_pitch)
+{
+    if (!imageTracker.get(image)) {
+        return CL_INVALID_MEM_OBJECT;
     }
 
-    // Point the dispatcher to counter variable (tracking # of dispatches)
-    // polled by runtime
-    hsa_task->numDispLeft = (uint64_t)command_queue->numDispLeft;
+    const cl_image_layout_hsa *img = (const cl_image_layout_hsa*)image;
 
-    hsa_task->sRegCount = kernel->sRegCount;
-    hsa_task->dRegCount = kernel->dRegCount;
-    hsa_task->cRegCount = kernel->cRegCount;
+    if (!origin || !region || !region[0] || !region[1] || !region[2] ||
+        !hsaInBounds(origin[0], region[0], img->width) ||
+        !hsaInBounds(origin[1], region[1], img->height) ||
+        !hsaInBounds(origin[2], region[2], img->depth)) {
+        return CL_INVALID_VALUE;
+    }
 
-    DPRINT("regs: s %d d %d c %d\n", hsa_task->sRegCount,
-           hsa_task->dRegCount, hsa_task->cRegCount);
+    if (*row_pitch == 0) {
+        *row_pitch = region[0] * img->element_size;
+    } else if (*row_pitch < region[0] * img->element_size) {
+        return CL_INVALID_VALUE;
+    }
 
-    // Allocate private memory for the kernel, the gdSize already
-    // accounts for all the blocks
-    int numWorkItems = hsa_task->gdSize[0] *
-                       hsa_task->gdSize[1] *
-                       hsa_task->gdSize[2];
-    numWorkItems = numWorkItems % VecSize ? numWorkItems + VecSize -
-            (numWorkItems % VecSize) : numWorkItems;
+    // a slice of host rows must not wrap
+    if (*row_pitch > SIZE_MAX / region[1]) {
+        return CL_INVALID_VALUE;
+    }
 
-    hsa_task ->privMemPerItem = kernel->privateMemSize;
-    hsa_task ->spillMemPerItem = kernel->spillMemSize;
+    if (*slice_pitch == 0) {
+        *slice_pitch = *row_pitch * region[1];
+    } else if (*slice_pitch < *row_pitch * region[1]) {
+        return CL_INVALID_VALUE;
+    }
 
-    // Total of privMem and spillMem should be calculated with
-    // Total number of wavefronts must be:
-    // (Wavefronts * WavefrontSize)* privMemPerItem/spillMemPerItem.
-    hsa_task->privMemTotal = (kernel->privateMemSize * numWorkItems);
-    hsa_task->spillMemTotal = (kernel->spillMemSize * numWorkItems);
+    return CL_SUCCESS;
+}
 
-    // FIXME: There is a mismatch regarding the allcation and use of both
-    // privateMemory and spliiMemory. On this (HSA_runtime), the total memory
-    // for each buufer (spill or priv) is calucalted by muptiplying
-    // total_number of workitems with spill/priv size per workitem.
-    // On hsail GPU side, the accesses to spill/priv memory assumes
-    // there is (VSZ * spill/priv per workitem) for each wavefront.
-    // This becomes a problem when the (total workitems less than number
-    // of wavefronts * VSZ). The multiplication by 8 below is a hack.
-    // should be fixed. The multiply with 8 (below) is to make the allocated
-    // memory for spill buffer large enough. Multipying with 64 would be
-    // the most conservative approach.
-    hsa_task->spillMemTotal = hsa_task->spillMemTotal * 8;
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueReadImage(cl_command_queue command_queue, cl_mem image,
+                   cl_bool blocking_read, const size_t *origin,
+                   const size_t *region, size_t row_pitch,
+                   size_t slice_pitch, void *ptr,
+                   cl_uint num_events_in_wait_list,
+                   const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_0
+{
+    DPRINT("clEnqueueReadImage()\n");
 
-    hsa_task->privMemStart = hsa_task->privMemTotal > 0 ?
-        (uint64_t)malloc(hsa_task->privMemTotal) : 0;
-    DPRINT("hsa_task->privMemTotal=%d\n", hsa_task->privMemTotal);
-    DPRINT("hsa_task->privMemStart=%p\n", (void*)hsa_task->privMemStart);
+    if (!ptr) {
+        return CL_INVALID_VALUE;
+    }
 
-    hsa_task->spillMemStart = hsa_task->spillMemTotal > 0 ?
-        (uint64_t)malloc(hsa_task->spillMemTotal) : 0;
-    DPRINT("hsa_task->spillMemTotal=%d\n", hsa_task->spillMemTotal);
-    DPRINT("hsa_task->spillMemStart=%p\n", (void*)hsa_task->spillMemStart);
+    cl_int ret = imageRegion(image, origin, region, &row_pitch,
+                             &slice_pitch);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
 
-    hsa_task->roMemTotal = hsaDriverSizes.readonly_size;
-    hsa_task->roMemStart = (uint64_t)hsaReadonly;
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+        (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
 
-    // initialize read-only memory
+    if (event) {
+        *event = new _cl_event();
+    }
 
-    // LDS storage will be allocated by CU
-    hsa_task->ldsSize = kernel->groupMemSize;
-    DPRINT("hsa_task->ldsSize=%d\n", hsa_task->ldsSize);
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    clFinish(command_queue);
+    transferImage((const cl_image_layout_hsa*)image, origin, region,
+                  (char*)ptr, row_pitch, slice_pitch, false);
 
-    // Point the dispatcher to done variables polled by runtime
     if (event) {
-        hsa_task->addrToNotify = (uint64_t)&((*event)->done);
-        (*event)->hsaTaskPtr = hsa_task;
-    } else {
-        hsa_task->addrToNotify = 0;
-        hsa_task->depends = 0;
+        (*event)->done = true;
     }
-    memcpy(hsaTaskPtr, hsa_task, sizeof(HsaQueueEntry));
-
-    // notify the dispatch engine that the task params are complete
-    *dispatcherDoorbell = 0;
 
     return CL_SUCCESS;
 }
 
-extern CL_API_ENTRY cl_int CL_API_CALL
-clGetKernelWorkGroupInfo(cl_kernel kernel, cl_device_id device,
-                         cl_kernel_work_group_info param_name,
-                         size_t param_value_size, void *param_value,
-                         size_t *param_value_size_ret)
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueWriteImage(cl_command_queue command_queue, cl_mem image,
+                    cl_bool blocking_write, const size_t *origin,
+                    const size_t *region, size_t input_row_pitch,
+                    size_t input_slice_pitch, const void *ptr,
+                    cl_uint num_events_in_wait_list,
+                    const cl_event *event_wait_list, cl_event *event)
 CL_API_SUFFIX__VERSION_1_0
 {
-    DPRINT("clGetKernelWorkGroupInfo()\n");
+    DPRINT("clEnqueueWriteImage()\n");
 
-    switch (param_name) {
-      case CL_KERNEL_WORK_GROUP_SIZE:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(size_t);
-        }
+    if (!ptr) {
+        return CL_INVALID_VALUE;
+    }
 
-        if (param_value) {
-            if (param_value_size >= sizeof(size_t)) {
-                *((size_t*)(param_value)) = MAX_WG_SIZE;
-            } else {
-                return CL_INVALID_VALUE;
-            }
-        }
-        break;
-      case CL_KERNEL_COMPILE_WORK_GROUP_SIZE:
-        if(param_value_size_ret) {
-            *param_value_size_ret = sizeof(size_t) * 3;
-        }
+    cl_int ret = imageRegion(image, origin, region, &input_row_pitch,
+                             &input_slice_pitch);
+    if (ret != CL_SUCCESS) {
+        return ret;
+    }
 
-        if (param_value) {
-            if (param_value_size >= sizeof(size_t) * 3) {
-                size_t *dest = (size_t*)param_value;
-                dest[0] = 0;
-                dest[1] = 0;
-                dest[2] = 0;
-            } else {
-                return CL_INVALID_VALUE;
-            }
-        }
-        break;
-      case CL_KERNEL_LOCAL_MEM_SIZE:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_ulong);
-        }
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+       (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_ulong)) {
-                *((cl_ulong*)(param_value)) = MAX_LDS_SIZE;
-            } else {
-                return CL_INVALID_VALUE;
-            }
-        }
-        break;
-      default:
+    if (event) {
+        *event = new _cl_event();
+    }
+
+    // kernels already enqueued may still be reading the image
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    clFinish(command_queue);
+    transferImage((const cl_image_layout_hsa*)image, origin, region,
+                  (char*)ptr, input_row_pitch, input_slice_pitch, true);
+
+    if (event) {
+        (*event)->done = true;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueFillBuffer(cl_command_queue command_queue, cl_mem buffer,
+                    const void *pattern, size_t pattern_size, size_t offset,
+                    size_t size, cl_uint num_events_in_wait_list,
+                    const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clEnqueueFillBuffer()\n");
+
+    if (!buffer) {
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    // the pattern must be a power of two no larger than a fill line, and
+    // the filled region must hold a whole number of patterns
+    if (!pattern || !pattern_size || pattern_size > FILL_LINE_SIZE ||
+        (pattern_size & (pattern_size - 1)) ||
+        offset % pattern_size || size % pattern_size) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (beyondBuffer(buffer, offset, size)) {
         return CL_INVALID_VALUE;
     }
 
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+       (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
+
+    if (event) {
+        *event = new _cl_event();
+    }
+
+    // the queue is in order, so earlier kernels must not see the new data
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    clFinish(command_queue);
+    fillPattern((char*)buffer + offset, pattern, pattern_size, size);
+
+    if (event) {
+        (*event)->done = true;
+    }
+
     return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-clWaitForEvents(cl_uint num_events, const cl_event *event_list)
-CL_API_SUFFIX__VERSION_1_0
+clEnqueueAdvanceFileWindowHSA(cl_command_queue command_queue, cl_mem buffer,
+                              size_t window_offset,
+                              cl_uint num_events_in_wait_list,
+                              const cl_event *event_wait_list,
+                              cl_event *event)
+CL_EXT_SUFFIX__VERSION_1_1
 {
-    DPRINT("clWaitForEvents()\n");
+    DPRINT("clEnqueueAdvanceFileWindowHSA()\n");
 
-    for (cl_uint i = 0; i < num_events; ++i) {
-        while (!event_list[i]->done) {
-            __builtin_ia32_monitor ((void *)&event_list[i]->done, 0, 0);
-#if 1
-            __builtin_ia32_mwait(0, 0);
-#else
-            asm("hlt");
-#endif
-        }
+    fileBufDesc desc;
+    size_t size = 0;
+    if (!fileBufTracker.get(buffer, &desc) || !desc.windowSize) {
+        return CL_INVALID_MEM_OBJECT;
     }
-    return CL_SUCCESS;
-}
 
-extern CL_API_ENTRY cl_int CL_API_CALL
-clGetEventInfo(cl_event event, cl_event_info param_name,
-               size_t param_value_size, void *param_value,
-               size_t *param_value_size_ret)
-CL_API_SUFFIX__VERSION_1_0
-{
-    DPRINT("clGetEventInfo()\n");
+    memSize.get(buffer, &size);
+    if (window_offset >= size) {
+        return CL_INVALID_VALUE;
+    }
 
-    switch (param_name) {
-      case CL_EVENT_COMMAND_QUEUE:
-        clFatal("CL_EVENT_COMMAND_QUEUE: clGetEventInfo not yet "
-                "implemented\n");
-        break;
-      case CL_EVENT_COMMAND_TYPE:
-        clFatal("CL_EVENT_COMMAND_TYPE: clGetEventInfo not yet "
-                "implemented\n");
-        break;
-      case CL_EVENT_COMMAND_EXECUTION_STATUS:
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(cl_int);
-        }
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+       (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
 
-        if (param_value) {
-            if (param_value_size >= sizeof(cl_int)) {
-                if(event->done) {
-                    *((cl_int*)(param_value)) = CL_COMPLETE;
-                } else {
-                    *((cl_int*)(param_value)) = CL_RUNNING;
-                }
-            } else {
-                return CL_INVALID_VALUE;
-            }
+    if (event) {
+        *event = new _cl_event();
+    }
+
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+
+    // Drop the pages behind the new window. They are clean or backed by
+    // the page cache, so a late access simply faults them back in.
+    if (window_offset > desc.windowOffset) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        char *drop_end =
+            (char*)((uintptr_t)((char*)buffer + window_offset) & ~(page - 1));
+        if (drop_end > (char*)desc.mapBase) {
+            madvise(desc.mapBase, drop_end - (char*)desc.mapBase,
+                    MADV_DONTNEED);
         }
-        break;
-      case CL_EVENT_REFERENCE_COUNT:
-        clFatal("CL_EVENT_REFERENCE_COUNT: clGetEventInfo not yet "
-                "implemented\n");
-        break;
-      default:
-        return CL_INVALID_VALUE;
+    }
+
+    desc.windowOffset = window_offset;
+    fileBufTracker.set(buffer, desc);
+    prefetchFileWindow(buffer, desc, window_offset,
+                       std::min(desc.windowSize, size - window_offset));
+
+    if (event) {
+        (*event)->done = true;
     }
 
     return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-clReleaseEvent(cl_event event)
-CL_API_SUFFIX__VERSION_1_0
+clEnqueueSVMFree(cl_command_queue command_queue, cl_uint num_svm_pointers,
+                 void *svm_pointers[],
+                 void (CL_CALLBACK *pfn_free_func)(cl_command_queue queue,
+                                                   cl_uint num_svm_pointers,
+                                                   void *svm_pointers[],
+                                                   void *user_data),
+                 void *user_data, cl_uint num_events_in_wait_list,
+                 const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_2
 {
-    DPRINT("clReleaseEvent()\n");
+    DPRINT("clEnqueueSVMFree()\n");
 
-    if (event->hsaTaskPtr) {
-        if (event->hsaTaskPtr->privMemStart) {
-            free((void*)(event->hsaTaskPtr->privMemStart));
-        }
-        if (event->hsaTaskPtr->spillMemStart) {
-            free((char*)(event->hsaTaskPtr->spillMemStart));
-        }
-        free(event->hsaTaskPtr);
+    if (!num_svm_pointers || !svm_pointers) {
+        return CL_INVALID_VALUE;
     }
-    delete event;
-    return CL_SUCCESS;
-}
 
-/* Profiling APIs */
-extern CL_API_ENTRY cl_int CL_API_CALL
-clGetEventProfilingInfo(cl_event event, cl_profiling_info param_name,
-                        size_t param_value_size, void *param_value,
-                        size_t *param_value_size_ret)
-CL_API_SUFFIX__VERSION_1_0
-{
-    DPRINT("clGetEventProfilingInfo()\n");
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+       (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
 
-    if (param_value_size_ret) {
-        *param_value_size_ret = 0;
+    if (event) {
+        *event = new _cl_event();
     }
 
-    switch (param_name) {
-      case CL_PROFILING_COMMAND_START:
-        assert(param_value_size >= sizeof(uint64_t));
-        *((uint64_t*)param_value) = event->start;
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(uint64_t);
-        }
-        break;
-      case CL_PROFILING_COMMAND_END:
-        assert(param_value_size >= sizeof(uint64_t));
-        *((uint64_t*)param_value) = event->end;
-        if (param_value_size_ret) {
-            *param_value_size_ret = sizeof(uint64_t);
+    // kernels earlier in the queue may still use the memory
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    clFinish(command_queue);
+
+    if (pfn_free_func) {
+        pfn_free_func(command_queue, num_svm_pointers, svm_pointers,
+                      user_data);
+    } else {
+        for (cl_uint i = 0; i < num_svm_pointers; ++i) {
+            clSVMFree(nullptr, svm_pointers[i]);
         }
-        break;
-      default:
-        return CL_INVALID_VALUE;
     }
-    return CL_SUCCESS;
-}
 
-/* Flush and Finish APIs */
-extern CL_API_ENTRY cl_int CL_API_CALL
-clFlush(cl_command_queue command_queue)
-CL_API_SUFFIX__VERSION_1_0
-{
-    DPRINT("clFlush()\n");
-    while (*(command_queue->numDispLeft) > 0);
-    // asm("hlt") does not work here because there
-    // is a race if the dispatcher called cpu->wakeup()
-    // when the CPU is awake and hlt is the next CPU instruction
-    // to be executed
-    return CL_SUCCESS;
-}
+    if (event) {
+        (*event)->done = true;
+    }
 
-CL_API_ENTRY cl_int CL_API_CALL
-clFinish(cl_command_queue  command_queue) CL_API_SUFFIX__VERSION_1_0
-{
-    DPRINT("clFinish()\n");
-    while (*(command_queue->numDispLeft) > 0);
-    // asm("hlt") does not work here because there
-    // is a race if the dispatcher called cpu->wakeup()
-    // when the CPU is awake and hlt is the next CPU instruction
-    // to be executed
     return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-clEnqueueReadBuffer(cl_command_queue command_queue, cl_mem buffer,
-                    cl_bool blocking_read, size_t offset, size_t size,
-                    void *ptr, cl_uint num_events_in_wait_list,
-                    const cl_event *event_wait_list, cl_event *event)
-CL_API_SUFFIX__VERSION_1_0
+clEnqueueSVMMemcpy(cl_command_queue command_queue, cl_bool blocking_copy,
+                   void *dst_ptr, const void *src_ptr, size_t size,
+                   cl_uint num_events_in_wait_list,
+                   const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_2
 {
-    DPRINT("clEnqueueReadBuffer()\n");
-    // make sure buffer and ptr are not nullptr pointers
-    if (!(buffer && ptr)) {
+    DPRINT("clEnqueueSVMMemcpy()\n");
+
+    if (!(dst_ptr && src_ptr)) {
         return CL_INVALID_VALUE;
     }
 
-    if (event) {
-        *event = new _cl_event();
+    if ((const char*)src_ptr < (char*)dst_ptr + size &&
+        (char*)dst_ptr < (const char*)src_ptr + size) {
+        return CL_MEM_COPY_OVERLAP;
     }
 
     if ((!event_wait_list && num_events_in_wait_list > 0) ||
-        (event_wait_list && !num_events_in_wait_list)) {
+       (event_wait_list && !num_events_in_wait_list)) {
         return CL_INVALID_EVENT_WAIT_LIST;
     }
 
+    if (event) {
+        *event = new _cl_event();
+    }
+
     clWaitForEvents(num_events_in_wait_list, event_wait_list);
     clFinish(command_queue);
-    if ((void*)buffer != ptr) {
-        memcpy(ptr, (char*)buffer+offset, size);
-    }
+    memcpy(dst_ptr, src_ptr, size);
 
     if (event) {
         (*event)->done = true;
     }
+
     return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-clEnqueueWriteBuffer(cl_command_queue command_queue, cl_mem buffer,
-                     cl_bool blocking_write, size_t offset, size_t size,
-                     const void *ptr, cl_uint num_events_in_wait_list,
-                     const cl_event *event_wait_list, cl_event *event)
-CL_API_SUFFIX__VERSION_1_0
+clEnqueueSVMMemFill(cl_command_queue command_queue, void *svm_ptr,
+                    const void *pattern, size_t pattern_size, size_t size,
+                    cl_uint num_events_in_wait_list,
+                    const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_2
 {
-    DPRINT("clEnqueueWriteBuffer()\n");
+    DPRINT("clEnqueueSVMMemFill()\n");
 
-    if (!(buffer && ptr)) {
+    if (!svm_ptr || !pattern_size || (uintptr_t)svm_ptr % pattern_size) {
         return CL_INVALID_VALUE;
     }
 
-    if (event) {
-        *event = new _cl_event();
+    return clEnqueueFillBuffer(command_queue, (cl_mem)svm_ptr, pattern,
+                               pattern_size, 0, size,
+                               num_events_in_wait_list, event_wait_list,
+                               event);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueSVMMap(cl_command_queue command_queue, cl_bool blocking_map,
+                cl_map_flags flags, void *svm_ptr, size_t size,
+                cl_uint num_events_in_wait_list,
+                const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clEnqueueSVMMap()\n");
+
+    if (!svm_ptr || !size) {
+        return CL_INVALID_VALUE;
     }
 
     if ((!event_wait_list && num_events_in_wait_list > 0) ||
@@ -1566,11 +5905,15 @@ CL_API_SUFFIX__VERSION_1_0
         return CL_INVALID_EVENT_WAIT_LIST;
     }
 
-    clWaitForEvents(num_events_in_wait_list, event_wait_list);
-    if ((void*)buffer != ptr) {
-        memcpy((char *)buffer+offset, ptr, size);
+    if (event) {
+        *event = new _cl_event();
     }
 
+    // the host already sees the memory; mapping only has to wait for the
+    // device to be done with it
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+    clFinish(command_queue);
+
     if (event) {
         (*event)->done = true;
     }
@@ -1579,35 +5922,80 @@ CL_API_SUFFIX__VERSION_1_0
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-clEnqueueCopyBuffer(cl_command_queue command_queue, cl_mem src_buffer,
-                    cl_mem dst_buffer, size_t src_offset, size_t dst_offset,
-                    size_t size, cl_uint num_events_in_wait_list,
-                    const cl_event *event_wait_list, cl_event *event)
-CL_API_SUFFIX__VERSION_1_0
+clEnqueueSVMUnmap(cl_command_queue command_queue, void *svm_ptr,
+                  cl_uint num_events_in_wait_list,
+                  const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_2
 {
-    DPRINT("clEnqueueCopyBuffer()\n");
+    DPRINT("clEnqueueSVMUnmap()\n");
 
-    if (!src_buffer) {
+    if (!svm_ptr) {
         return CL_INVALID_VALUE;
     }
 
-    if (!dst_buffer) {
-        return CL_INVALID_VALUE;
+    if ((!event_wait_list && num_events_in_wait_list > 0) ||
+       (event_wait_list && !num_events_in_wait_list)) {
+        return CL_INVALID_EVENT_WAIT_LIST;
     }
 
     if (event) {
         *event = new _cl_event();
     }
 
+    clWaitForEvents(num_events_in_wait_list, event_wait_list);
+
+    if (event) {
+        (*event)->done = true;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueMigrateMemObjects(cl_command_queue command_queue,
+                           cl_uint num_mem_objects,
+                           const cl_mem *mem_objects,
+                           cl_mem_migration_flags flags,
+                           cl_uint num_events_in_wait_list,
+                           const cl_event *event_wait_list, cl_event *event)
+CL_API_SUFFIX__VERSION_1_2
+{
+    DPRINT("clEnqueueMigrateMemObjects()\n");
+
+    if (!num_mem_objects || !mem_objects ||
+        (flags & ~(CL_MIGRATE_MEM_OBJECT_HOST |
+                   CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED))) {
+        return CL_INVALID_VALUE;
+    }
+
+    for (cl_uint i = 0; i < num_mem_objects; ++i) {
+        size_t size;
+        if (!bufferExtent(mem_objects[i], &size)) {
+            return CL_INVALID_MEM_OBJECT;
+        }
+    }
+
     if ((!event_wait_list && num_events_in_wait_list > 0) ||
        (event_wait_list && !num_events_in_wait_list)) {
         return CL_INVALID_EVENT_WAIT_LIST;
     }
 
+    if (event) {
+        *event = new _cl_event();
+    }
+
     clWaitForEvents(num_events_in_wait_list, event_wait_list);
 
-    if (((char*)(dst_buffer)+dst_offset) != (char*)(src_buffer)) {
-        memcpy(((char*)(dst_buffer)+dst_offset), (char*)src_buffer, size);
+    // Host and device share memory, so there is nothing to move; migrating
+    // to the device means making the pages resident before it touches them.
+    if (!(flags & CL_MIGRATE_MEM_OBJECT_HOST)) {
+        bool lock =
+            command_queue->properties & CL_QUEUE_PREFAULT_MLOCK_HSA;
+        for (cl_uint i = 0; i < num_mem_objects; ++i) {
+            size_t size;
+            bufferExtent(mem_objects[i], &size);
+            prefaultRange(mem_objects[i], size, lock, command_queue);
+        }
     }
 
     if (event) {
@@ -1658,12 +6046,21 @@ CL_API_ENTRY cl_int CL_API_CALL
 clReleaseKernel(cl_kernel kernel) CL_API_SUFFIX__VERSION_1_0
 {
     DPRINT("clReleaseKernel()\n");
-    cl_int refcnt = refkernel[kernel];
-
-    if (!refcnt)
+    if (dropRef(refkernel, kernel)) {
+       // the kernel frees every thread's clone; forget the calling
+       // thread's, the other threads never look this ID up again
+       threadArgs.kernels.erase(kernel->ID);
+       cl_program program = kernel->program;
+       if (program) {
+           program->removeFunction(kernel);
+       }
        delete kernel;
-    else if (refcnt > 0)
-       refkernel[kernel]--;
+
+       // drop the reference the kernel took at creation
+       if (program) {
+           clReleaseProgram(program);
+       }
+    }
 
     return CL_SUCCESS;
 }
@@ -1672,12 +6069,14 @@ CL_API_ENTRY cl_int CL_API_CALL
 clReleaseProgram(cl_program program) CL_API_SUFFIX__VERSION_1_0
 {
     DPRINT("clReleaseProgram()\n");
-    cl_int refcnt = refprogram[program];
-
-    if (!refcnt)
+    // every kernel holds a reference, so none is left once this is the
+    // last one
+    if (dropRef(refprogram, program)) {
+        if (program->binary) {
+            hsaReleaseProgramBinary(program->binary);
+        }
         delete program;
-    else if (refcnt > 0)
-        refprogram[program]--;
+    }
 
     return CL_SUCCESS;
 }
@@ -1686,8 +6085,40 @@ CL_API_ENTRY cl_int CL_API_CALL
 clReleaseMemObject(cl_mem memobj) CL_API_SUFFIX__VERSION_1_0
 {
     DPRINT("clReleaseMemObject()\n");
+    if (!dropRef(refmem, memobj)) {
+        return CL_SUCCESS;
+    }
+
+    if (imageTracker.erase(memobj)) {
+        cl_image_layout_hsa *img = (cl_image_layout_hsa*)memobj;
+        free((void*)img->data);
+        delete img;
+        return CL_SUCCESS;
+    }
+
+    size_t size;
+    if (lockedMem.erase(memobj, &size)) {
+        char *start;
+        size_t len;
+        pageSpan(memobj, size, &start, &len);
+        unlockPages(start, len);
+    }
+
+    // releasing a sub-buffer drops the reference it holds on its parent
+    subBufDesc sub_buf;
+    if (subBufTracker.erase(memobj, &sub_buf)) {
+        return clReleaseMemObject(sub_buf.parent);
+    }
+
+    fileBufDesc file_buf;
+    if (fileBufTracker.erase(memobj, &file_buf)) {
+        munmap(file_buf.mapBase, file_buf.mapSize);
+    }
 
-    if (memTracker.count(memobj)) {
+    // drop the size first so the address is never known to be live once
+    // it is back with the allocator
+    memSize.erase(memobj);
+    if (memTracker.erase(memobj)) {
         free(memobj);
     }
 
@@ -1699,12 +6130,21 @@ clReleaseCommandQueue(cl_command_queue command_queue)
 CL_API_SUFFIX__VERSION_1_0
 {
     DPRINT("clReleaseCommandQueue()\n");
-    cl_int refcnt = refcmdqueue[command_queue];
-
-    if (!refcnt)
+    if (dropRef(refcmdqueue, command_queue)) {
+        // the implicit flush; retired code may only be unmapped once the
+        // queue's dispatches have finished, and so may the scratch of
+        // event-less launches and the events of a co-execution queue
+        clFlush(command_queue);
+        if (!command_queue->scratch.empty() || command_queue->coLastGpu) {
+            clFinish(command_queue);
+        }
+        {
+            std::lock_guard<std::mutex> guard(hsaBinaryLock);
+            liveQueues.erase(command_queue);
+        }
         delete command_queue;
-    else if (refcnt > 0)
-        refcmdqueue[command_queue]--;
+        hsaReclaimBinaries();
+    }
 
     return CL_SUCCESS;
 }
@@ -1713,12 +6153,9 @@ CL_API_ENTRY cl_int CL_API_CALL
 clReleaseContext(cl_context context) CL_API_SUFFIX__VERSION_1_0
 {
     DPRINT("clReleaseContext()\n");
-    cl_int refcnt = refcontext[context];
-
-    if (!refcnt)
-         delete context;
-    else if (refcnt > 0)
-        refcontext[context]--;
+    if (dropRef(refcontext, context)) {
+        delete context;
+    }
 
     return CL_SUCCESS;
 }
@@ -1726,21 +6163,21 @@ clReleaseContext(cl_context context) CL_API_SUFFIX__VERSION_1_0
 CL_API_ENTRY cl_int CL_API_CALL
 clRetainContext(cl_context context) CL_API_SUFFIX__VERSION_1_0
 {
-    ++refcontext[context];
+    takeRef(refcontext, context);
     return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
 clRetainMemObject(cl_mem memobj) CL_API_SUFFIX__VERSION_1_0
 {
-    ++refmem[memobj];
+    takeRef(refmem, memobj);
     return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
 clRetainKernel(cl_kernel kernel) CL_API_SUFFIX__VERSION_1_0
 {
-    ++refkernel[kernel];
+    takeRef(refkernel, kernel);
     return CL_SUCCESS;
 }
 
@@ -1748,15 +6185,22 @@ CL_API_ENTRY cl_int CL_API_CALL
 clRetainCommandQueue(cl_command_queue command_queue)
 CL_API_SUFFIX__VERSION_1_0
 {
-      ++refcmdqueue[command_queue];
+      takeRef(refcmdqueue, command_queue);
       return CL_SUCCESS;
 
 }
 
+CL_API_ENTRY cl_int CL_API_CALL
+clRetainEvent(cl_event event) CL_API_SUFFIX__VERSION_1_0
+{
+    takeRef(refevent, event);
+    return CL_SUCCESS;
+}
+
 CL_API_ENTRY cl_int CL_API_CALL
 clRetainProgram(cl_program program) CL_API_SUFFIX__VERSION_1_0
 {
-      ++refprogram[program];
+      takeRef(refprogram, program);
       return CL_SUCCESS;
 
 }
@@ -43,13 +43,19 @@
 #endif
 
 #include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 #include "CL/cl_platform.h"
 #include "CL/cl.hpp"
 #include "cl_event.h"
 #include "cl_command_queue.h"
+#include "hsa_code_object.h"
 
 static const int MAX_WG_SIZE = 1024;
 
@@ -61,17 +67,40 @@ static const int MAX_WI_DIM2 = 64;
 // Assume a maximum LDS space of 64k
 static const int MAX_LDS_SIZE = 64 * 1024;
 
-// maximum number of kernels per OpenCL binary
-static const int MAX_FUNCTIONS_PER_BINARY = 32;
-static const int MAX_ARGS_FOR_KERNELS = 40;
-
-// Used in qstruct.h
-typedef uint64_t Addr;
+// Buffers are allocated cache block aligned, and sub-buffers must start
+// on a cache block too. In bytes.
+static const int MEM_BASE_ADDR_ALIGN = 64;
+
+// Per-CU resources a work-group has to fit in. Vector registers are
+// counted in 32-bit slots per lane; a d register takes two and condition
+// registers pack one bit per lane, 32 to a slot.
+static const int NUM_SIMDS_PER_CU = 4;
+static const int MAX_WFS_PER_SIMD = 10;
+static const int VREGS_PER_SIMD = 2048;
+
+// Image limits
+static const int MAX_IMAGE2D_DIM = 16384;
+static const int MAX_IMAGE3D_DIM = 2048;
+static const int MAX_READ_IMAGE_ARGS = 128;
+static const int MAX_WRITE_IMAGE_ARGS = 8;
+
+// Arguments a kernel can hold, and bytes of each argument value, before
+// its argument storage spills to the heap. Every scalar, pointer and
+// vector up to 128 bits stays inline.
+static const int ARG_INLINE_COUNT = 16;
+static const int ARG_INLINE_SIZE = 16;
 
 // general stuff
 void clWarn(const char *s);
 void clFatal(const char *s);
 
+// A code object loaded for a program. It is reference counted by the
+// program and every kernel instantiated from it, and unmapped once the
+// last reference is gone and no dispatch can still be running its code.
+struct HsaProgramBinary;
+void hsaRetainProgramBinary(HsaProgramBinary *binary);
+void hsaReleaseProgramBinary(HsaProgramBinary *binary);
+
 // opencl "built-in" types
 struct _cl_platform_id {
     cl_uint ID;
@@ -85,9 +114,12 @@ class _cl_device_id {
 
     ~_cl_device_id() { }
 
-    _cl_command_queue *addCQ()
+    _cl_command_queue *addCQ(cl_context context,
+                             cl_command_queue_properties properties)
     {
-        _cl_command_queue *CQ = new _cl_command_queue();
+        _cl_command_queue *CQ =
+            new _cl_command_queue(context, this, properties);
+        std::lock_guard<std::mutex> guard(cqLock);
         cqList.push_back(CQ);
         return CQ;
     }
@@ -96,139 +128,510 @@ class _cl_device_id {
     cl_device_type type;
 
   private:
+    std::mutex cqLock;
     std::vector<_cl_command_queue *> cqList;
     static cl_uint nextID;
 };
 
 struct source_desc
 {
-    char *str;
+    const char *str;
+    // length without the terminating NUL
     size_t len;
 };
 
-struct argDesc {
+// Storage for the program sources of a context. Text is copied into large
+// chunks that live as long as the arena, and identical strings are stored
+// once: creating a program from sources the context has already seen
+// costs a hash of each string and no allocation.
+class sourceArena {
+  public:
+    sourceArena() : chunkPtr(nullptr), chunkFree(0) { }
+
+    ~sourceArena()
+    {
+        for (size_t i = 0; i < chunks.size(); ++i)
+            free(chunks[i]);
+    }
+
+    sourceArena(const sourceArena&) = delete;
+    sourceArena &operator=(const sourceArena&) = delete;
+
+    // Return the stored copy of the len bytes at str, NUL terminated,
+    // adding it first if no identical text is stored yet.
+    const source_desc *intern(const char *str, size_t len)
+    {
+        uint64_t hash = hsaCodeObjectChecksum((const uint8_t*)str, len);
+        std::lock_guard<std::mutex> guard(lock);
+        auto range = index.equal_range(hash);
+
+        for (auto it = range.first; it != range.second; ++it) {
+            const source_desc &src = it->second;
+            if (src.len == len && !memcmp(src.str, str, len))
+                return &src;
+        }
+
+        char *copy = alloc(len + 1);
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+
+        // element addresses survive a rehash, so programs may keep them
+        source_desc src = { copy, len };
+        return &index.insert(std::make_pair(hash, src))->second;
+    }
+
+  private:
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    char *alloc(size_t bytes)
+    {
+        // a large source gets an allocation of its own rather than
+        // wasting the rest of the current chunk
+        if (bytes > CHUNK_SIZE / 4) {
+            char *big = (char*)malloc(bytes);
+            chunks.push_back(big);
+            return big;
+        }
+
+        if (bytes > chunkFree) {
+            chunkPtr = (char*)malloc(CHUNK_SIZE);
+            chunkFree = CHUNK_SIZE;
+            chunks.push_back(chunkPtr);
+        }
+
+        char *ptr = chunkPtr;
+        chunkPtr += bytes;
+        chunkFree -= bytes;
+        return ptr;
+    }
+
+    std::mutex lock;
+    std::vector<char*> chunks;
+    char *chunkPtr;
+    size_t chunkFree;
+    std::unordered_multimap<uint64_t, source_desc> index;
+};
+
+// A sub-buffer aliases its parent's storage; its cl_mem handle is the
+// parent's address plus the origin, so no allocation is ever made for it.
+struct subBufDesc {
+    cl_mem parent;
+    size_t origin;
     size_t size;
-    void *contents;
-    int groupMemOffset;
 };
 
-class _cl_kernel {
+// A file-backed buffer is a shared mapping of a file range. The cl_mem
+// handle points at the first requested byte, which may lie past the start
+// of the page-aligned mapping.
+struct fileBufDesc {
+    void *mapBase;
+    size_t mapSize;
+    size_t windowSize;
+    size_t windowOffset;
+};
+
+// Vector of trivially copyable elements with room for N of them inside
+// the object; it only allocates once it grows past N. New elements are
+// zeroed.
+template <typename T, unsigned N>
+class smallVector {
   public:
-    _cl_kernel(const char *_name, const void *_code, unsigned sregs,
-               unsigned dregs, unsigned cregs, unsigned privmem,
-               unsigned spillmem, unsigned static_lds_size) :
-        name(_name), code(_code), sRegCount(sregs), dRegCount(dregs),
-        cRegCount(cregs), privateMemSize(privmem), spillMemSize(spillmem),
-        groupMemSize(static_lds_size), maxArgIdx(0)
+    smallVector() : elems(inlineElems), count(0), capacity(N) { }
+
+    ~smallVector()
     {
-        memset(&argList, 0, sizeof(argList));
+        if (elems != inlineElems)
+            free(elems);
     }
 
-    ~_cl_kernel()
+    smallVector(const smallVector&) = delete;
+    smallVector &operator=(const smallVector&) = delete;
+
+    size_t size() const { return count; }
+    T &operator[](size_t i) { return elems[i]; }
+    const T &operator[](size_t i) const { return elems[i]; }
+
+    void resize(size_t n)
     {
-        for (int i = 0; i < MAX_ARGS_FOR_KERNELS; i++)
-            if (argList[i].contents)
-                free(argList[i].contents);
+        if (n > capacity) {
+            size_t new_capacity = std::max(n, 2 * capacity);
+            T *new_elems = (T*)malloc(sizeof(T) * new_capacity);
+            memcpy(new_elems, elems, sizeof(T) * count);
+            if (elems != inlineElems)
+                free(elems);
+            elems = new_elems;
+            capacity = new_capacity;
+        }
+
+        if (n > count)
+            memset(&elems[count], 0, sizeof(T) * (n - count));
+        count = n;
     }
 
-    void addArg(cl_uint arg_index, size_t arg_size, const void *arg_value)
+  private:
+    T *elems;
+    size_t count;
+    size_t capacity;
+    T inlineElems[N];
+};
+
+// Map from object handles to runtime metadata, split into independently
+// locked shards so that threads working on different objects rarely
+// contend. Every operation holds the lock of a single shard.
+template <typename K, typename V, unsigned N = 16>
+class shardedMap {
+  public:
+    // Add key unless it is already present. Returns whether it was added.
+    bool insert(const K &key, const V &value = V())
     {
-        assert(arg_index < MAX_ARGS_FOR_KERNELS);
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        return s.map.insert(std::make_pair(key, value)).second;
+    }
 
-        if (arg_value != nullptr) {
-            argList[arg_index].size = arg_size;
-            if (argList[arg_index].contents == nullptr) {
-                argList[arg_index].contents =
-                    (void*)malloc(argList[arg_index].size);
-            }
-            memcpy(argList[arg_index].contents, arg_value, arg_size);
-        } else {
-            argList[arg_index].size = sizeof(uint64_t);
-            // assume a null pointer value means it's group memory
-            // that needs to be dynamically allocated
-            argList[arg_index].contents = nullptr;
-            argList[arg_index].groupMemOffset = groupMemSize;
-            groupMemSize += (arg_size + 7) & ~7; // force 8 byte alignment
-        }
+    void set(const K &key, const V &value)
+    {
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.map[key] = value;
+    }
 
-        if (maxArgIdx < arg_index) {
-            maxArgIdx = arg_index;
-        }
+    // Returns whether key is present, copying its value to value if set.
+    bool get(const K &key, V *value = nullptr) const
+    {
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.map.find(key);
+        if (it == s.map.end())
+            return false;
+        if (value)
+            *value = it->second;
+        return true;
     }
 
-    void addOCLKernelOffsetArgs(cl_uint arg_index, const void *arg_value)
+    // Returns whether key was present, copying its value to value if set.
+    bool erase(const K &key, V *value = nullptr)
     {
-        assert(arg_index < MAX_ARGS_FOR_KERNELS);
-        argList[arg_index].size = sizeof(uint64_t);
-        argList[arg_index].contents = nullptr;
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.map.find(key);
+        if (it == s.map.end())
+            return false;
+        if (value)
+            *value = it->second;
+        s.map.erase(it);
+        return true;
+    }
 
-        if (arg_value) {
-            if (argList[arg_index].contents == nullptr) {
-                argList[arg_index].contents =
-                    (void*)malloc(argList[arg_index].size);
-            }
+    // Run f on the value of key, default constructed if key is absent,
+    // under the shard lock. The entry is removed if f returns false.
+    template <typename F>
+    void update(const K &key, F f)
+    {
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.map.insert(std::make_pair(key, V())).first;
+        if (!f(it->second))
+            s.map.erase(it);
+    }
 
-            memcpy(argList[arg_index].contents, arg_value,
-                   argList[arg_index].size);
-        }
+  private:
+    // a cache line each, so the locks of neighbouring shards do not
+    // share one
+    struct alignas(64) shard {
+        std::mutex lock;
+        std::map<K, V> map;
+    };
+
+    shard &shardOf(const K &key) const
+    {
+        // handles are heap addresses; mix the bits so their alignment
+        // does not leave most shards unused
+        uint64_t h = std::hash<K>()(key);
+        h ^= h >> 29;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 32;
+        return shards[h % N];
+    }
+
+    mutable shard shards[N];
+};
+
+template <typename K>
+using shardedSet = shardedMap<K, bool>;
 
-        if (maxArgIdx < arg_index) {
-            maxArgIdx = arg_index;
+struct argDesc {
+    size_t size;
+    int groupMemOffset;
+    // size of the group memory requested by a __local argument, 0 otherwise
+    size_t localSize;
+    // false for __local arguments and arguments never set
+    bool hasValue;
+    // values up to ARG_INLINE_SIZE bytes are stored in place
+    union {
+        uint8_t inlineValue[ARG_INLINE_SIZE];
+        void *heapValue;
+    };
+
+    const void *contents() const
+    {
+        if (!hasValue)
+            return nullptr;
+        return size <= ARG_INLINE_SIZE ? inlineValue : heapValue;
+    }
+
+    void setValue(const void *value, size_t value_size)
+    {
+        if (value_size <= ARG_INLINE_SIZE) {
+            clear();
+            memcpy(inlineValue, value, value_size);
+        } else {
+            // keep the old allocation if it has the right size
+            if (!hasValue || size != value_size) {
+                clear();
+                heapValue = malloc(value_size);
+            }
+            memcpy(heapValue, value, value_size);
         }
+
+        size = value_size;
+        hasValue = true;
+    }
+
+    void clear()
+    {
+        if (hasValue && size > ARG_INLINE_SIZE)
+            free(heapValue);
+        hasValue = false;
     }
+};
+
+// What a kernel expects in one argument slot.
+struct kernelArgMeta {
+    // bytes the argument occupies in the kernarg segment, 0 if unknown
+    size_t size;
+    size_t alignment;
+    cl_kernel_arg_address_qualifier addressQualifier;
+    bool isPointer;
+};
 
-    const char *name;
+// Description of a kernel in a code image. Every _cl_kernel instantiated
+// from the kernel shares it.
+struct kernelDesc {
+    std::string name;
     const void *code;
+    // code object holding the code, nullptr for the driver's kernels
+    HsaProgramBinary *binary;
+    // read-only data segment of the code object the kernel came from
+    const void *readonly;
+    unsigned int readonlySize;
 
     unsigned int privateMemSize;
     unsigned int spillMemSize;
-    unsigned int groupMemSize;
+    unsigned int staticLdsSize;
     unsigned int sRegCount; // Number of s registers
     unsigned int dRegCount; // Number of d registers
     unsigned int cRegCount; // Number of c registers
 
-    cl_uint maxArgIdx;
-    argDesc argList[MAX_ARGS_FOR_KERNELS];
+    // entry point of a native kernel for the CPU device, nullptr for the
+    // kernels of a code image
+    cl_native_kernel_fn_hsa nativeEntry;
+    cl_native_kernel_flags_hsa nativeFlags;
+
+    kernelDesc() : nativeEntry(nullptr), nativeFlags(0), argsCaptured(false)
+    { }
+
+    // Signature of the user arguments. The driver's kernel info does not
+    // describe arguments, so this is captured from the first launch of any
+    // instance and then used to validate clSetKernelArg. Only read once
+    // argsCaptured is set; argsLock serializes the capture.
+    std::vector<kernelArgMeta> args;
+    std::mutex argsLock;
+    std::atomic<bool> argsCaptured;
 };
 
-class _cl_program {
+class _cl_kernel {
   public:
-    _cl_program() : numFunctions(0)
+    _cl_kernel(kernelDesc *_desc) :
+        desc(_desc), name(_desc->name), ID(nextID++),
+        threadLocalArgs(false), groupMemSize(_desc->staticLdsSize),
+        program(nullptr)
     {
-        kernList =
-           (_cl_kernel**)malloc(sizeof(_cl_kernel*)*MAX_FUNCTIONS_PER_BINARY);
+        if (_desc->binary)
+            hsaRetainProgramBinary(_desc->binary);
     }
 
-    ~_cl_program()
+    // A clone shares the descriptor and starts with a private copy of the
+    // argument block.
+    _cl_kernel(const _cl_kernel &other) :
+        desc(other.desc.load()), name(other.name), ID(nextID++),
+        threadLocalArgs(false), groupMemSize(other.groupMemSize),
+        program(nullptr)
     {
-        /*free(kernList);
-        for(cl_uint i=0; i<numSrcStrings; i++) {
-            free(srcStrings[i]->str);
-            free(srcStrings[i]);
+        kernelDesc *d = desc;
+        if (d->binary)
+            hsaRetainProgramBinary(d->binary);
+
+        argList.resize(other.argList.size());
+
+        for (size_t i = 0; i < argList.size(); i++) {
+            argList[i] = other.argList[i];
+            if (other.argList[i].hasValue) {
+                argList[i].hasValue = false;
+                argList[i].setValue(other.argList[i].contents(),
+                                    other.argList[i].size);
+            }
         }
-        free(srcStrings);*/
     }
 
-    source_desc **srcStrings;
-    cl_uint numSrcStrings;
-    _cl_kernel **kernList;
+    ~_cl_kernel()
+    {
+        for (auto clone : clones)
+            delete clone;
 
-    cl_int addFunction(_cl_kernel *kernel)
+        for (size_t i = 0; i < argList.size(); i++)
+            argList[i].clear();
+
+        kernelDesc *d = desc;
+        if (d->binary)
+            hsaReleaseProgramBinary(d->binary);
+    }
+
+    // Switch to another build of the same kernel. The argument values are
+    // kept; the signature is captured again from the next launch. A launch
+    // on another thread sees either build, never a mix.
+    void setDesc(kernelDesc *_desc)
+    {
+        if (_desc->binary)
+            hsaRetainProgramBinary(_desc->binary);
+
+        kernelDesc *old_desc = desc.exchange(_desc);
+        if (old_desc->binary)
+            hsaReleaseProgramBinary(old_desc->binary);
+    }
+
+    void addArg(cl_uint arg_index, size_t arg_size, const void *arg_value)
+    {
+        if (arg_index >= argList.size()) {
+            argList.resize(arg_index + 1);
+        }
+
+        argDesc &arg = argList[arg_index];
+
+        if (arg_value != nullptr) {
+            arg.setValue(arg_value, arg_size);
+            arg.localSize = 0;
+        } else {
+            // assume a null pointer value means it's group memory
+            // that needs to be dynamically allocated; its offset is
+            // assigned by layoutGroupMem() at launch
+            arg.clear();
+            arg.size = sizeof(uint64_t);
+            arg.localSize = arg_size;
+        }
+    }
+
+    void addOCLKernelOffsetArgs(cl_uint arg_index, const void *arg_value)
+    {
+        static const uint64_t zero = 0;
+
+        if (arg_index >= argList.size()) {
+            argList.resize(arg_index + 1);
+        }
+
+        argList[arg_index].setValue(arg_value ? arg_value : &zero,
+                                    sizeof(uint64_t));
+        argList[arg_index].localSize = 0;
+    }
+
+    // Place the dynamically sized __local arguments after the kernel's
+    // static group memory, in argument order, and return the total group
+    // memory a work-group of this launch needs.
+    unsigned int layoutGroupMem()
     {
-        if (numFunctions == MAX_FUNCTIONS_PER_BINARY) {
-            printf("Unable to register function %s (increase "
-                   "MAX_FUNCTIONS_PER_BINARY)\n", kernel->name);
-            return CL_OUT_OF_HOST_MEMORY;
+        return layoutGroupMem(desc.load()->staticLdsSize);
+    }
+
+    // The same after static_size bytes of static group memory, for a
+    // launch of another implementation of the kernel.
+    unsigned int layoutGroupMem(unsigned int static_size)
+    {
+        unsigned int offset = static_size;
+
+        for (size_t i = 0; i < argList.size(); i++) {
+            if (argList[i].localSize) {
+                offset = (offset + 7) & ~7; // force 8 byte alignment
+                argList[i].groupMemOffset = offset;
+                offset += argList[i].localSize;
+            }
         }
 
-        kernList[numFunctions] = kernel;
-        numFunctions++;
+        groupMemSize = (offset + 7) & ~7;
+        return groupMemSize;
+    }
+
+    // switched by a program reload while other threads may launch, so
+    // read it once per operation
+    std::atomic<kernelDesc*> desc;
+    // the same for every build of the kernel
+    const std::string name;
+    // unique for the lifetime of the process, unlike the address
+    const uint64_t ID;
+    // each thread sets and launches with its own copy of the arguments
+    std::atomic<bool> threadLocalArgs;
+    // the thread-local copies, made by any thread and freed with the
+    // kernel; guarded by clonesLock
+    std::vector<_cl_kernel*> clones;
+    std::mutex clonesLock;
+
+    // static plus dynamic group memory of the most recent launch
+    unsigned int groupMemSize;
+    // program the kernel was created or cloned from and holds a reference
+    // on; nullptr for the thread-local copies
+    cl_program program;
+
+    smallVector<argDesc, ARG_INLINE_COUNT> argList;
+
+  private:
+    static std::atomic<uint64_t> nextID;
+};
+
+class _cl_program {
+  public:
+    _cl_program(cl_device_type device_type = CL_DEVICE_TYPE_GPU) :
+        binary(nullptr), deviceType(device_type)
+    {
+    }
+
+    // owned by the source arena of the context
+    std::vector<const source_desc*> srcStrings;
+    // guards kernList and the switch to a reloaded binary
+    std::mutex kernLock;
+    std::vector<_cl_kernel*> kernList;
+    // code object of a program created from a binary, nullptr if the
+    // program uses the kernels loaded from the driver
+    HsaProgramBinary *binary;
+    // type of the context's devices; a CPU program runs native kernels
+    const cl_device_type deviceType;
+
+    // The caller holds kernLock across looking the kernel up in the
+    // program's binary and adding it, so a reload cannot slip between.
+    cl_int addFunction(_cl_kernel *kernel)
+    {
+        kernList.push_back(kernel);
+        kernel->program = this;
 
         return CL_SUCCESS;
     }
 
+    void removeFunction(_cl_kernel *kernel)
+    {
+        std::lock_guard<std::mutex> guard(kernLock);
+        kernList.erase(std::remove(kernList.begin(), kernList.end(), kernel),
+                       kernList.end());
+    }
+
   private:
-    cl_uint numFunctions;
     char *symbolTable;
     int numAllocatedSymbols;
 };
@@ -261,37 +664,26 @@ class _cl_context {
                      const size_t *lengths, _cl_program **program)
     {
         if (count == 0 || strings == nullptr || *strings == nullptr) {
-            _cl_program *_program = new _cl_program();
+            _cl_program *_program = new _cl_program(deviceType);
             *program = _program;
             return CL_SUCCESS;
         }
 
-        _cl_program *_program = new _cl_program();
-        _program->srcStrings = (source_desc**)malloc(sizeof(source_desc*));
-        _program->numSrcStrings = count;
-
-        for (cl_uint i; i < count; i++) {
+        for (cl_uint i = 0; i < count; i++) {
             if (strings[i] == nullptr) {
+                *program = nullptr;
                 return CL_INVALID_VALUE;
             }
+        }
 
-            source_desc *cur_src = (source_desc *)malloc(sizeof(source_desc));
-
-            if (lengths == nullptr || lengths[i] == 0) {
-                size_t bytes = strlen(strings[i]) + 1;
-                cur_src->str = (char*)malloc(bytes);
-                cur_src->len = 0;
-                strcpy(cur_src->str, strings[i]);
-                cur_src->str[strlen(strings[i])] = '\0';
-            } else {
-                cur_src->str = (char *)malloc(lengths[i]+1);
-                cur_src->len = lengths[i];
-                memcpy(cur_src->str, strings[i], lengths[i]);
-                cur_src->str[lengths[i]] = '\0';
-            }
+        _cl_program *_program = new _cl_program(deviceType);
+        _program->srcStrings.resize(count);
 
-            sourceList.push_back(cur_src);
-            _program->srcStrings[i] = cur_src;
+        for (cl_uint i = 0; i < count; i++) {
+            size_t len = (lengths == nullptr || lengths[i] == 0) ?
+                         strlen(strings[i]) : lengths[i];
+
+            _program->srcStrings[i] = sources.intern(strings[i], len);
         }
 
         *program = _program;
@@ -323,7 +715,7 @@ class _cl_context {
     cl_uint numDevices;
     cl_device_type deviceType;
 
-    std::vector<source_desc *> sourceList;
+    sourceArena sources;
 };
 
 class platform {
@@ -332,6 +724,7 @@ class platform {
     {
         clID.ID = 0;
         gpuDevList.push_back(new _cl_device_id(CL_DEVICE_TYPE_GPU));
+        cpuDevList.push_back(new _cl_device_id(CL_DEVICE_TYPE_CPU));
     }
 
     _cl_platform_id *getID() { return &clID; }
@@ -356,19 +749,15 @@ class platform {
             return CL_DEVICE_NOT_AVAILABLE;
         }
 
-        contextList.push_back(*context);
+        std::lock_guard<std::mutex> guard(contextLock);
+        contextList.insert(*context);
         return CL_SUCCESS;
     }
 
     bool isContextValid(_cl_context *context)
     {
-        auto it = find (contextList.begin(), contextList.end(), context);
-
-        if (it == contextList.end()) {
-            return false;
-        }
-
-        return true;
+        std::lock_guard<std::mutex> guard(contextLock);
+        return contextList.count(context);
     }
 
     bool isValidDev(_cl_device_id *dev)
@@ -419,7 +808,9 @@ class platform {
     }
 
   private:
-    std::vector<_cl_context *> contextList;
+    std::mutex contextLock;
+    std::set<_cl_context *> contextList;
+    // fixed once the platform is constructed, so read without a lock
     std::vector<_cl_device_id *> gpuDevList;
     std::vector<_cl_device_id *> cpuDevList;
     _cl_platform_id clID;
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2011-2015 Advanced Micro Devices, Inc.
+ * All rights reserved.
+ *
+ * For use for simulation and test purposes only
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HSA_CODE_OBJECT_H_INCLUDED
+#define HSA_CODE_OBJECT_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+// On-disk image of everything the runtime pulls from the HSA driver: the
+// kernel table, the string table, the code and the read-only data. The code
+// and read-only sections start on page boundaries and are zero padded to a
+// whole page, so both can be mapped straight out of the file and shared by
+// every process that runs the same kernels.
+
+static const uint32_t HSA_CODE_OBJECT_MAGIC = 0x4f435348; // "HSCO"
+static const uint32_t HSA_CODE_OBJECT_VERSION = 3;
+static const uint32_t HSA_CODE_OBJECT_ALIGN = 4096;
+
+struct HsaCodeObjectHeader {
+    uint32_t magic;
+    uint32_t version;
+    // size of the whole image, header included
+    uint64_t size;
+    // checksum of every byte that follows the header
+    uint64_t checksum;
+
+    // HsaDriverSizes as reported by the driver
+    uint32_t numKernels;
+    uint32_t stringTableSize;
+    uint32_t codeSize;
+    uint32_t readonlySize;
+
+    uint32_t numCUs;
+    uint32_t vecSize;
+    // sizeof(HsaKernelInfo) of the writer, guards against layout changes
+    uint32_t kernelInfoSize;
+    uint32_t pad;
+    // identity of the driver and executable the image was captured from;
+    // a match lets the runtime start from the image without the driver
+    uint64_t driverFingerprint;
+    // hsaCodeObjectContentHash of the image
+    uint64_t contentHash;
+
+    // file offsets of the sections
+    uint64_t kernelInfoOffs;
+    uint64_t stringTableOffs;
+    uint64_t codeOffs;
+    uint64_t readonlyOffs;
+};
+
+inline uint64_t
+hsaCodeObjectAlign(uint64_t size)
+{
+    return (size + HSA_CODE_OBJECT_ALIGN - 1) &
+           ~(uint64_t)(HSA_CODE_OBJECT_ALIGN - 1);
+}
+
+// 64-bit FNV-1a; pass the hash of earlier data to continue it
+inline uint64_t
+hsaCodeObjectChecksum(const uint8_t *data, size_t size,
+                      uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Hash of the header, less the fields that do not describe the kernels,
+// and of the code and read-only sections. Images with the same hash run
+// the same code with the same device parameters.
+inline uint64_t
+hsaCodeObjectContentHash(const HsaCodeObjectHeader &hdr, const uint8_t *code,
+                         const uint8_t *readonly)
+{
+    HsaCodeObjectHeader key = hdr;
+    key.checksum = 0;
+    key.driverFingerprint = 0;
+    key.contentHash = 0;
+
+    uint64_t hash = hsaCodeObjectChecksum((const uint8_t*)&key, sizeof(key));
+    hash = hsaCodeObjectChecksum(code, hdr.codeSize, hash);
+
+    return hsaCodeObjectChecksum(readonly, hdr.readonlySize, hash);
+}
+
+#endif
@@ -25,10 +25,10 @@ VPATH = ..
 
 HSAIL_GPU ?= ../../gem5/src/gpu-compute
 GEM5_BASE ?= ../../gem5/src
-RUNTIME_SRCS = cl_runtime.cc
-HEADERS = cl_runtime.hh \
+RUNTIME_SRCS = cl_runtime.cc cl_cpu_device.cc
+HEADERS = cl_runtime.hh cl_cpu_device.h hsa_code_object.h \
 		$(HSAIL_GPU)/hsa_kernel_info.hh $(HSAIL_GPU)/qstruct.hh
-CFLAGS = -D BUILD_CL_RUNTIME -msse3
+CFLAGS = -D BUILD_CL_RUNTIME -msse3 -pthread
 
 ifeq ($(MODE), dbg)
     CFLAGS += -g -DDEBUG
@@ -37,7 +37,8 @@ else
 endif
 
 ifeq ($(BITS), 32)
-    CFLAGS += -m32
+    # off_t must hold the file offsets of file-backed buffers
+    CFLAGS += -m32 -D_FILE_OFFSET_BITS=64
 endif
 
 CXXFLAGS = $(CFLAGS) -std=c++11
@@ -51,7 +52,33 @@ RUNTIME_OBJS = $(RUNTIME_SRCS:.cc=.o)
 $(RUNTIME_OBJS): $(HEADERS)
 
 libOpenCL.a: $(RUNTIME_OBJS)
-	ar rc libOpenCL.a cl_runtime.o
+	ar rc libOpenCL.a $(RUNTIME_OBJS)
+
+# White-box tests of the runtime. Each includes cl_runtime.cc to reach its
+# internals and stands in for the dispatcher, so the tests run on the host
+# without the simulator.
+TESTS = ring_release_test bad_binary_test
+TEST_CXXFLAGS = $(CXXFLAGS) -g -fsanitize=address -fno-omit-frame-pointer
+
+.PHONY: tests
+tests: $(TESTS)
+	@for t in $(TESTS); do ./$$t || exit 1; done
+
+$(TESTS): %: tests/%.cc cl_runtime.cc cl_cpu_device.cc $(HEADERS)
+	$(CXX) $(TEST_CXXFLAGS) $(CPPFLAGS) -o $@ $< \
+		$(filter %cl_cpu_device.cc,$^)
+
+# Benchmarks are built the same way but with the library's flags, and are
+# not part of the tests goal.
+BENCHES = enqueue_stress_bench
+
+.PHONY: bench
+bench: $(BENCHES)
+	@for b in $(BENCHES); do ./$$b || exit 1; done
+
+$(BENCHES): %: tests/%.cc cl_runtime.cc cl_cpu_device.cc $(HEADERS)
+	$(CXX) $(CXXFLAGS) $(CPPFLAGS) -o $@ $< \
+		$(filter %cl_cpu_device.cc,$^)
 
 clean:
-	rm -f libOpenCL.a cl_runtime.o hsa_test
+	rm -f libOpenCL.a $(RUNTIME_OBJS) hsa_test $(TESTS) $(BENCHES)
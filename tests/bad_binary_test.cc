@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2011-2015 Advanced Micro Devices, Inc.
+ * All rights reserved.
+ *
+ * For use for simulation and test purposes only
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Feeds clCreateProgramWithBinary code objects whose checksum is valid but
+// whose kernel table or section offsets point outside the image, and
+// checks that each is rejected before anything is read through them. The
+// test includes the runtime and marks the driver state as loaded, so it
+// runs without the simulator.
+
+#include "../cl_runtime.cc"
+
+__attribute__((weak)) _cl_event *
+hsa_signal_create()
+{
+    return new _cl_event();
+}
+
+static const char KERNEL_SYM[] = "__OpenCL_bad_binary_kernel";
+static const uint32_t CODE_SIZE = 256;
+
+// Build a sealed image of one kernel, letting corrupt() change the header
+// or the kernel entry before the checksum is computed.
+template <typename F>
+static std::vector<uint8_t>
+buildImage(F corrupt)
+{
+    HsaDriverSizes sizes;
+    sizes.num_kernels = 1;
+    sizes.string_table_size = sizeof(KERNEL_SYM);
+    sizes.code_size = CODE_SIZE;
+    sizes.readonly_size = 0;
+
+    HsaCodeObjectHeader hdr;
+    hsaInitCodeObject(&hdr, sizes);
+
+    std::vector<uint8_t> image(hdr.size, 0);
+    HsaKernelInfo *kinfo = (HsaKernelInfo*)&image[hdr.kernelInfoOffs];
+    memcpy(&image[hdr.stringTableOffs], KERNEL_SYM, sizeof(KERNEL_SYM));
+
+    corrupt(&hdr, kinfo);
+    hsaSealCodeObject(image, &hdr);
+
+    return image;
+}
+
+static cl_int
+loadImage(cl_context context, cl_device_id device,
+          const std::vector<uint8_t> &image, cl_program *program)
+{
+    const unsigned char *binary = image.data();
+    size_t length = image.size();
+    cl_int status = CL_SUCCESS;
+    cl_int err;
+
+    *program = clCreateProgramWithBinary(context, 1, &device, &length,
+                                         &binary, &status, &err);
+
+    return err != CL_SUCCESS ? err : status;
+}
+
+int
+main()
+{
+    // the device parameters the driver would report
+    static const HsaKernelInfo no_kernels[1] = { };
+    hsaKernelInfo = no_kernels;
+    numCUs = 8;
+    VecSize = 64;
+
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_int err;
+
+    clGetPlatformIDs(1, &platform, nullptr);
+    clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, nullptr);
+    cl_context context = clCreateContext(nullptr, 1, &device, nullptr,
+                                         nullptr, &err);
+
+    struct {
+        const char *name;
+        std::vector<uint8_t> image;
+    } bad[] = {
+        { "kernel name past the string table",
+          buildImage([](HsaCodeObjectHeader *hdr, HsaKernelInfo *kinfo) {
+              kinfo->name_offs = hdr->stringTableSize;
+          }) },
+        { "kernel code past the code section",
+          buildImage([](HsaCodeObjectHeader *hdr, HsaKernelInfo *kinfo) {
+              kinfo->code_offs = 0x80000000;
+          }) },
+        { "kernel table wrapping around",
+          buildImage([](HsaCodeObjectHeader *hdr, HsaKernelInfo *kinfo) {
+              hdr->kernelInfoOffs = ~(uint64_t)0 - 8;
+          }) },
+        { "code section wrapping around",
+          buildImage([](HsaCodeObjectHeader *hdr, HsaKernelInfo *kinfo) {
+              hdr->codeSize = 0xfffff000;
+              hdr->codeOffs = ~(uint64_t)0 - 0xffff;
+          }) },
+    };
+
+    int failures = 0;
+
+    for (auto &test : bad) {
+        cl_program program;
+        cl_int ret = loadImage(context, device, test.image, &program);
+
+        if (ret != CL_INVALID_BINARY || program) {
+            printf("FAIL: %s: returned %d\n", test.name, ret);
+            ++failures;
+        }
+    }
+
+    // the same image with a sound kernel entry loads and finds its kernel
+    cl_program program;
+    cl_int ret = loadImage(context, device,
+                           buildImage([](HsaCodeObjectHeader *hdr,
+                                         HsaKernelInfo *kinfo) { }),
+                           &program);
+    cl_kernel kernel = ret == CL_SUCCESS ?
+        clCreateKernel(program, "bad_binary", &ret) : nullptr;
+
+    if (!kernel) {
+        printf("FAIL: valid image: returned %d\n", ret);
+        ++failures;
+    } else {
+        clReleaseKernel(kernel);
+        clReleaseProgram(program);
+    }
+
+    if (failures) {
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
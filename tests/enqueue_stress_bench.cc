@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2011-2015 Advanced Micro Devices, Inc.
+ * All rights reserved.
+ *
+ * For use for simulation and test purposes only
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Enqueue throughput from 1 to MAX_THREADS threads sharing one queue. Each
+// thread sets the two arguments of a kernel of its own and launches it,
+// so the numbers cover the argument path, the descriptor read guard and
+// the submission ring together. Like the tests, it includes the runtime
+// and redirects the dispatcher's mailbox to host memory; what it measures
+// is the runtime's side of a launch, not the simulated device.
+
+#include "../cl_runtime.cc"
+
+#include <chrono>
+
+// stands in for the simulator's signal allocator
+__attribute__((weak)) _cl_event *
+hsa_signal_create()
+{
+    return new _cl_event();
+}
+
+static const int MAX_THREADS = 8;
+static const int LAUNCHES_PER_THREAD = 200000;
+static const uint8_t KERNEL_CODE[256] = { 0 };
+
+static HsaQueueEntry mailbox;
+static volatile uint32_t doorbell;
+
+// Launch from num_threads threads at once. Returns launches per second.
+static double
+runThreads(cl_command_queue queue, kernelDesc *desc, int num_threads)
+{
+    std::vector<std::thread> threads;
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&] {
+            _cl_kernel kernel(desc);
+            size_t global = 4096;
+            size_t local = 64;
+            cl_uint n = 4096;
+            void *buf = nullptr;
+
+            ++ready;
+            while (!go) {
+                std::this_thread::yield();
+            }
+
+            for (int i = 0; i < LAUNCHES_PER_THREAD; ++i) {
+                clSetKernelArg(&kernel, 0, sizeof(buf), &buf);
+                clSetKernelArg(&kernel, 1, sizeof(n), &n);
+                clEnqueueNDRangeKernel(queue, &kernel, 1, nullptr, &global,
+                                       &local, 0, nullptr, nullptr);
+            }
+        });
+    }
+
+    while (ready != num_threads) {
+        std::this_thread::yield();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    clFinish(queue);
+    std::chrono::duration<double> secs =
+        std::chrono::steady_clock::now() - start;
+
+    return (double)num_threads * LAUNCHES_PER_THREAD / secs.count();
+}
+
+int
+main()
+{
+    hsaTaskPtr = &mailbox;
+    dispatcherDoorbell = &doorbell;
+    numCUs = 8;
+    VecSize = 64;
+
+    kernelDesc desc;
+    desc.name = "enqueue_stress";
+    desc.code = KERNEL_CODE;
+    desc.binary = nullptr;
+    desc.readonly = nullptr;
+    desc.readonlySize = 0;
+    desc.privateMemSize = 0;
+    desc.spillMemSize = 0;
+    desc.staticLdsSize = 0;
+    desc.sRegCount = 8;
+    desc.dRegCount = 0;
+    desc.cRegCount = 0;
+
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_int err;
+
+    clGetPlatformIDs(1, &platform, nullptr);
+    clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, nullptr);
+    cl_context context = clCreateContext(nullptr, 1, &device, nullptr,
+                                         nullptr, &err);
+    cl_command_queue queue = clCreateCommandQueue(context, device, 0, &err);
+    if (err != CL_SUCCESS) {
+        printf("clCreateCommandQueue returned %d\n", err);
+        return 1;
+    }
+
+    double base = 0;
+
+    printf("threads  launches/s  speedup\n");
+    for (int n = 1; n <= MAX_THREADS; n *= 2) {
+        double rate = runThreads(queue, &desc, n);
+        if (n == 1) {
+            base = rate;
+        }
+        printf("%7d  %10.0f  %7.2f\n", n, rate, rate / base);
+    }
+
+    return 0;
+}
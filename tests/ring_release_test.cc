@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2011-2015 Advanced Micro Devices, Inc.
+ * All rights reserved.
+ *
+ * For use for simulation and test purposes only
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Releases the event of every launch right after enqueueing it, from
+// several threads at once, so that most entries still wait in the queue's
+// submission ring when their event frees them. The ring has to publish
+// its own copies of the entries. The test includes the runtime to reach
+// its device parameters and redirects the dispatcher's mailbox to host
+// memory, so it runs without the simulator; build it with
+// AddressSanitizer to catch a publisher reading a freed entry.
+
+#include "../cl_runtime.cc"
+
+// the dispatcher's host state is never freed, and there is no dispatcher
+// here to finish the launches
+extern "C" const char *
+__asan_default_options()
+{
+    return "detect_leaks=0";
+}
+
+// stands in for the simulator's signal allocator
+__attribute__((weak)) _cl_event *
+hsa_signal_create()
+{
+    return new _cl_event();
+}
+
+static const int NUM_THREADS = 8;
+static const int LAUNCHES_PER_THREAD = 20000;
+static const uint8_t KERNEL_CODE[256] = { 0 };
+
+static HsaQueueEntry mailbox;
+static volatile uint32_t doorbell;
+static std::atomic<bool> running(true);
+static std::atomic<int> badEntries(0);
+
+// Look at whatever entry the mailbox holds between publications.
+static void
+checkMailbox()
+{
+    while (running) {
+        {
+            std::lock_guard<std::mutex> guard(dispatcherLock);
+            if (mailbox.code_ptr &&
+                mailbox.code_ptr != (uint64_t)KERNEL_CODE) {
+                ++badEntries;
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+int
+main()
+{
+    hsaTaskPtr = &mailbox;
+    dispatcherDoorbell = &doorbell;
+    numCUs = 8;
+    VecSize = 64;
+
+    kernelDesc desc;
+    desc.name = "ring_release";
+    desc.code = KERNEL_CODE;
+    desc.binary = nullptr;
+    desc.readonly = nullptr;
+    desc.readonlySize = 0;
+    desc.privateMemSize = 0;
+    desc.spillMemSize = 0;
+    desc.staticLdsSize = 0;
+    desc.sRegCount = 8;
+    desc.dRegCount = 0;
+    desc.cRegCount = 0;
+
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_int err;
+
+    clGetPlatformIDs(1, &platform, nullptr);
+    clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, nullptr);
+    cl_context context = clCreateContext(nullptr, 1, &device, nullptr,
+                                         nullptr, &err);
+    cl_command_queue queue = clCreateCommandQueue(context, device, 0, &err);
+    if (err != CL_SUCCESS) {
+        printf("FAIL: clCreateCommandQueue returned %d\n", err);
+        return 1;
+    }
+
+    _cl_kernel *kernel = new _cl_kernel(&desc);
+    std::thread checker(checkMailbox);
+    std::vector<std::thread> threads;
+    std::atomic<int> failed(0);
+
+    for (int t = 0; t < NUM_THREADS; ++t) {
+        threads.emplace_back([&] {
+            size_t global = 4096;
+            size_t local = 64;
+
+            for (int i = 0; i < LAUNCHES_PER_THREAD; ++i) {
+                cl_event event;
+
+                if (clEnqueueNDRangeKernel(queue, kernel, 1, nullptr,
+                                           &global, &local, 0, nullptr,
+                                           &event) != CL_SUCCESS) {
+                    ++failed;
+                    return;
+                }
+                clReleaseEvent(event);
+            }
+        });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    clFinish(queue);
+    running = false;
+    checker.join();
+    delete kernel;
+
+    if (failed || badEntries) {
+        printf("FAIL: %d launches failed, %d bad entries published\n",
+               (int)failed, (int)badEntries);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}